@@ -0,0 +1,366 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+// Batch runner: simulates many scenarios in parallel, each one in its own
+// machine. The scenarios are distributed between per-thread queues, each
+// worker takes scenarios from the back of its own queue and, when empty,
+// steals from the front of the other queues.
+
+#include "batch.h"
+#include "hw.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct scenario
+{
+    // Files from the manifest, NULL if "-"
+    char *rom;
+    char *flash;
+    char *input;
+    char *expect;
+    uint64_t limit;
+    unsigned line;
+    // Results
+    int pass;
+    const char *msg;
+    enum sim65_error err;
+    uint64_t cycles;
+    double time;
+};
+
+// Queue of scenarios of one worker
+struct queue
+{
+    pthread_mutex_t mutex;
+    unsigned *items;
+    unsigned head;
+    unsigned tail;
+};
+
+struct batch
+{
+    const struct batch_opts *opt;
+    struct scenario *sc;
+    unsigned count;
+    struct queue *queues;
+    unsigned nthreads;
+};
+
+struct worker
+{
+    struct batch *b;
+    unsigned id;
+    pthread_t thread;
+};
+
+static double get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Reads a full file, returns NULL on error
+static char *read_file(const char *fname, size_t *len)
+{
+    FILE *f = fopen(fname, "rb");
+    if (!f)
+        return 0;
+    size_t size = 4096, n = 0;
+    char *buf = malloc(size);
+    while (buf)
+    {
+        n += fread(buf + n, 1, size - n, f);
+        if (n < size)
+            break;
+        size *= 2;
+        char *nbuf = realloc(buf, size);
+        if (!nbuf)
+            free(buf);
+        buf = nbuf;
+    }
+    if (ferror(f))
+    {
+        free(buf);
+        buf = 0;
+    }
+    fclose(f);
+    *len = n;
+    return buf;
+}
+
+static void run_scenario(const struct batch_opts *opt, struct scenario *sc)
+{
+    char *in = 0, *out = 0, *expect = 0;
+    size_t in_len = 0, out_len = 0, expect_len = 0;
+    struct hw *hw = 0;
+    FILE *fout = 0;
+    double start = get_time();
+
+    sim65 s = sim65_new();
+    if (!s)
+    {
+        sc->msg = "internal error";
+        return;
+    }
+    sim65_set_error_level(s, opt->errlvl);
+    if (opt->jit)
+        sim65_set_jit(s, 1);
+
+    if (sc->input && !(in = read_file(sc->input, &in_len)))
+        sc->msg = "can't read input file";
+    else if (sc->expect && !(expect = read_file(sc->expect, &expect_len)))
+        sc->msg = "can't read expected output file";
+    else if (!(hw = hw_init(s, sc->flash)))
+        sc->msg = "can't read flash file";
+    else if (!(fout = open_memstream(&out, &out_len)))
+        sc->msg = "internal error";
+    else if (!(sc->msg = opt->rom_load(sc->rom, s)))
+    {
+        hw_set_vga_file(hw, 0);
+        hw_set_uart_buffer(hw, in, in_len, fout);
+
+        // Runs simulator from RESET pointer, or from the snapshot state
+        struct sim65_reg regs;
+        regs.pc = sim65_get_byte(s, 0xFFFC) + (sim65_get_byte(s, 0xFFFD) << 8);
+        if (opt->snapshot && hw_snapshot_load(hw, s, opt->snapshot, opt->snapshot_len))
+            sc->msg = "invalid snapshot file";
+        else
+        {
+            if (opt->snapshot)
+                sim65_get_regs(s, &regs);
+            sim65_set_cycle_limit(s, sc->limit);
+            sc->err = sim65_run(s, 0, regs.pc);
+            sc->cycles = sim65_get_cycles(s);
+            fclose(fout);
+            fout = 0;
+
+            // Without expected output, the scenario must run up to the limit
+            if (expect)
+                sc->pass = out_len == expect_len && !memcmp(out, expect, out_len);
+            else
+                sc->pass = sc->err == sim65_err_cycle_limit;
+            if (!sc->pass && expect)
+                sc->msg = "output differs";
+            else
+                sc->msg = sim65_error_str(s, sc->err);
+        }
+    }
+    if (fout)
+        fclose(fout);
+    hw_free(hw);
+    sim65_free(s);
+    free(out);
+    free(in);
+    free(expect);
+    sc->time = get_time() - start;
+}
+
+// Gets the next scenario for the worker, returns 0 if there are no more
+static int get_work(struct batch *b, unsigned id, unsigned *item)
+{
+    for (unsigned i = 0; i < b->nthreads; i++)
+    {
+        struct queue *q = &b->queues[(id + i) % b->nthreads];
+        int found = 0;
+        pthread_mutex_lock(&q->mutex);
+        if (q->head != q->tail)
+        {
+            // Own queue from the back, others from the front
+            if (!i)
+                *item = q->items[--q->tail];
+            else
+                *item = q->items[q->head++];
+            found = 1;
+        }
+        pthread_mutex_unlock(&q->mutex);
+        if (found)
+            return 1;
+    }
+    return 0;
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *w = arg;
+    unsigned item;
+    while (get_work(w->b, w->id, &item))
+        run_scenario(w->b->opt, &w->b->sc[item]);
+    return 0;
+}
+
+// Returns a copy of the field, or NULL if it is "-"
+static char *get_field(const char *field)
+{
+    if (!strcmp(field, "-"))
+        return 0;
+    return strdup(field);
+}
+
+// Reads the manifest, with one scenario per line:
+//   <rom> <flash> <input> <cycles> <expected>
+static int read_manifest(struct batch *b, const char *manifest)
+{
+    FILE *f = fopen(manifest, "r");
+    if (!f)
+    {
+        perror(manifest);
+        return -1;
+    }
+    char buf[4096];
+    unsigned line = 0, size = 0;
+    while (fgets(buf, sizeof(buf), f))
+    {
+        char *fld[6], *save;
+        unsigned n = 0;
+        line++;
+        for (char *p = strtok_r(buf, " \t\r\n", &save); p && n < 6;
+             p = strtok_r(0, " \t\r\n", &save))
+            fld[n++] = p;
+        if (!n || fld[0][0] == '#')
+            continue;
+        char *end;
+        uint64_t limit = n == 5 ? strtoull(fld[3], &end, 0) : 0;
+        // The cycle limit is required, without it a scenario that never
+        // fails would never return
+        if (n != 5 || *end || !limit)
+        {
+            fprintf(stderr, "%s:%u: invalid scenario\n", manifest, line);
+            fclose(f);
+            return -1;
+        }
+        if (b->count == size)
+        {
+            size = size ? size * 2 : 64;
+            struct scenario *sc = realloc(b->sc, size * sizeof(*sc));
+            if (!sc)
+            {
+                fclose(f);
+                return -1;
+            }
+            b->sc = sc;
+        }
+        struct scenario *sc = &b->sc[b->count++];
+        memset(sc, 0, sizeof(*sc));
+        sc->rom = get_field(fld[0]);
+        sc->flash = get_field(fld[1]);
+        sc->input = get_field(fld[2]);
+        sc->limit = limit;
+        sc->expect = get_field(fld[4]);
+        sc->line = line;
+    }
+    fclose(f);
+    return 0;
+}
+
+static void print_summary(const struct batch *b, const char *manifest, double time)
+{
+    unsigned passed = 0;
+    uint64_t cycles = 0;
+    for (unsigned i = 0; i < b->count; i++)
+    {
+        const struct scenario *sc = &b->sc[i];
+        printf("%s %s:%u: %s, %" PRIu64 " cycles, %.3f s.\n",
+               sc->pass ? "PASS" : "FAIL", manifest, sc->line, sc->msg,
+               sc->cycles, sc->time);
+        passed += sc->pass;
+        cycles += sc->cycles;
+    }
+    printf("Passed %u of %u scenarios, %" PRIu64 " cycles, %.3f s with %u threads.\n",
+           passed, b->count, cycles, time, b->nthreads);
+}
+
+int batch_run(const char *manifest, const struct batch_opts *opt)
+{
+    struct batch b = { .opt = opt };
+    int ret = -1;
+
+    if (read_manifest(&b, manifest))
+        goto end;
+
+    b.nthreads = opt->threads;
+    if (!b.nthreads)
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        b.nthreads = n > 0 ? n : 1;
+    }
+    if (b.nthreads > b.count)
+        b.nthreads = b.count ? b.count : 1;
+
+    // Distribute the scenarios between the queues
+    b.queues = calloc(b.nthreads, sizeof(struct queue));
+    struct worker *w = calloc(b.nthreads, sizeof(struct worker));
+    unsigned *items = calloc(b.count + 1, sizeof(unsigned));
+    if (!b.queues || !w || !items)
+    {
+        free(items);
+        free(w);
+        goto end;
+    }
+    for (unsigned i = 0, pos = 0; i < b.nthreads; i++)
+    {
+        struct queue *q = &b.queues[i];
+        pthread_mutex_init(&q->mutex, 0);
+        q->items = items + pos;
+        for (unsigned j = i; j < b.count; j += b.nthreads)
+            q->items[q->tail++] = j;
+        pos += q->tail;
+    }
+
+    double start = get_time();
+    unsigned started = 0;
+    for (unsigned i = 0; i < b.nthreads; i++)
+    {
+        w[i].b = &b;
+        w[i].id = i;
+        if (pthread_create(&w[i].thread, 0, worker_thread, &w[i]))
+            break;
+        started++;
+    }
+    // Runs in this thread if no worker could be created
+    if (!started)
+        worker_thread(&w[0]);
+    for (unsigned i = 0; i < started; i++)
+        pthread_join(w[i].thread, 0);
+
+    print_summary(&b, manifest, get_time() - start);
+    ret = 0;
+    for (unsigned i = 0; i < b.count; i++)
+        ret += !b.sc[i].pass;
+
+    for (unsigned i = 0; i < b.nthreads; i++)
+        pthread_mutex_destroy(&b.queues[i].mutex);
+    free(items);
+    free(w);
+end:
+    for (unsigned i = 0; i < b.count; i++)
+    {
+        free(b.sc[i].rom);
+        free(b.sc[i].flash);
+        free(b.sc[i].input);
+        free(b.sc[i].expect);
+    }
+    free(b.sc);
+    free(b.queues);
+    return ret;
+}
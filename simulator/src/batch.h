@@ -0,0 +1,39 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#pragma once
+
+#include "sim65.h"
+
+// Options for all the machines of a batch
+struct batch_opts
+{
+    unsigned threads;               // Worker threads, 0 for one per CPU
+    int jit;                        // Translate hot code to native code
+    enum sim65_error_lvl errlvl;
+    // Loads the ROM of a new machine, the file name is NULL for the default
+    // ROM. Returns the error message or NULL.
+    const char *(*rom_load)(const char *fname, sim65 s);
+    // Snapshot to start all the machines from, if not NULL
+    const void *snapshot;
+    size_t snapshot_len;
+};
+
+// Runs the scenarios listed in the manifest file, one machine per worker
+// thread, and prints a summary of the results to the standard output.
+// Returns the number of failed scenarios, or -1 if the manifest is invalid.
+int batch_run(const char *manifest, const struct batch_opts *opt);
@@ -0,0 +1,44 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+// Generates the decimal mode ADC and SBC tables of the 6502 core, from the
+// reference implementation in sim65_alu.h. The output is a C header.
+
+#include "sim65_alu.h"
+#include <stdio.h>
+
+static void print_table(const char *name, unsigned (*fn)(unsigned, unsigned, unsigned))
+{
+    unsigned i;
+    printf("static const uint16_t %s[ALU_TABLE_SIZE] = {\n", name);
+    for (i = 0; i < ALU_TABLE_SIZE; i++)
+    {
+        unsigned r = fn((i >> 8) & 0xFF, i & 0xFF, i >> 16);
+        printf("%s0x%04X,%s", (i & 15) ? "" : "    ", r, (i & 15) == 15 ? "\n" : "");
+    }
+    printf("};\n");
+}
+
+int main(void)
+{
+    printf("// Generated by gen_alu.c, do not edit.\n");
+    printf("// Indexed by ALU_INDEX(carry, A, value), see sim65_alu.h\n");
+    print_table("alu_adc_tab", alu_adc_dec);
+    print_table("alu_sbc_tab", alu_sbc_dec);
+    return 0;
+}
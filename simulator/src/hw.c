@@ -19,6 +19,7 @@
 #include "hw.h"
 
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <termios.h>
@@ -28,39 +29,198 @@
 #include <string.h>
 #include <utime.h>
 
+// Buffer shared copy-on-write between cloned machines
+struct shared
+{
+    unsigned refs;
+    size_t size;
+    uint8_t data[];
+};
+
+static struct shared *shared_new(size_t size)
+{
+    struct shared *b = malloc(sizeof(struct shared) + size);
+    if( !b )
+    {
+        perror("allocate memory");
+        exit(1);
+    }
+    b->refs = 1;
+    b->size = size;
+    return b;
+}
+
+static struct shared *shared_ref(struct shared *b)
+{
+    if( b )
+        __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+    return b;
+}
+
+static void shared_unref(struct shared *b)
+{
+    if( b && !__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) )
+        free(b);
+}
+
+// Returns the data to modify, copying the buffer if it is shared
+static uint8_t *shared_write(struct shared **pb)
+{
+    struct shared *b = *pb;
+    if( __atomic_load_n(&b->refs, __ATOMIC_ACQUIRE) > 1 )
+    {
+        *pb = shared_new(b->size);
+        memcpy((*pb)->data, b->data, b->size);
+        shared_unref(b);
+    }
+    return (*pb)->data;
+}
+
 // TIMER: $FE00 - $FE1F
+// The simulated timer can also raise an IRQ while the shot flag is set, if
+// enabled by writing bit 6 of the control register. The FPGA timer has no
+// IRQ output.
+struct timer
+{
+    uint16_t count0;
+    int active;
+    int shot;
+    int irq;
+    uint64_t event;             // Cycle of the pending event, 0 if none
+};
+
+// Source of the UART input
+enum uart_input
+{
+    uart_in_console = 0,
+    uart_in_buffer,             // Set by hw_set_uart_buffer
+    uart_in_replay              // Set by hw_set_uart_replay
+};
+
+// Byte received by the UART, -1 for the end of the input
+struct uart_rec
+{
+    uint64_t cycle;
+    int data;
+};
+
+struct uart
+{
+    uint64_t curr_tx;
+    unsigned init;
+    int tx_busy;
+    int next_rx;
+    int rx_ok;
+    int rx_eof;
+    uint64_t rx_event;          // Cycle of the pending RX event, 0 if none
+    enum uart_input input;
+    const uint8_t *in;
+    size_t in_len;
+    size_t in_pos;
+    struct shared *log;         // Array of struct uart_rec to replay
+    size_t log_pos;
+    FILE *out;                  // Output, standard output if NULL
+    FILE *record;               // Log of the received bytes, if not NULL
+};
+
+struct vga_info {
+    struct shared *bank[8];     // Video memory, in 8K banks
+    int terminate;
+    uint8_t *pmem;
+    unsigned vga_page;
+    unsigned hv_mode;
+    unsigned pix_height;
+    unsigned bitmap_base;
+    unsigned color_base;
+    unsigned font_base;
+    const char *fname;
+    int running;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+};
+
+struct spi
+{
+    int gen_cs;
+    int rx_valid;
+    int rx_data;
+    int rx_next;
+    int tx_data;
+    int tx_hold;
+    uint64_t nxt_cycle;
+    int spi_state;
+    int spi_cmd;
+    int spi_addr;
+    struct shared *flash;
+};
+
+struct ps2
+{
+    int rx_hold;
+    int rx_keycode;
+    int rx_ascii;
+    int shifts;
+    int code_ext;
+};
+
+// Devices of one simulated machine, passed to the callbacks as the
+// simulator user data.
+struct hw
+{
+    sim65 s;
+    struct timer timer;
+    struct uart uart;
+    struct vga_info vga;
+    struct spi spi;
+    struct ps2 ps2;
+};
+
+static struct hw *get_hw(sim65 s)
+{
+    return sim65_get_user_data(s);
+}
+
+// End of the count, the shot flag is set in the next cycle
+static int timer_event(sim65 s, void *data)
+{
+    struct timer *t = data;
+    t->event = 0;
+    t->shot = 1;
+    if( t->irq )
+        sim65_set_irq(s, 1);
+    return 0;
+}
+
 static int sim_timer(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
 {
     int reg = addr & 3;
 
-    static uint16_t count0 = 0;
-    static int active = 0;
-    static int shot = 0;
-    static unsigned next_shot = 0;
+    struct timer *t = &get_hw(s)->timer;
 
-    unsigned cycles = sim65_get_cycles(s);
+    uint64_t cycles = sim65_get_cycles(s);
 
-    uint16_t count = active ? (count0 - cycles) : count0;
+    uint16_t count = t->active ? (t->count0 - cycles) : t->count0;
 
-    if( next_shot && (cycles > next_shot) )
-        shot = 1;
+    // The status only changes at the scheduled event
+    if (data == sim65_cb_event)
+        return INT_MAX;
 
     if (data == sim65_cb_read)
     {
         switch( reg )
         {
             case 0:
-                return count0 & 0xFF;
+                return t->count0 & 0xFF;
             case 1:
-                return (count0 >> 8);
+                return (t->count0 >> 8);
             default:
-                return shot * 128 + active;
+                return t->shot * 128 + t->active;
         }
     }
     else
     {
         // Adds 1 if active, because HW misses the decrement.
-        count = count + (active?1:0);
+        count = count + (t->active?1:0);
 
         switch( reg )
         {
@@ -72,24 +232,28 @@ static int sim_timer(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
                 count = count + ((data & 0xFF) << 8);
                 break;
             default:
-                shot = !!(data & 0x80);
-                active = !!(data & 0x01);
-                if (!active)
+                t->shot = !!(data & 0x80);
+                t->irq = !!(data & 0x40);
+                t->active = !!(data & 0x01);
+                if (!t->active)
                     count = 0;
                 break;
         }
-        if( active )
+        if( t->active )
         {
-            count0 = count + cycles;
-            next_shot = cycles + count;
+            t->count0 = count + cycles;
+            t->event = cycles + count + 1;
+            sim65_schedule_event(s, t->event, timer_event, t);
         }
         else
         {
-            count0 = count;
-            next_shot = 0;
+            t->count0 = count;
+            t->event = 0;
+            sim65_cancel_event(s, timer_event, t);
         }
-//        fprintf(stderr,"TIMER: c=%04X s=%02x cy=%08X nx=%08X\n",
-//                count, active + 128*shot, cycles, next_shot);
+        sim65_set_irq(s, t->shot && t->irq);
+//        fprintf(stderr,"TIMER: c=%04X s=%02x cy=%08" PRIX64 "\n",
+//                count, t->active + 128*t->shot, cycles);
     }
     return 0;
 }
@@ -131,71 +295,139 @@ static void reset_term(void)
     set_raw_term(0);
 }
 
+// The console is shared by all the simulated machines, initialize it once
+static void init_stdin(void)
+{
+    static int stdin_init = 0;
+    if( stdin_init )
+        return;
+    stdin_init = 1;
+    if( isatty(STDIN_FILENO) )
+    {
+        // We have a TTY, set terminal properties
+        atexit(reset_term);
+        set_raw_term(1);
+    }
+    else
+    {
+        int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
+        fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
+    }
+}
+
 // UART: $FE20 - $FE3F
-static int sim_uart(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
+// Simulates TX/RX to console
+// UART is simulated at a fixed clock, at 115200 baud, with 12.5875MHz CPU clock,
+// we have TX/RX at 109 cycles per baud, 1090 cycles per word.
+#define UART_DIV 1090
+
+// End of the shift register, moves the hold register to the shift register
+static int uart_tx_event(sim65 s, void *data)
 {
-    // Simulates TX/RX to console
-    // UART is simulated at a fixed clock, at 115200 baud, with 12.5875MHz CPU clock,
-    // we have TX/RX at 109 cycles per baud, 1090 cycles per word.
-    const unsigned div = 1090;
+    struct uart *u = data;
+    u->curr_tx += UART_DIV;
+    u->tx_busy = 0;
+    return 0;
+}
 
-    int reg = addr & 1;
+static int uart_rx_event(sim65 s, void *data);
 
-    static unsigned curr_tx = 0;
-    static unsigned init = 0;
-    static int tx_busy = 0;
-    static int next_rx = -1;
-    static int rx_ok = 0;
+static void uart_rx_schedule(sim65 s, struct uart *u, uint64_t cycle)
+{
+    u->rx_event = cycle;
+    sim65_schedule_event(s, cycle, uart_rx_event, u);
+}
 
+// Reads the recorded input at the given cycle, returns 1 with a byte, 0 at
+// the end of the input and -1 if there is no byte at this cycle.
+static int uart_replay(struct uart *u, uint64_t cycle, char *ch)
+{
+    const struct uart_rec *r = (const struct uart_rec *)u->log->data;
+    if( u->log_pos >= u->log->size / sizeof(struct uart_rec) ||
+        r[u->log_pos].cycle > cycle )
+        return -1;
+    if( r[u->log_pos].data < 0 )
+        return 0;
+    *ch = r[u->log_pos++].data;
+    return 1;
+}
 
-    if( !init )
+// Polls the input once per word time while the receive register is empty
+static int uart_rx_event(sim65 s, void *data)
+{
+    struct uart *u = data;
+    // The input is recorded at the scheduled cycle, as the event can be
+    // called later depending on how the simulation is run.
+    uint64_t cycle = u->rx_event;
+    u->rx_event = 0;
+    char ch;
+    int n;
+    switch( u->input )
     {
-        // Init stdin
-        if( isatty(STDIN_FILENO) )
-        {
-            // We have a TTY, set terminal properties
-            atexit(reset_term);
-            set_raw_term(1);
-        }
-        else
-        {
-            int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
-            fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
-        }
-        init = 1;
+        case uart_in_buffer:
+            n = u->in_pos < u->in_len;
+            if( n )
+                ch = u->in[u->in_pos++];
+            break;
+        case uart_in_replay:
+            n = uart_replay(u, cycle, &ch);
+            break;
+        default:
+            n = read(STDIN_FILENO, &ch, 1);
+            break;
     }
-
-    unsigned cycles = sim65_get_cycles(s);
-
-    int tx_shift = curr_tx && (cycles < curr_tx);
-    if( !tx_shift && tx_busy )
+    if( n == 1 )
     {
-        curr_tx += div;
-        tx_shift = (cycles < curr_tx);
-        tx_busy = 0;
+        if( u->record )
+            fprintf(u->record, "%" PRIu64 " %d\n", cycle, ch & 0xFF);
+        u->next_rx = ch & 0xFF;
+        u->rx_ok = 1;
+        if( ch == 1) // CONTROL-A
+            return -1;
     }
+    else if( n == 0 && (u->input != uart_in_console || !isatty(STDIN_FILENO)) )
+    {
+        // End of the input file, stop polling so idle loops are skipped
+        // up to the next timer event.
+        if( u->record )
+            fprintf(u->record, "%" PRIu64 " -1\n", cycle);
+        u->rx_eof = 1;
+    }
+    else
+        uart_rx_schedule(s, u, sim65_get_cycles(s) + UART_DIV);
+    return 0;
+}
 
-    if ( !rx_ok )
+static int sim_uart(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
+{
+    int reg = addr & 1;
+
+    struct uart *u = &get_hw(s)->uart;
+
+    // The status only changes at the scheduled events
+    if (data == sim65_cb_event)
+        return INT_MAX;
+
+    if( !u->init )
     {
-        // Try to read a character
-        char ch;
-        if( read(STDIN_FILENO, &ch, 1) == 1 )
-        {
-            next_rx = ch & 0xFF;
-            rx_ok = (next_rx >= 0);
-            if( ch == 1) // CONTROL-A
-                return -1;
-        }
+        if( u->input == uart_in_console )
+            init_stdin();
+        u->init = 1;
+        uart_rx_schedule(s, u, sim65_get_cycles(s));
     }
 
+    uint64_t cycles = sim65_get_cycles(s);
+
+    int tx_shift = u->curr_tx && (cycles < u->curr_tx);
+
     if (data == sim65_cb_read)
     {
         switch( reg )
         {
             case 0:
-                return next_rx & 0xFF;
+                return u->next_rx & 0xFF;
             case 1:
-                return tx_busy * 128 + rx_ok * 64;
+                return u->tx_busy * 128 + u->rx_ok * 64;
         }
     }
     else
@@ -203,19 +435,28 @@ static int sim_uart(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
         switch( reg )
         {
             case 0:
-                if( tx_busy )
+                if( u->tx_busy )
                     fprintf(stderr, "\nUART: TX overrun, char lost\n");
                 // Simply output char
                 char c = data & 0xFF;
-                write(STDOUT_FILENO, &c, 1);
+                if( u->out )
+                    putc(c, u->out);
+                else
+                    write(STDOUT_FILENO, &c, 1);
                 // And add to the shift or hold register
                 if( !tx_shift )
-                    curr_tx = cycles + div;
+                    u->curr_tx = cycles + UART_DIV;
                 else
-                    tx_busy = 1;
+                {
+                    u->tx_busy = 1;
+                    sim65_schedule_event(s, u->curr_tx, uart_tx_event, u);
+                }
                 break;
             case 1:
-                rx_ok = 0;
+                // Next character is received after one word time
+                if( u->rx_ok && !u->rx_eof )
+                    uart_rx_schedule(s, u, cycles + UART_DIV);
+                u->rx_ok = 0;
                 break;
         }
     }
@@ -227,27 +468,15 @@ static int sim_uart(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
 static int sim_led(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
 {
     // TODO: not simulated yet
-    if (data == sim65_cb_read)
+    if (data == sim65_cb_event)
+        return INT_MAX;
+    else if (data == sim65_cb_read)
         return 0xFF;
     else
         return 0;
 }
 
 // VGA thread - updates video image file
-struct vga_info {
-    uint8_t *mem;
-    int terminate;
-    uint8_t *pmem;
-    unsigned vga_page;
-    unsigned hv_mode;
-    unsigned pix_height;
-    unsigned bitmap_base;
-    unsigned color_base;
-    unsigned font_base;
-    pthread_t thread;
-    pthread_mutex_t mutex;
-};
-
 enum vga_hv_mode {
     VGA_HMODE_TEXT  = 0,
     VGA_HMODE_HIRES = 1,
@@ -255,6 +484,11 @@ enum vga_hv_mode {
     VGA_HMODE_LORES = 3
 };
 
+static uint8_t vram_get(const struct vga_info *v, unsigned addr)
+{
+    return v->bank[(addr >> 13) & 7]->data[addr & 8191];
+}
+
 static void vga_gen_line(uint8_t *buf, struct vga_info *v, unsigned baddr, unsigned line)
 {
     static uint8_t palR[16] = {   0,   0,   0,   0, 150, 150, 150, 150, 104, 104, 104, 104, 255, 255, 255, 255};
@@ -267,9 +501,9 @@ static void vga_gen_line(uint8_t *buf, struct vga_info *v, unsigned baddr, unsig
         {
             for(int col = 0; col < 80; col ++)
             {
-                uint8_t ch = v->mem[(v->bitmap_base + baddr + col) & 0xFFFF];
-                uint8_t c = v->mem[(v->color_base + baddr + col) & 0xFFFF];
-                uint8_t b = v->mem[((v->font_base + line) * 256 + ch) & 0xFFFF];
+                uint8_t ch = vram_get(v, (v->bitmap_base + baddr + col));
+                uint8_t c = vram_get(v, (v->color_base + baddr + col));
+                uint8_t b = vram_get(v, ((v->font_base + line) * 256 + ch));
                 for(int i=0; i<8; i++)
                 {
                     *buf++ = (b & 1) ? palR[c&15] : palR[c>>4];
@@ -284,8 +518,8 @@ static void vga_gen_line(uint8_t *buf, struct vga_info *v, unsigned baddr, unsig
         {
             for(int col = 0; col < 80; col ++)
             {
-                uint8_t b = v->mem[(v->bitmap_base + baddr + col) & 0xFFFF];
-                uint8_t c = v->mem[(v->color_base + baddr + col) & 0xFFFF];
+                uint8_t b = vram_get(v, (v->bitmap_base + baddr + col));
+                uint8_t c = vram_get(v, (v->color_base + baddr + col));
                 for(int i=0; i<8; i++)
                 {
                     *buf++ = (b & 1) ? palR[c&15] : palR[c>>4];
@@ -300,7 +534,7 @@ static void vga_gen_line(uint8_t *buf, struct vga_info *v, unsigned baddr, unsig
         {
             for(int col = 0; col < 160; col ++)
             {
-                uint8_t b = v->mem[(v->bitmap_base + baddr + col) & 0xFFFF];
+                uint8_t b = vram_get(v, (v->bitmap_base + baddr + col));
                 *buf++ = palR[b&15];
                 *buf++ = palG[b&15];
                 *buf++ = palB[b&15];
@@ -314,8 +548,8 @@ static void vga_gen_line(uint8_t *buf, struct vga_info *v, unsigned baddr, unsig
         {
             for(int col = 0; col < 40; col ++)
             {
-                uint8_t b = v->mem[(v->bitmap_base + baddr + col) & 0xFFFF];
-                uint8_t c = v->mem[(v->color_base + baddr + col) & 0xFFFF];
+                uint8_t b = vram_get(v, (v->bitmap_base + baddr + col));
+                uint8_t c = vram_get(v, (v->color_base + baddr + col));
                 for(int i=0; i<8; i++)
                 {
                     *buf++ = (b & 1) ? palR[c&15] : palR[c>>4];
@@ -335,7 +569,7 @@ static void vga_gen_line(uint8_t *buf, struct vga_info *v, unsigned baddr, unsig
 static void * vga_thread(void *arg)
 {
     struct vga_info *v = (struct vga_info *)arg;
-    const char *fname = "my6502_sim-vga.ppm";
+    const char *fname = v->fname;
     const unsigned fsize = 15 * 64 * 1024;
 
     // Opens and maps external video file
@@ -373,12 +607,10 @@ static void * vga_thread(void *arg)
     while( 0 == __atomic_load_n( &(v->terminate), __ATOMIC_ACQUIRE) )
     {
         usleep(20000);
-        // Lock memory
+        // Lock memory, the banks can be replaced by copies while unlocked
         pthread_mutex_lock(&v->mutex);
         // Move memory out from CPU
-        memcpy(v->mem + (v->vga_page & 7) * 8192, v->pmem, 8192);
-        // Unlock memory
-        pthread_mutex_unlock(&v->mutex);
+        memcpy(shared_write(&v->bank[v->vga_page & 7]), v->pmem, 8192);
         // Generate RGB image
         int lcount = 0, xaddr = 0;
         for(int y=0; y<480; y++)
@@ -398,43 +630,50 @@ static void * vga_thread(void *arg)
                 lcount ++;
 
         }
+        // Unlock memory
+        pthread_mutex_unlock(&v->mutex);
         // Sync RAM to file
         msync(faddr, fsize, MS_ASYNC);
     }
 
-    // Terminate program
+    // Terminate thread
+    munmap(faddr, fsize);
+    close(fd);
     return 0;
 }
 
-// VGA: $FE60 - $FE7F
-static int sim_vga(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
+static void vga_init(sim65 s, struct vga_info *v)
 {
-    // VGA state
-    static struct vga_info v = {
-        .mem = 0,
-        .pmem = 0,
-        .terminate = 0,
-        .vga_page = 0,
-        .hv_mode = 0,
-        .pix_height = 15,
-        .bitmap_base = 0,
-        .color_base = 4096,
-        .font_base = 32,
-        .thread = 0
-    };
-
-    // Init VGA
-    if (!v.mem)
+    for(int i=0; i<8; i++)
+    {
+        v->bank[i] = shared_new(8192);
+        memset(v->bank[i]->data, 0, 8192);
+    }
+    v->pmem = sim65_get_pbyte(s, 0xD000);
+    pthread_mutex_init(&v->mutex, 0);
+    if (v->fname)
     {
-        v.mem = calloc(65536, 1);
-        v.pmem = sim65_get_pbyte(s, 0xD000);
-        pthread_mutex_init(&v.mutex, 0);
-        if (0 != pthread_create(&(v.thread), 0, vga_thread, &v))
+        if (0 != pthread_create(&(v->thread), 0, vga_thread, v))
         {
             perror("create vga thread");
             exit(1);
         }
+        v->running = 1;
     }
+}
+
+// VGA: $FE60 - $FE7F
+static int sim_vga(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
+{
+    struct vga_info *v = &get_hw(s)->vga;
+
+    // Registers never change by themselves
+    if (data == sim65_cb_event)
+        return INT_MAX;
+
+    // Init VGA
+    if (!v->bank[0])
+        vga_init(s, v);
 
     addr &= 7;      // 3 address bits
     if (data == sim65_cb_read)
@@ -446,39 +685,40 @@ static int sim_vga(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
             case 0:     // VGAPAGE
                 {
                     unsigned new_page = data & 7;
-                    if( new_page != v.vga_page )
+                    if( new_page != v->vga_page )
                     {
                         // Lock memory
-                        pthread_mutex_lock(&v.mutex);
+                        pthread_mutex_lock(&v->mutex);
                         // Move memory out from CPU
-                        memcpy(v.mem + (v.vga_page & 7) * 8192, v.pmem, 8192);
+                        memcpy(shared_write(&v->bank[v->vga_page & 7]), v->pmem, 8192);
                         // Update page
-                        v.vga_page = new_page;
+                        v->vga_page = new_page;
                         // Move new page in to CPU
-                        memcpy(v.pmem, v.mem + (v.vga_page & 7) * 8192, 8192);
+                        memcpy(v->pmem, v->bank[v->vga_page & 7]->data, 8192);
+                        sim65_mem_changed(s, 0xD000, 8192);
                         // Unlock memory
-                        pthread_mutex_unlock(&v.mutex);
+                        pthread_mutex_unlock(&v->mutex);
                     }
                 }
                 break;
             case 1:     // VGAMODE
-                v.hv_mode = data & 3;
-                v.pix_height = (data >> 3) & 31;
+                v->hv_mode = data & 3;
+                v->pix_height = (data >> 3) & 31;
                 break;
             case 2:     // VGAGBASE_L
-                v.bitmap_base = (v.bitmap_base & 0xFF00) | (data & 0xFF);
+                v->bitmap_base = (v->bitmap_base & 0xFF00) | (data & 0xFF);
                 break;
             case 3:     // VGAGBASE_H
-                v.bitmap_base = (v.bitmap_base & 0xFF) | ((data << 8) & 0xFF00);
+                v->bitmap_base = (v->bitmap_base & 0xFF) | ((data << 8) & 0xFF00);
                 break;
             case 4:     // VGACBASE_L
-                v.color_base = (v.color_base & 0xFF00) | (data & 0xFF);
+                v->color_base = (v->color_base & 0xFF00) | (data & 0xFF);
                 break;
             case 5:     // VGACBASE_H
-                v.color_base = (v.color_base & 0xFF) | ((data << 8) & 0xFF00);
+                v->color_base = (v->color_base & 0xFF) | ((data << 8) & 0xFF00);
                 break;
             case 6:     // VGAFBASE
-                v.font_base = data & 0xFF;
+                v->font_base = data & 0xFF;
                 break;
             case 7:     // unused
                 break;
@@ -488,57 +728,57 @@ static int sim_vga(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
 }
 
 // SPI: $FE80 - $FE9F
-static uint8_t *spi_flash;
 #define FLASH_SIZE (2*1024*1024)
 static int sim_spi(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
 {
-    static int gen_cs = 1;
-    static int rx_valid = 0;
-    static int rx_data = 0;
-    static int rx_next = 0;
-    static int tx_data = 0;
-    static int tx_hold = 0;
-    static unsigned nxt_cycle = 0;
+    struct spi *p = &get_hw(s)->spi;
 
-    static int spi_state = 0;
-    static int spi_cmd  = 0;
-    static int spi_addr = 0;
+    uint64_t cycles = sim65_get_cycles(s);
 
-    unsigned cycles = sim65_get_cycles(s);
-    if ( (cycles - nxt_cycle) < INT_MAX )
+    // Data and status change at the next byte cycle
+    if (data == sim65_cb_event)
     {
-        rx_data = rx_next;
-        if( tx_hold )
-            nxt_cycle += 16;
+        if ( cycles >= p->nxt_cycle )
+            return 0;
+        // The event return is an int, and nxt_cycle is UINT64_MAX when no
+        // transfer is pending, so clamp the wait instead of truncating it.
+        return (p->nxt_cycle - cycles) < INT_MAX ? p->nxt_cycle - cycles : INT_MAX;
+    }
+
+    if ( cycles >= p->nxt_cycle )
+    {
+        p->rx_data = p->rx_next;
+        if( p->tx_hold )
+            p->nxt_cycle += 16;
         else
-            nxt_cycle = cycles + INT_MAX;
-        if ( tx_hold )
+            p->nxt_cycle = UINT64_MAX;
+        if ( p->tx_hold )
         {
             // perform read/writes instantly
-            rx_next = 0xFF;
-            tx_hold = 0;
-            rx_valid = !rx_valid;
-            if( gen_cs )
+            p->rx_next = 0xFF;
+            p->tx_hold = 0;
+            p->rx_valid = !p->rx_valid;
+            if( p->gen_cs )
             {
-                spi_state = -4;
-                spi_cmd = tx_data;
-                spi_addr = 0;
-                rx_valid = 0;
-                gen_cs = 0;
-                if( spi_cmd != 0x03 )
-                    sim65_eprintf(s, "spi: unimplemented command $%02X\n", spi_cmd);
+                p->spi_state = -4;
+                p->spi_cmd = p->tx_data;
+                p->spi_addr = 0;
+                p->rx_valid = 0;
+                p->gen_cs = 0;
+                if( p->spi_cmd != 0x03 )
+                    sim65_eprintf(s, "spi: unimplemented command $%02X\n", p->spi_cmd);
             }
             else
             {
-                spi_state ++;
-                if( spi_state < 0 )
-                    spi_addr = (spi_addr << 8) | tx_data;
+                p->spi_state ++;
+                if( p->spi_state < 0 )
+                    p->spi_addr = (p->spi_addr << 8) | p->tx_data;
                 else
                 {
                     // TODO: all commands are implemented as READ MEM
-                    if( spi_flash )
-                        rx_next = spi_flash[spi_addr];
-                    spi_addr = (spi_addr + 1) & (FLASH_SIZE-1);
+                    if( p->flash )
+                        p->rx_next = p->flash->data[p->spi_addr];
+                    p->spi_addr = (p->spi_addr + 1) & (FLASH_SIZE-1);
                 }
             }
         }
@@ -550,9 +790,9 @@ static int sim_spi(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
         switch (addr)
         {
             case 0:
-                return (tx_hold << 7) | (rx_valid << 6) | gen_cs;
+                return (p->tx_hold << 7) | (p->rx_valid << 6) | p->gen_cs;
             case 1:
-                return rx_data;
+                return p->rx_data;
             default:
                 return 0xFF;
         }
@@ -560,14 +800,13 @@ static int sim_spi(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
         switch (addr)
         {
             case 0:
-                gen_cs = 1;
+                p->gen_cs = 1;
                 break;
             case 1:
-                tx_data = data & 0xFF;
-                tx_hold = 1;
-                nxt_cycle = cycles + 16;
-                if ( (cycles - nxt_cycle) > 32 )
-                    nxt_cycle = 1;
+                p->tx_data = data & 0xFF;
+                p->tx_hold = 1;
+                // Transfers complete immediately, at the next access
+                p->nxt_cycle = cycles;
                 break;
         }
 
@@ -584,93 +823,449 @@ static int parity(int n)
 // PS2: $FEA0 - $FEBF
 static int sim_ps2(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
 {
-    static int rx_hold = 0;
-    static int rx_keycode = 0;
-    static int rx_ascii = 0;
-    static int shifts = 0;
-    static int code_ext = 0;
+    struct ps2 *k = &get_hw(s)->ps2;
 
     addr = addr & 3;    // 2 bits valid
 
     // TODO: only simulates the key pressed, ignores timing
-    if (data == sim65_cb_read)
+    if (data == sim65_cb_event)
+        return INT_MAX;
+    else if (data == sim65_cb_read)
     {
         switch(addr)
         {
             case 0:
                 {
                     int code_rel = 0;
-                    int rx_parity = parity(rx_keycode);
-                    return (rx_hold<<7) | (code_rel<<6) | (rx_parity<<5) |
-                           (code_ext<<4) | shifts;
+                    int rx_parity = parity(k->rx_keycode);
+                    return (k->rx_hold<<7) | (code_rel<<6) | (rx_parity<<5) |
+                           (k->code_ext<<4) | k->shifts;
                 }
             case 1:
-                return rx_keycode;
+                return k->rx_keycode;
             case 2:
-                return 128 | rx_ascii;
+                return 128 | k->rx_ascii;
             default:
                 return 0xFF;
         }
     }
     else
     {
-        rx_hold = 0;
+        k->rx_hold = 0;
         return 0;
     }
 }
 
 // Load flash
-static void flash_load(const char *fname)
+static int flash_load(struct spi *p, const char *fname)
 {
-    spi_flash = malloc(FLASH_SIZE);
-    if( !spi_flash )
-    {
-        perror("allocate flash");
-        exit(1);
-    }
-    for(int i=0; i<FLASH_SIZE; i++)
-        spi_flash[i] = 0xFF;
+    p->flash = shared_new(FLASH_SIZE);
+    memset(p->flash->data, 0xFF, FLASH_SIZE);
+    if( !fname )
+        return 0;
 
     FILE *f = fopen(fname, "rb");
     if (!f)
     {
         perror("firmware");
         fprintf(stderr, "can't open firmware file.\n");
-        exit(1);
+        return -1;
     }
 
     int c, addr = 128*1024;
     while ((addr < FLASH_SIZE) && (EOF != (c = getc(f))))
     {
-        spi_flash[addr] = c;
+        p->flash->data[addr] = c;
         addr++;
     }
     fclose(f);
+    return 0;
 }
 
 // Initialize hardware
-enum sim65_error hw_init(sim65 s, const char *fname)
+struct hw *hw_init(sim65 s, const char *fname)
 {
+    struct hw *hw = calloc(1, sizeof(struct hw));
+    if( !hw )
+        return 0;
+
+    // Reset state of the devices
+    hw->uart.next_rx = -1;
+    hw->vga.pix_height = 15;
+    hw->vga.color_base = 4096;
+    hw->vga.font_base = 32;
+    hw->vga.fname = "my6502_sim-vga.ppm";
+    hw->spi.gen_cs = 1;
+
     // Load firmware
-    flash_load(fname);
+    if( flash_load(&hw->spi, fname) )
+    {
+        hw_free(hw);
+        return 0;
+    }
 
     // Adds RAM
     sim65_add_ram(s, 0, 0xFE00);
     sim65_add_zeroed_ram(s, 0xD000, 0x2000);
 
     // Add hardware callbacks
+    hw->s = s;
+    sim65_set_user_data(s, hw);
     sim65_add_callback_range(s, 0xFE00, 0x20, sim_timer, sim65_cb_read);
     sim65_add_callback_range(s, 0xFE00, 0x20, sim_timer, sim65_cb_write);
+    sim65_add_callback_range(s, 0xFE00, 0x20, sim_timer, sim65_cb_event);
     sim65_add_callback_range(s, 0xFE20, 0x20, sim_uart, sim65_cb_read);
     sim65_add_callback_range(s, 0xFE20, 0x20, sim_uart, sim65_cb_write);
+    sim65_add_callback_range(s, 0xFE20, 0x20, sim_uart, sim65_cb_event);
     sim65_add_callback_range(s, 0xFE40, 0x20, sim_led, sim65_cb_read);
     sim65_add_callback_range(s, 0xFE40, 0x20, sim_led, sim65_cb_write);
+    sim65_add_callback_range(s, 0xFE40, 0x20, sim_led, sim65_cb_event);
     sim65_add_callback_range(s, 0xFE60, 0x20, sim_vga, sim65_cb_read);
     sim65_add_callback_range(s, 0xFE60, 0x20, sim_vga, sim65_cb_write);
+    sim65_add_callback_range(s, 0xFE60, 0x20, sim_vga, sim65_cb_event);
     sim65_add_callback_range(s, 0xFE80, 0x20, sim_spi, sim65_cb_read);
     sim65_add_callback_range(s, 0xFE80, 0x20, sim_spi, sim65_cb_write);
+    sim65_add_callback_range(s, 0xFE80, 0x20, sim_spi, sim65_cb_event);
     sim65_add_callback_range(s, 0xFEA0, 0x20, sim_ps2, sim65_cb_read);
     sim65_add_callback_range(s, 0xFEA0, 0x20, sim_ps2, sim65_cb_write);
+    sim65_add_callback_range(s, 0xFEA0, 0x20, sim_ps2, sim65_cb_event);
+    return hw;
+}
+
+// Stops the VGA thread and frees the devices
+void hw_free(struct hw *hw)
+{
+    if( !hw )
+        return;
+    if( hw->vga.running )
+    {
+        __atomic_store_n(&hw->vga.terminate, 1, __ATOMIC_RELEASE);
+        pthread_join(hw->vga.thread, 0);
+    }
+    if( hw->vga.bank[0] )
+    {
+        pthread_mutex_destroy(&hw->vga.mutex);
+        for(int i=0; i<8; i++)
+            shared_unref(hw->vga.bank[i]);
+    }
+    shared_unref(hw->spi.flash);
+    shared_unref(hw->uart.log);
+    free(hw);
+}
+
+// Schedules the pending device events again, after the simulator state was
+// restored from a snapshot or cloned.
+static void hw_schedule_events(struct hw *hw)
+{
+    struct timer *t = &hw->timer;
+    struct uart *u = &hw->uart;
+    if( t->event )
+        sim65_schedule_event(hw->s, t->event, timer_event, t);
+    if( u->tx_busy )
+        sim65_schedule_event(hw->s, u->curr_tx, uart_tx_event, u);
+    if( u->rx_event )
+        uart_rx_schedule(hw->s, u, u->rx_event);
+}
+
+// Restarts polling if the old input ended, after changing the input
+static void uart_restart(struct hw *hw)
+{
+    struct uart *u = &hw->uart;
+    if( u->init && u->rx_eof )
+    {
+        u->rx_eof = 0;
+        if( !u->rx_ok && !u->rx_event )
+            uart_rx_schedule(hw->s, u, sim65_get_cycles(hw->s));
+    }
+}
+
+struct hw *hw_clone(struct hw *hw, sim65 s)
+{
+    struct hw *c = malloc(sizeof(struct hw));
+    if( !c )
+        return 0;
+    memcpy(c, hw, sizeof(struct hw));
+    c->s = s;
+    shared_ref(c->spi.flash);
+    shared_ref(c->uart.log);
+    c->uart.record = 0;
+
+    // Video memory is shared, but not the image file
+    struct vga_info *v = &c->vga;
+    v->fname = 0;
+    v->running = 0;
+    v->terminate = 0;
+    if( v->bank[0] )
+    {
+        pthread_mutex_lock(&hw->vga.mutex);
+        for(int i=0; i<8; i++)
+            v->bank[i] = shared_ref(hw->vga.bank[i]);
+        pthread_mutex_unlock(&hw->vga.mutex);
+        v->pmem = sim65_get_pbyte(s, 0xD000);
+        pthread_mutex_init(&v->mutex, 0);
+    }
+
+    sim65_set_user_data(s, c);
+    hw_schedule_events(c);
+    return c;
+}
+
+void hw_set_uart_buffer(struct hw *hw, const void *in, size_t len, FILE *out)
+{
+    struct uart *u = &hw->uart;
+    u->input = uart_in_buffer;
+    u->in = in;
+    u->in_len = len;
+    u->in_pos = 0;
+    u->out = out;
+    uart_restart(hw);
+}
+
+void hw_set_uart_output(struct hw *hw, FILE *out)
+{
+    hw->uart.out = out;
+}
+
+void hw_set_uart_record(struct hw *hw, FILE *f)
+{
+    hw->uart.record = f;
+}
+
+int hw_set_uart_replay(struct hw *hw, const char *fname)
+{
+    FILE *f = fopen(fname, "r");
+    if( !f )
+    {
+        perror(fname);
+        return -1;
+    }
+    size_t n = 0, size = 256;
+    struct shared *log = shared_new(size * sizeof(struct uart_rec));
+    struct uart_rec r;
+    while( 2 == fscanf(f, "%" SCNu64 " %d", &r.cycle, &r.data) )
+    {
+        if( n == size )
+        {
+            struct shared *nlog = shared_new(2 * size * sizeof(struct uart_rec));
+            memcpy(nlog->data, log->data, size * sizeof(struct uart_rec));
+            shared_unref(log);
+            log = nlog;
+            size *= 2;
+        }
+        ((struct uart_rec *)log->data)[n++] = r;
+    }
+    int err = !feof(f);
+    fclose(f);
+    if( err )
+    {
+        fprintf(stderr, "%s: invalid UART record file\n", fname);
+        shared_unref(log);
+        return -1;
+    }
+    log->size = n * sizeof(struct uart_rec);
+
+    struct uart *u = &hw->uart;
+    shared_unref(u->log);
+    u->input = uart_in_replay;
+    u->log = log;
+    u->log_pos = 0;
+    uart_restart(hw);
+    return 0;
+}
+
+void hw_set_vga_file(struct hw *hw, const char *fname)
+{
+    hw->vga.fname = fname;
+}
+
+// Snapshot of the devices, stored after the simulator snapshot in host byte
+// order. The UART input source and the VGA image file are not stored.
+#define HW_SNAPSHOT_MAGIC "my65hw"
+#define HW_SNAPSHOT_VERSION 1
+struct hw_snapshot
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t size;              // Size of this struct
+    // Timer
+    uint64_t timer_event;
+    int32_t timer_count0;
+    int32_t timer_active;
+    int32_t timer_shot;
+    int32_t timer_irq;
+    // UART
+    uint64_t uart_curr_tx;
+    uint64_t uart_rx_event;
+    int32_t uart_init;
+    int32_t uart_tx_busy;
+    int32_t uart_next_rx;
+    int32_t uart_rx_ok;
+    // VGA
+    int32_t vga_init;
+    int32_t vga_page;
+    int32_t vga_hv_mode;
+    int32_t vga_pix_height;
+    int32_t vga_bitmap_base;
+    int32_t vga_color_base;
+    int32_t vga_font_base;
+    // SPI
+    uint64_t spi_nxt_cycle;
+    int32_t spi_gen_cs;
+    int32_t spi_rx_valid;
+    int32_t spi_rx_data;
+    int32_t spi_rx_next;
+    int32_t spi_tx_data;
+    int32_t spi_tx_hold;
+    int32_t spi_state;
+    int32_t spi_cmd;
+    int32_t spi_addr;
+    // PS2
+    int32_t ps2_rx_hold;
+    int32_t ps2_rx_keycode;
+    int32_t ps2_rx_ascii;
+    int32_t ps2_shifts;
+    int32_t ps2_code_ext;
+    uint8_t vram[65536];
+    uint8_t flash[FLASH_SIZE];
+};
+
+int hw_snapshot_save(struct hw *hw, sim65 s, FILE *f)
+{
+    struct hw_snapshot *sn = calloc(1, sizeof(struct hw_snapshot));
+    if( !sn )
+        return -1;
+    memcpy(sn->magic, HW_SNAPSHOT_MAGIC, sizeof(HW_SNAPSHOT_MAGIC));
+    sn->version = HW_SNAPSHOT_VERSION;
+    sn->size = sizeof(struct hw_snapshot);
+
+    sn->timer_event = hw->timer.event;
+    sn->timer_count0 = hw->timer.count0;
+    sn->timer_active = hw->timer.active;
+    sn->timer_shot = hw->timer.shot;
+    sn->timer_irq = hw->timer.irq;
+
+    sn->uart_curr_tx = hw->uart.curr_tx;
+    sn->uart_rx_event = hw->uart.rx_event;
+    sn->uart_init = hw->uart.init;
+    sn->uart_tx_busy = hw->uart.tx_busy;
+    sn->uart_next_rx = hw->uart.next_rx;
+    sn->uart_rx_ok = hw->uart.rx_ok;
+
+    struct vga_info *v = &hw->vga;
+    if( v->bank[0] )
+    {
+        sn->vga_init = 1;
+        pthread_mutex_lock(&v->mutex);
+        for(int i=0; i<8; i++)
+            memcpy(sn->vram + i * 8192, v->bank[i]->data, 8192);
+        pthread_mutex_unlock(&v->mutex);
+        // The current page is in the CPU memory
+        memcpy(sn->vram + (v->vga_page & 7) * 8192, v->pmem, 8192);
+    }
+    sn->vga_page = v->vga_page;
+    sn->vga_hv_mode = v->hv_mode;
+    sn->vga_pix_height = v->pix_height;
+    sn->vga_bitmap_base = v->bitmap_base;
+    sn->vga_color_base = v->color_base;
+    sn->vga_font_base = v->font_base;
+
+    struct spi *p = &hw->spi;
+    sn->spi_nxt_cycle = p->nxt_cycle;
+    sn->spi_gen_cs = p->gen_cs;
+    sn->spi_rx_valid = p->rx_valid;
+    sn->spi_rx_data = p->rx_data;
+    sn->spi_rx_next = p->rx_next;
+    sn->spi_tx_data = p->tx_data;
+    sn->spi_tx_hold = p->tx_hold;
+    sn->spi_state = p->spi_state;
+    sn->spi_cmd = p->spi_cmd;
+    sn->spi_addr = p->spi_addr;
+    memcpy(sn->flash, p->flash->data, FLASH_SIZE);
+
+    sn->ps2_rx_hold = hw->ps2.rx_hold;
+    sn->ps2_rx_keycode = hw->ps2.rx_keycode;
+    sn->ps2_rx_ascii = hw->ps2.rx_ascii;
+    sn->ps2_shifts = hw->ps2.shifts;
+    sn->ps2_code_ext = hw->ps2.code_ext;
+
+    int ret = sim65_snapshot_save(s, f);
+    if( !ret && fwrite(sn, sizeof(struct hw_snapshot), 1, f) != 1 )
+        ret = -1;
+    free(sn);
+    return ret;
+}
+
+int hw_snapshot_load(struct hw *hw, sim65 s, const void *data, size_t len)
+{
+    size_t pos = sim65_snapshot_load(s, data, len);
+    const struct hw_snapshot *sn = (const void *)((const char *)data + pos);
+    if( !pos || len - pos < sizeof(struct hw_snapshot) ||
+        memcmp(sn->magic, HW_SNAPSHOT_MAGIC, sizeof(HW_SNAPSHOT_MAGIC)) ||
+        sn->version != HW_SNAPSHOT_VERSION || sn->size != sizeof(struct hw_snapshot) )
+        return -1;
+
+    struct timer *t = &hw->timer;
+    t->event = sn->timer_event;
+    t->count0 = sn->timer_count0;
+    t->active = sn->timer_active;
+    t->shot = sn->timer_shot;
+    t->irq = sn->timer_irq;
+
+    struct uart *u = &hw->uart;
+    u->curr_tx = sn->uart_curr_tx;
+    u->init = sn->uart_init;
+    u->tx_busy = sn->uart_tx_busy;
+    u->next_rx = sn->uart_next_rx;
+    u->rx_ok = sn->uart_rx_ok;
+    u->rx_event = sn->uart_rx_event;
+    // The input source is new, so polling restarts if it was at the end
+    u->rx_eof = 0;
+    if( u->init )
+    {
+        if( u->input == uart_in_console )
+            init_stdin();
+        if( !u->rx_event && !u->rx_ok )
+            u->rx_event = sim65_get_cycles(s);
+    }
+
+    struct vga_info *v = &hw->vga;
+    if( sn->vga_init && !v->bank[0] )
+        vga_init(s, v);
+    if( v->bank[0] )
+    {
+        pthread_mutex_lock(&v->mutex);
+        for(int i=0; i<8; i++)
+            memcpy(shared_write(&v->bank[i]), sn->vram + i * 8192, 8192);
+        v->vga_page = sn->vga_page;
+        v->hv_mode = sn->vga_hv_mode;
+        v->pix_height = sn->vga_pix_height;
+        v->bitmap_base = sn->vga_bitmap_base;
+        v->color_base = sn->vga_color_base;
+        v->font_base = sn->vga_font_base;
+        pthread_mutex_unlock(&v->mutex);
+    }
+
+    struct spi *p = &hw->spi;
+    p->nxt_cycle = sn->spi_nxt_cycle;
+    p->gen_cs = sn->spi_gen_cs;
+    p->rx_valid = sn->spi_rx_valid;
+    p->rx_data = sn->spi_rx_data;
+    p->rx_next = sn->spi_rx_next;
+    p->tx_data = sn->spi_tx_data;
+    p->tx_hold = sn->spi_tx_hold;
+    p->spi_state = sn->spi_state;
+    p->spi_cmd = sn->spi_cmd;
+    p->spi_addr = sn->spi_addr;
+    memcpy(shared_write(&p->flash), sn->flash, FLASH_SIZE);
+
+    hw->ps2.rx_hold = sn->ps2_rx_hold;
+    hw->ps2.rx_keycode = sn->ps2_rx_keycode;
+    hw->ps2.rx_ascii = sn->ps2_rx_ascii;
+    hw->ps2.shifts = sn->ps2_shifts;
+    hw->ps2.code_ext = sn->ps2_code_ext;
+
+    // The simulator snapshot cancelled all the events
+    hw_schedule_events(hw);
     return 0;
 }
 
@@ -19,5 +19,50 @@
 
 #include "sim65.h"
 
-enum sim65_error hw_init(sim65 s, const char *fname);
+struct hw;
 
+// Adds the devices of one machine to the simulator and loads the firmware
+// file into the SPI flash, the flash is left erased if fname is NULL. The
+// devices are passed to the callbacks as the simulator user data, so each
+// simulator needs its own hw_init.
+// Returns NULL on error.
+struct hw *hw_init(sim65 s, const char *fname);
+
+// Frees the devices, must be called before freeing the simulator.
+void hw_free(struct hw *hw);
+
+// Copies the devices to a simulator created with sim65_clone. The flash and
+// video memory are shared copy-on-write with the original. The clone keeps
+// the UART buffers of the original, use hw_set_uart_buffer to give it its
+// own, and does not write the VGA image file.
+struct hw *hw_clone(struct hw *hw, sim65 s);
+
+// Connects the UART to buffers instead of the console: the bytes in "in"
+// are received in order and the transmitted bytes are written to "out".
+// Polling restarts if the old input was at the end, "in" is not copied.
+void hw_set_uart_buffer(struct hw *hw, const void *in, size_t len, FILE *out);
+
+// Sets the file for the UART output, NULL for the standard output.
+void hw_set_uart_output(struct hw *hw, FILE *out);
+
+// Writes each byte received by the UART and the end of the input to the
+// file, one "<cycle> <byte>" line each with -1 for the end. The UART input
+// is the only input of the simulation that does not depend only on the
+// cycle count, so the record replays the full run.
+void hw_set_uart_record(struct hw *hw, FILE *f);
+
+// Reads the UART input from a file written by hw_set_uart_record, each byte
+// is received at the same cycle as in the recorded run. Returns 0 on success.
+int hw_set_uart_replay(struct hw *hw, const char *fname);
+
+// Sets the file updated with the VGA image, NULL to disable the updates.
+void hw_set_vga_file(struct hw *hw, const char *fname);
+
+// Writes a snapshot of the simulator and the devices to the file.
+// Returns 0 on success.
+int hw_snapshot_save(struct hw *hw, sim65 s, FILE *f);
+
+// Restores the simulator and the devices from a snapshot in memory, that can
+// be a memory mapped file. The simulator must be initialized with hw_init
+// and the same ROM as the saved one. Returns 0 on success.
+int hw_snapshot_load(struct hw *hw, sim65 s, const void *data, size_t len);
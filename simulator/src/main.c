@@ -15,14 +15,21 @@
  * You should have received a copy of the GNU General Public License along
  * with this program.  If not, see <http://www.gnu.org/licenses/>
  */
+#include "batch.h"
 #include "hw.h"
+#include "replay.h"
+#include "segtrace.h"
 #include "sim65.h"
 #include <minirom.h>
 #include <minirom_lbl.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 static char *prog_name;
@@ -31,15 +38,30 @@ static FILE *trace_file;
 static void print_help(void)
 {
     fprintf(stderr, "Usage: %s [options] <firmware.bin>\n"
+                    "       %s [options] -b <file>\n"
                     "Options:\n"
-                    " -d       : Print debug messages to standard error\n"
+                    " -a <mode>: Write the trace in a thread, if it falls behind the\n"
+                    "            simulation 'block' waits for it and 'drop' skips records\n"
+                    " -b <file>: Run the scenarios listed in file in parallel, see README\n"
+                    " -B       : Store the trace in binary format, see sim65-tracedump\n"
+                    " -c <num> : Stop the simulation after num cycles\n"
+                    " -d       : Print debug messages and statistics to standard error\n"
                     " -e <lvl> : Sets the error level to 'none', 'mem' or 'full'\n"
                     " -h       : Show this help\n"
+                    " -j       : Translate hot code to native code, faster simulation\n"
                     " -l <file>: Loads label file, used in simulation trace\n"
+                    " -n <num> : Number of threads for -b, defaults to the number of CPUs\n"
                     " -p <file>: Store profile information into file\n"
+                    " -P <file>: Replay the UART input recorded with -R, with reverse debugging\n"
                     " -r <file>: Load file at $FF00 instead of default mini-rom.\n"
-                    " -t <file>: Store simulation trace into file\n",
-            prog_name);
+                    " -R <file>: Record the UART input into file\n"
+                    " -s <file>: Resume the simulation from a snapshot file\n"
+                    " -S <file>: Store a snapshot file when the simulation stops\n"
+                    " -t <file>: Store simulation trace into file\n"
+                    " -T <num> : Trace and profile in parallel segments of num cycles,\n"
+                    "            with -n threads, the UART input is read before starting\n"
+                    " -w <cond>: Only trace inside the window set by cond, see README\n",
+            prog_name, prog_name);
 }
 
 static void print_error(const char *text)
@@ -103,122 +125,469 @@ static void set_trace_file(const char *fname, sim65 s)
     sim65_set_trace_file(s, trace_file);
 }
 
-static int rom_load(const char *fname, sim65 s)
+// Reads all the standard input, as the UART input of a segmented run
+static char *read_input(size_t *len)
 {
+    size_t size = 4096, n = 0;
+    char *buf = malloc(size);
+    while (buf)
+    {
+        n += fread(buf + n, 1, size - n, stdin);
+        if (n < size)
+            break;
+        size *= 2;
+        char *nbuf = realloc(buf, size);
+        if (!nbuf)
+            free(buf);
+        buf = nbuf;
+    }
+    if (!buf || ferror(stdin))
+        exit_error("can't read standard input");
+    *len = n;
+    return buf;
+}
+
+// Maps the snapshot file to memory
+static const void *map_snapshot(const char *fname, size_t *len)
+{
+    struct stat st;
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st))
+    {
+        perror(fname);
+        exit_error("can't open snapshot file");
+    }
+    void *data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        perror(fname);
+        exit_error("can't read snapshot file");
+    }
+    *len = st.st_size;
+    return data;
+}
+
+static void store_snapshot(const char *fname, struct hw *hw, sim65 s)
+{
+    FILE *f = fopen(fname, "wb");
+    if (!f)
+    {
+        perror(fname);
+        exit_error("can't open snapshot file");
+    }
+    if (hw_snapshot_save(hw, s, f) | fclose(f))
+        exit_error("can't write snapshot file");
+}
+
+// Reads an address, as a label or in hex
+static int parse_addr(sim65 s, const char *str, unsigned *addr)
+{
+    int a = sim65_lbl_find(s, str);
+    char *end;
+    if (a >= 0)
+    {
+        *addr = a;
+        return 0;
+    }
+    if (*str == '$')
+        str++;
+    unsigned long v = strtoul(str, &end, 16);
+    if (end == str || *end || v > 0xFFFF)
+        return -1;
+    *addr = v;
+    return 0;
+}
+
+// Sets the trace window from a list of conditions separated by commas
+static const char *set_trace_window(sim65 s, const char *spec)
+{
+    struct sim65_trace_trigger trig = { .start_pc = -1, .watch = -1 };
+    char *buf = strdup(spec), *save = 0, *tok;
+    const char *err = 0;
+    for (tok = strtok_r(buf, ",", &save); tok && !err; tok = strtok_r(0, ",", &save))
+    {
+        char *val = strchr(tok, '=');
+        unsigned addr;
+        if (val)
+            *val++ = 0;
+        if (!strcmp(tok, "ret") && !val)
+            trig.stop_ret = 1;
+        else if (!val)
+            err = "invalid trace window condition";
+        else if (!strcmp(tok, "pc") || !strcmp(tok, "write"))
+        {
+            if (parse_addr(s, val, &addr))
+                err = "invalid trace window address";
+            else if (!strcmp(tok, "pc"))
+                trig.start_pc = addr;
+            else
+                trig.watch = addr;
+        }
+        else if (!strcmp(tok, "range"))
+        {
+            char *hi = strchr(val, '-');
+            if (hi)
+                *hi++ = 0;
+            if (!hi || parse_addr(s, val, &trig.lo) || parse_addr(s, hi, &trig.hi))
+                err = "invalid trace window range";
+        }
+        else if (!strcmp(tok, "cycle"))
+            trig.start_cycle = strtoull(val, 0, 0);
+        else if (!strcmp(tok, "until"))
+            trig.stop_cycle = strtoull(val, 0, 0);
+        else if (!strcmp(tok, "count"))
+            trig.count = strtoull(val, 0, 0);
+        else
+            err = "invalid trace window condition";
+    }
+    free(buf);
+    if (!err && sim65_set_trace_trigger(s, &trig))
+        err = "invalid trace window";
+    return err;
+}
+
+static FILE *open_record(const char *fname)
+{
+    FILE *f = fopen(fname, "w");
+    if (!f)
+    {
+        perror(fname);
+        exit_error("can't open record file");
+    }
+    // Keeps the record if the simulation is killed
+    setvbuf(f, 0, _IOLBF, 0);
+    return f;
+}
+
+// Reads replay commands from the standard input, the simulated UART output
+// goes to the standard output.
+static void replay_prompt(struct replay *r, uint64_t limit)
+{
+    char buf[256];
+    fprintf(stderr, "Commands: s [n] step, rs [n] reverse step, c continue, "
+                    "rc reverse continue,\n          g <cycle> go to cycle, "
+                    "b/d <addr> add/delete breakpoint, r registers, q quit\n");
+    sim65_print_reg(replay_sim(r), stderr);
+    for (;;)
+    {
+        fputs("> ", stderr);
+        if (!fgets(buf, sizeof(buf), stdin))
+            break;
+        char *cmd = strtok(buf, " \t\r\n");
+        char *arg = strtok(0, " \t\r\n");
+        uint64_t n = arg ? strtoull(arg, 0, 0) : 1;
+        enum sim65_error e = sim65_err_none;
+        if (!cmd)
+            continue;
+        else if (!strcmp(cmd, "q"))
+            break;
+        else if (!strcmp(cmd, "s"))
+            while (n-- && !e)
+                e = replay_step(r);
+        else if (!strcmp(cmd, "rs"))
+            while (n-- && !e)
+                e = replay_reverse_step(r);
+        else if (!strcmp(cmd, "c"))
+            e = replay_continue(r, limit);
+        else if (!strcmp(cmd, "rc"))
+            e = replay_reverse_continue(r);
+        else if (!strcmp(cmd, "g") && arg)
+            e = replay_goto(r, n);
+        else if ((!strcmp(cmd, "b") || !strcmp(cmd, "d")) && arg)
+        {
+            unsigned addr = strtoul(arg, 0, 16) & 0xFFFF;
+            if (cmd[0] == 'b' ? replay_add_breakpoint(r, addr)
+                              : replay_del_breakpoint(r, addr))
+                fprintf(stderr, "invalid breakpoint %04x\n", addr);
+            continue;
+        }
+        else if (strcmp(cmd, "r"))
+        {
+            fprintf(stderr, "invalid command\n");
+            continue;
+        }
+        sim65 s = replay_sim(r);
+        if (e == sim65_err_user)
+            fprintf(stderr, "breakpoint\n");
+        else if (e == sim65_err_cycle_limit && cmd[0] == 'r')
+            fprintf(stderr, "start of replay\n");
+        else if (e)
+            fprintf(stderr, "%s at address %04x\n", sim65_error_str(s, e),
+                    sim65_error_addr(s));
+        sim65_print_reg(s, stderr);
+    }
+}
+
+// Loads the ROM at $FF00 from the file, or the internal mini-rom if NULL.
+// Returns the error message or NULL.
+static const char *rom_load(const char *fname, sim65 s)
+{
+    if (!fname)
+    {
+        // Adds internal ROM
+        if( ___build_minirom_bin_len != 256 )
+            return "internal error: minirom.bin too short";
+        sim65_add_data_rom(s, 0xFF00, ___build_minirom_bin, 256);
+        // and labels
+        for(int i=0; minirom_lbl[i].lbl; i++)
+            sim65_lbl_add(s, minirom_lbl[i].addr, minirom_lbl[i].lbl);
+        return 0;
+    }
+
     int c, addr = 0xFF00;
     FILE *f = fopen(fname, "rb");
     if (!f)
-        exit_error("can't open ROM file");
+        return "can't open ROM file";
 
     // Load 256 byte ROM
     while (EOF != (c = getc(f)))
     {
         unsigned char data = c;
         if( addr >= 0x10000 )
-            exit_error("ROM file too big");
+        {
+            fclose(f);
+            return "ROM file too big";
+        }
         sim65_add_data_rom(s, addr++, &data, 1);
     }
     fclose(f);
 
     if( addr != 0x10000 )
-        exit_error("ROM file too short");
+        return "ROM file too short";
     return 0;
 }
 
 int main(int argc, char **argv)
 {
     sim65 s;
-    int opt;
+    int opt, debug = 0;
     const char *rom = 0;
-    const char *lblname = 0, *profname = 0;
+    const char *lblname = 0, *profname = 0, *batch = 0;
+    const char *snap_load = 0, *snap_save = 0, *replay_name = 0;
+    const char *trace_name = 0, *window = 0;
+    struct segtrace_opts sopt = { 0, 0, 0, 0 };
+    int segments = 0;
+    FILE *record = 0;
+    uint64_t cycles = 0;
+    struct batch_opts bopt = { 0, 0, sim65_errlvl_default, rom_load, 0, 0 };
 
     prog_name = argv[0];
     s = sim65_new();
     if (!s)
         exit_error("internal error");
 
-    while ((opt = getopt(argc, argv, "t:dhl:e:p:")) != -1)
+    while ((opt = getopt(argc, argv, "a:t:T:b:Bc:dhjl:e:n:p:P:r:R:s:S:w:")) != -1)
     {
         switch (opt)
         {
             case 't': // trace
-                sim65_set_debug(s, sim65_debug_trace);
-                set_trace_file(optarg, s);
+                trace_name = optarg;
+                break;
+            case 'T': // segmented trace
+                sopt.interval = strtoull(optarg, 0, 0);
+                segments = 1;
+                break;
+            case 'a': // asynchronous trace
+                if (!strcmp(optarg, "b") || !strcmp(optarg, "block"))
+                    sim65_set_trace_async(s, sim65_trace_block);
+                else if (!strcmp(optarg, "d") || !strcmp(optarg, "drop"))
+                    sim65_set_trace_async(s, sim65_trace_drop);
+                else
+                    print_error("invalid trace writer mode");
+                break;
+            case 'b': // batch
+                batch = optarg;
+                break;
+            case 'B': // binary trace
+                sim65_set_trace_format(s, sim65_trace_binary);
+                break;
+            case 'c': // cycle limit
+                cycles = strtoull(optarg, 0, 0);
                 break;
             case 'd': // debug
                 sim65_set_debug(s, sim65_debug_messages);
+                debug = 1;
                 break;
             case 'e': // error level
                 if (!strcmp(optarg, "n") || !strcmp(optarg, "none"))
-                    sim65_set_error_level(s, sim65_errlvl_none);
+                    bopt.errlvl = sim65_errlvl_none;
                 else if (!strcmp(optarg, "f") || !strcmp(optarg, "full"))
-                    sim65_set_error_level(s, sim65_errlvl_full);
+                    bopt.errlvl = sim65_errlvl_full;
                 else if (!strcmp(optarg, "m") || !strcmp(optarg, "mem"))
-                    sim65_set_error_level(s, sim65_errlvl_memory);
+                    bopt.errlvl = sim65_errlvl_memory;
                 else
                     print_error("invalid error level");
+                sim65_set_error_level(s, bopt.errlvl);
                 break;
             case 'h': // help
                 print_help();
                 return 0;
+            case 'j': // native code translation
+                bopt.jit = 1;
+                if (!sim65_set_jit(s, 1))
+                    fprintf(stderr, "%s: native code translation not available\n", prog_name);
+                break;
+            case 'P': // replay
+                replay_name = optarg;
+                break;
             case 'r': // rom file
                 rom = strdup(optarg);
                 break;
+            case 'R': // record
+                record = open_record(optarg);
+                break;
             case 'l': // label file
                 lblname = optarg;
                 break;
+            case 'n': // batch and segment threads
+                bopt.threads = sopt.threads = atoi(optarg);
+                break;
             case 'p': // profile
                 profname = optarg;
                 break;
+            case 's': // resume from snapshot
+                snap_load = optarg;
+                break;
+            case 'S': // store snapshot
+                snap_save = optarg;
+                break;
+            case 'w': // trace window
+                window = optarg;
+                break;
             default:
                 print_error(0);
         }
     }
 
-    if (optind >= argc)
+    if (batch)
+    {
+        if (optind != argc)
+            print_error("no filename allowed with -b");
+        if (record || replay_name)
+            print_error("can't record or replay with -b");
+        sim65_free(s);
+        if (snap_load)
+            bopt.snapshot = map_snapshot(snap_load, &bopt.snapshot_len);
+        int failed = batch_run(batch, &bopt);
+        if (failed < 0)
+            exit_error("invalid batch file");
+        return failed ? 1 : 0;
+    }
+
+    // The flash contents are in the snapshot
+    if (optind >= argc && !snap_load)
         print_error("missing filename");
-    else if (optind + 1 != argc)
+    else if (optind + 1 < argc)
         print_error("only one filename allowed");
-    const char *fname = argv[optind];
+    const char *fname = optind < argc ? argv[optind] : 0;
+
+    if (segments && (record || replay_name))
+        print_error("can't record or replay with -T");
+    if (trace_name)
+    {
+        set_trace_file(trace_name, s);
+        if (!segments)
+            sim65_set_debug(s, sim65_debug_trace);
+    }
 
     // Load labels file
     if (lblname)
         sim65_lbl_load(s, lblname);
 
     // Initialize hardware and loads firmware
-    if (hw_init(s, fname) == sim65_err_user)
+    struct hw *hw = hw_init(s, fname);
+    if (!hw)
         exit_error("error reading firmware file");
 
     // Set profile info
-    if (profname)
+    if (profname && !segments)
         sim65_set_profiling(s, 1);
 
     // Read ROM file
-    if( rom )
-        rom_load(rom, s);
-    else
+    const char *err = rom_load(rom, s);
+    if (err)
+        exit_error(err);
+
+    // The window can use the labels of the ROM
+    if (window && (err = set_trace_window(s, window)))
+        print_error(err);
+
+    // Runs simulator from RESET pointer, or from the snapshot state
+    unsigned pc = sim65_get_byte(s, 0xFFFC) + (sim65_get_byte(s, 0xFFFD) << 8);
+    if (snap_load)
     {
-        // Adds internal ROM
-        if( ___build_minirom_bin_len != 256 )
-            exit_error("internal error: minirom.bin too short");
-        sim65_add_data_rom(s, 0xFF00, ___build_minirom_bin, 256);
-        // and labels
-        for(int i=0; minirom_lbl[i].lbl; i++)
-            sim65_lbl_add(s, minirom_lbl[i].addr, minirom_lbl[i].lbl);
+        size_t len;
+        const void *data = map_snapshot(snap_load, &len);
+        if (hw_snapshot_load(hw, s, data, len))
+            exit_error("invalid snapshot file");
+        munmap((void *)data, len);
+        struct sim65_reg regs;
+        sim65_get_regs(s, &regs);
+        pc = regs.pc;
     }
-
-    // Runs simulator from RESET pointer
-    unsigned reset = sim65_get_byte(s, 0xFFFC) + (sim65_get_byte(s, 0xFFFD) << 8);
-    enum sim65_error e = sim65_run(s, 0, reset);
+    sim65_set_cycle_limit(s, cycles);
+    if (replay_name)
+    {
+        if (record)
+            print_error("can't record and replay at the same time");
+        if (hw_set_uart_replay(hw, replay_name))
+            exit_error("can't read replay file");
+        struct sim65_reg regs;
+        sim65_get_regs(s, &regs);
+        regs.pc = pc;
+        sim65_set_regs(s, &regs);
+        struct replay *r = replay_new(s, hw, 0);
+        if (!r)
+            exit_error("internal error");
+        replay_prompt(r, cycles);
+        replay_free(r);
+        if (trace_file)
+            fclose(trace_file);
+        return 0;
+    }
+    if (record)
+        hw_set_uart_record(hw, record);
+    enum sim65_error e;
+    char *input = 0;
+    if (segments)
+    {
+        // All the segments need the same input
+        size_t len;
+        input = read_input(&len);
+        hw_set_uart_buffer(hw, input, len, 0);
+        struct sim65_reg regs;
+        sim65_get_regs(s, &regs);
+        regs.pc = pc;
+        sim65_set_regs(s, &regs);
+        sopt.trace = trace_file;
+        sopt.profile = profname != 0;
+        e = segtrace_run(s, hw, &sopt);
+    }
+    else
+        e = sim65_run(s, 0, pc);
     if (e)
         // Prints error message
         sim65_eprintf(s, "simulator returned %s at address %04x.",
                       sim65_error_str(s, e), sim65_error_addr(s));
-    sim65_dprintf(s, "Total cycles: %ld", sim65_get_cycles(s));
+    sim65_dprintf(s, "Total cycles: %" PRIu64, sim65_get_cycles(s));
+    if (sim65_get_trace_drops(s))
+        sim65_dprintf(s, "Trace records dropped: %" PRIu64, sim65_get_trace_drops(s));
+    if (debug)
+    {
+        sim65_print_fuse_stats(s, stderr);
+        sim65_print_idle_stats(s, stderr);
+    }
     if (profname)
         store_prof(profname, s);
+    if (snap_save)
+        store_snapshot(snap_save, hw, s);
+    hw_free(hw);
     sim65_free(s);
+    free(input);
     if (trace_file)
         fclose(trace_file);
+    if (record)
+        fclose(record);
     return 0;
 }
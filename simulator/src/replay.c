@@ -0,0 +1,308 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+// Replay session: the simulation only depends on the cycle count and the
+// recorded UART input, so any past state is simulated again from a clone of
+// the machine stored at a previous checkpoint. Moving backwards restores the
+// last checkpoint before the target and runs forward to it.
+
+#include "replay.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#define REPLAY_INTERVAL 10000000
+#define MAX_BREAKPOINTS 64
+
+struct checkpoint
+{
+    sim65 s;
+    struct hw *hw;
+    uint64_t cycle;
+};
+
+struct replay
+{
+    // Current machine
+    sim65 s;
+    struct hw *hw;
+    // Checkpoints, in increasing cycle order
+    struct checkpoint *cp;
+    unsigned ncp;
+    unsigned size;
+    uint64_t interval;
+    // The output was already shown up to this cycle
+    uint64_t frontier;
+    FILE *sink;
+    uint16_t bp[MAX_BREAKPOINTS];
+    unsigned nbp;
+};
+
+static int bp_callback(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
+{
+    return sim65_err_user;
+}
+
+// Installs or removes the breakpoints in the current machine, they are
+// removed before storing checkpoints.
+static void set_breakpoints(struct replay *r, sim65_callback cb)
+{
+    for (unsigned i = 0; i < r->nbp; i++)
+        sim65_add_callback(r->s, r->bp[i], cb, sim65_cb_exec);
+}
+
+static int add_checkpoint(struct replay *r)
+{
+    if (r->ncp == r->size)
+    {
+        unsigned size = r->size ? r->size * 2 : 64;
+        struct checkpoint *cp = realloc(r->cp, size * sizeof(*cp));
+        if (!cp)
+            return -1;
+        r->cp = cp;
+        r->size = size;
+    }
+    struct checkpoint *cp = &r->cp[r->ncp];
+    cp->s = sim65_clone(r->s);
+    cp->hw = cp->s ? hw_clone(r->hw, cp->s) : 0;
+    if (!cp->hw)
+    {
+        sim65_free(cp->s);
+        return -1;
+    }
+    cp->cycle = sim65_get_cycles(r->s);
+    r->ncp++;
+    return 0;
+}
+
+// Replaces the current machine with a copy of the checkpoint
+static void restore(struct replay *r, const struct checkpoint *cp)
+{
+    sim65 s = sim65_clone(cp->s);
+    struct hw *hw = s ? hw_clone(cp->hw, s) : 0;
+    if (!hw)
+    {
+        perror("allocate memory");
+        exit(1);
+    }
+    hw_free(r->hw);
+    sim65_free(r->s);
+    r->s = s;
+    r->hw = hw;
+}
+
+// Runs the current machine up to the first instruction boundary at or after
+// the target cycle, storing checkpoints past the last one and showing the
+// UART output past the frontier. Stops at the breakpoints if "bp" is set.
+static enum sim65_error run_to(struct replay *r, uint64_t target, int bp)
+{
+    enum sim65_error e = sim65_err_none;
+    uint64_t cycles;
+
+    if (bp)
+        set_breakpoints(r, bp_callback);
+    while (!e && (cycles = sim65_get_cycles(r->s)) < target)
+    {
+        const struct checkpoint *last = &r->cp[r->ncp - 1];
+        uint64_t end = target;
+        if (cycles < r->frontier && r->frontier < end)
+            end = r->frontier;
+        if (cycles >= last->cycle && last->cycle + r->interval < end)
+            end = last->cycle + r->interval;
+
+        hw_set_uart_output(r->hw, cycles < r->frontier ? r->sink : 0);
+        e = sim65_run_cycles(r->s, 0, end - cycles);
+        cycles = sim65_get_cycles(r->s);
+        if (cycles > r->frontier)
+            r->frontier = cycles;
+        if (cycles >= last->cycle + r->interval)
+        {
+            if (bp)
+                set_breakpoints(r, 0);
+            if (add_checkpoint(r))
+                sim65_eprintf(r->s, "can't store checkpoint at cycle %" PRIu64,
+                              cycles);
+            if (bp)
+                set_breakpoints(r, bp_callback);
+        }
+    }
+    if (bp)
+        set_breakpoints(r, 0);
+    return e;
+}
+
+struct replay *replay_new(sim65 s, struct hw *hw, uint64_t interval)
+{
+    struct replay *r = calloc(1, sizeof(struct replay));
+    if (!r)
+        return 0;
+    r->s = s;
+    r->hw = hw;
+    r->interval = interval ? interval : REPLAY_INTERVAL;
+    r->frontier = sim65_get_cycles(s);
+    r->sink = fopen("/dev/null", "w");
+    if (!r->sink || add_checkpoint(r))
+    {
+        if (r->sink)
+            fclose(r->sink);
+        free(r);
+        return 0;
+    }
+    return r;
+}
+
+void replay_free(struct replay *r)
+{
+    if (!r)
+        return;
+    for (unsigned i = 0; i < r->ncp; i++)
+    {
+        hw_free(r->cp[i].hw);
+        sim65_free(r->cp[i].s);
+    }
+    hw_free(r->hw);
+    sim65_free(r->s);
+    fclose(r->sink);
+    free(r->cp);
+    free(r);
+}
+
+sim65 replay_sim(struct replay *r)
+{
+    return r->s;
+}
+
+int replay_add_breakpoint(struct replay *r, unsigned addr)
+{
+    for (unsigned i = 0; i < r->nbp; i++)
+        if (r->bp[i] == addr)
+            return 0;
+    if (r->nbp == MAX_BREAKPOINTS)
+        return -1;
+    r->bp[r->nbp++] = addr;
+    return 0;
+}
+
+int replay_del_breakpoint(struct replay *r, unsigned addr)
+{
+    for (unsigned i = 0; i < r->nbp; i++)
+        if (r->bp[i] == addr)
+        {
+            r->bp[i] = r->bp[--r->nbp];
+            return 0;
+        }
+    return -1;
+}
+
+enum sim65_error replay_goto(struct replay *r, uint64_t cycle)
+{
+    // Last checkpoint at or before the cycle
+    unsigned lo = 0, hi = r->ncp;
+    while (hi - lo > 1)
+    {
+        unsigned mid = (lo + hi) / 2;
+        if (r->cp[mid].cycle <= cycle)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    // Runs from the current state if it is after the checkpoint
+    uint64_t cycles = sim65_get_cycles(r->s);
+    if (cycles > cycle || cycles < r->cp[lo].cycle)
+        restore(r, &r->cp[lo]);
+    return run_to(r, cycle, 0);
+}
+
+enum sim65_error replay_step(struct replay *r)
+{
+    return run_to(r, sim65_get_cycles(r->s) + 1, 0);
+}
+
+enum sim65_error replay_continue(struct replay *r, uint64_t cycle)
+{
+    if (!cycle)
+        cycle = UINT64_MAX;
+    // Executes the instruction at the current breakpoint
+    enum sim65_error e = replay_step(r);
+    if (!e)
+        e = run_to(r, cycle, 1);
+    return e;
+}
+
+enum sim65_error replay_reverse_step(struct replay *r)
+{
+    uint64_t now = sim65_get_cycles(r->s), start = r->cp[0].cycle;
+    if (now <= start)
+        return sim65_err_cycle_limit;
+
+    // Steps from a few instructions before, further back if that is already
+    // past the current cycle.
+    for (uint64_t margin = 64;; margin *= 2)
+    {
+        uint64_t from = now - start > margin ? now - margin : start;
+        enum sim65_error e = replay_goto(r, from);
+        uint64_t cycles = sim65_get_cycles(r->s);
+        if (e || (cycles >= now && from == start))
+            return e ? e : sim65_err_cycle_limit;
+        if (cycles >= now)
+            continue;
+
+        uint64_t prev = cycles;
+        while (!e && (cycles = sim65_get_cycles(r->s)) < now)
+        {
+            prev = cycles;
+            e = replay_step(r);
+        }
+        return replay_goto(r, prev);
+    }
+}
+
+enum sim65_error replay_reverse_continue(struct replay *r)
+{
+    uint64_t now = sim65_get_cycles(r->s);
+
+    // Searches each interval between checkpoints, from the last one
+    for (unsigned i = r->ncp; i-- > 0;)
+    {
+        if (r->cp[i].cycle >= now)
+            continue;
+        uint64_t end = i + 1 < r->ncp && r->cp[i + 1].cycle < now ?
+                       r->cp[i + 1].cycle : now;
+        restore(r, &r->cp[i]);
+
+        // Last breakpoint hit before the end
+        uint64_t hit = UINT64_MAX;
+        for (;;)
+        {
+            enum sim65_error e = run_to(r, end, 1);
+            uint64_t cycles = sim65_get_cycles(r->s);
+            if (e != sim65_err_user || cycles >= end)
+                break;
+            hit = cycles;
+            if (replay_step(r))
+                break;
+        }
+        if (hit != UINT64_MAX)
+        {
+            replay_goto(r, hit);
+            return sim65_err_user;
+        }
+    }
+    replay_goto(r, r->cp[0].cycle);
+    return sim65_err_cycle_limit;
+}
@@ -0,0 +1,64 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#pragma once
+
+#include "hw.h"
+#include "sim65.h"
+
+struct replay;
+
+// Starts a replay session from the machine, with the registers already set
+// by sim65_set_regs and the UART input from hw_set_uart_replay. The session
+// owns the machine, the current one is returned by replay_sim. A checkpoint
+// is stored each "interval" cycles, 0 for the default, so any cycle is
+// reached again by running from the previous checkpoint.
+// Returns NULL on error.
+struct replay *replay_new(sim65 s, struct hw *hw, uint64_t interval);
+
+// Frees the session, including the current machine.
+void replay_free(struct replay *r);
+
+// Returns the current machine, it changes after moving backwards.
+sim65 replay_sim(struct replay *r);
+
+// Adds or removes a breakpoint at the address, used by replay_continue and
+// replay_reverse_continue. Breakpoints replace other exec callbacks at the
+// same address. Returns 0 on success.
+int replay_add_breakpoint(struct replay *r, unsigned addr);
+int replay_del_breakpoint(struct replay *r, unsigned addr);
+
+// Moves to the first instruction boundary at or after the cycle, forward or
+// backwards. The output of the UART is only shown the first time each cycle
+// is simulated.
+enum sim65_error replay_goto(struct replay *r, uint64_t cycle);
+
+// Executes one instruction.
+enum sim65_error replay_step(struct replay *r);
+
+// Runs up to a breakpoint, an error or the cycle, 0 for no limit.
+// Returns sim65_err_user at a breakpoint.
+enum sim65_error replay_continue(struct replay *r, uint64_t cycle);
+
+// Moves back to the previous instruction. Returns sim65_err_cycle_limit at
+// the start of the session.
+enum sim65_error replay_reverse_step(struct replay *r);
+
+// Moves back to the last breakpoint before the current cycle, or to the
+// start of the session if there is none. Returns sim65_err_user at a
+// breakpoint and sim65_err_cycle_limit at the start.
+enum sim65_error replay_reverse_continue(struct replay *r);
@@ -0,0 +1,252 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+// Segmented run: tracing is orders of magnitude slower than the plain
+// simulation, so the run is split in segments that are traced in parallel.
+// The main thread runs the machine without instrumentation and queues a
+// clone at the start of each segment, the workers run each clone up to the
+// end of its segment with the instrumentation, and the traces are written in
+// segment order as they are finished.
+
+#include "segtrace.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define SEGMENT_CYCLES 10000000
+
+struct segment
+{
+    sim65 s;                        // Clone at the start of the segment
+    struct hw *hw;
+    uint64_t end;                   // Cycle at the end, 0 for the last one
+    FILE *out;                      // Trace of the segment
+    int done;
+};
+
+struct segtrace
+{
+    const struct segtrace_opts *opt;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // Queued segments, segment "n" is at n % size
+    struct segment *seg;
+    unsigned size;
+    unsigned count;
+    unsigned next_run;
+    unsigned next_out;
+    unsigned workers;
+    int finished;
+    int writing;
+    sim65 prof;                     // Profile of the finished segments
+    FILE *sink;                     // UART output of the segments
+};
+
+static void copy_file(FILE *from, FILE *to)
+{
+    char buf[65536];
+    size_t n;
+    rewind(from);
+    while ((n = fread(buf, 1, sizeof(buf), from)) > 0)
+        fwrite(buf, 1, n, to);
+}
+
+static void run_segment(struct segtrace *t, struct segment *sg)
+{
+    sim65 s = sg->s;
+    hw_set_uart_output(sg->hw, t->sink);
+    if (t->opt->trace)
+    {
+        sg->out = tmpfile();
+        if (!sg->out)
+        {
+            perror("trace segment");
+            exit(1);
+        }
+        sim65_set_trace_file(s, sg->out);
+        sim65_set_debug(s, sim65_debug_trace);
+    }
+    if (t->opt->profile)
+        sim65_set_profiling(s, 1);
+
+    if (sg->end)
+        sim65_run_cycles(s, 0, sg->end - sim65_get_cycles(s));
+    else
+    {
+        struct sim65_reg regs;
+        sim65_get_regs(s, &regs);
+        sim65_run(s, 0, regs.pc);
+    }
+}
+
+// Writes the finished segments in order, only one thread at a time.
+// Called with the mutex locked.
+static void write_segments(struct segtrace *t)
+{
+    if (t->writing)
+        return;
+    t->writing = 1;
+    while (t->next_out != t->count && t->seg[t->next_out % t->size].done)
+    {
+        struct segment *sg = &t->seg[t->next_out % t->size];
+        pthread_mutex_unlock(&t->mutex);
+        if (sg->out)
+        {
+            copy_file(sg->out, t->opt->trace);
+            fclose(sg->out);
+        }
+        pthread_mutex_lock(&t->mutex);
+        t->next_out++;
+        pthread_cond_broadcast(&t->cond);
+    }
+    t->writing = 0;
+}
+
+// Runs the next queued segment, returns 0 if there is none.
+// Called with the mutex locked.
+static int work_one(struct segtrace *t)
+{
+    if (t->next_run == t->count)
+        return 0;
+    struct segment *sg = &t->seg[t->next_run++ % t->size];
+    pthread_mutex_unlock(&t->mutex);
+    run_segment(t, sg);
+    pthread_mutex_lock(&t->mutex);
+    if (t->opt->profile)
+        sim65_add_profile(t->prof, sg->s);
+    hw_free(sg->hw);
+    sim65_free(sg->s);
+    sg->done = 1;
+    write_segments(t);
+    return 1;
+}
+
+static void *worker_thread(void *arg)
+{
+    struct segtrace *t = arg;
+    pthread_mutex_lock(&t->mutex);
+    for (;;)
+    {
+        if (work_one(t))
+            continue;
+        if (t->finished)
+            break;
+        pthread_cond_wait(&t->cond, &t->mutex);
+    }
+    pthread_mutex_unlock(&t->mutex);
+    return 0;
+}
+
+// Queues the segment, waiting for a free slot
+static void add_segment(struct segtrace *t, sim65 s, struct hw *hw, uint64_t end)
+{
+    pthread_mutex_lock(&t->mutex);
+    while (t->count - t->next_out == t->size)
+        if (t->workers || !work_one(t))
+            pthread_cond_wait(&t->cond, &t->mutex);
+    struct segment *sg = &t->seg[t->count++ % t->size];
+    sg->s = s;
+    sg->hw = hw;
+    sg->end = end;
+    sg->out = 0;
+    sg->done = 0;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->mutex);
+}
+
+static sim65 clone_machine(sim65 s, struct hw *hw, struct hw **chw)
+{
+    sim65 c = sim65_clone(s);
+    *chw = c ? hw_clone(hw, c) : 0;
+    if (!*chw)
+    {
+        perror("allocate memory");
+        exit(1);
+    }
+    return c;
+}
+
+enum sim65_error segtrace_run(sim65 s, struct hw *hw, const struct segtrace_opts *opt)
+{
+    struct segtrace t = { .opt = opt };
+    uint64_t interval = opt->interval ? opt->interval : SEGMENT_CYCLES;
+    unsigned nthreads = opt->threads;
+    if (!nthreads)
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = n > 0 ? n : 1;
+    }
+
+    // A few segments per worker are queued, each one holds a clone
+    t.size = 4 * nthreads;
+    t.seg = calloc(t.size, sizeof(struct segment));
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    t.prof = opt->profile ? sim65_new() : 0;
+    t.sink = fopen("/dev/null", "w");
+    if (!t.seg || !threads || (opt->profile && !t.prof) || !t.sink)
+    {
+        perror("segmented run");
+        exit(1);
+    }
+    pthread_mutex_init(&t.mutex, 0);
+    pthread_cond_init(&t.cond, 0);
+    for (unsigned i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&threads[i], 0, worker_thread, &t))
+            break;
+        t.workers++;
+    }
+
+    // Runs each segment without instrumentation, queuing its start state
+    enum sim65_error e;
+    for (;;)
+    {
+        struct hw *chw;
+        sim65 c = clone_machine(s, hw, &chw);
+        uint64_t start = sim65_get_cycles(s);
+        e = sim65_run_cycles(s, 0, interval);
+        uint64_t end = sim65_get_cycles(s);
+        if (e || end == start)
+        {
+            add_segment(&t, c, chw, 0);
+            break;
+        }
+        add_segment(&t, c, chw, end);
+    }
+
+    pthread_mutex_lock(&t.mutex);
+    t.finished = 1;
+    pthread_cond_broadcast(&t.cond);
+    while (!t.workers && work_one(&t))
+        ;
+    pthread_mutex_unlock(&t.mutex);
+    for (unsigned i = 0; i < t.workers; i++)
+        pthread_join(threads[i], 0);
+
+    if (opt->profile)
+        sim65_add_profile(s, t.prof);
+    pthread_cond_destroy(&t.cond);
+    pthread_mutex_destroy(&t.mutex);
+    if (t.prof)
+        sim65_free(t.prof);
+    fclose(t.sink);
+    free(threads);
+    free(t.seg);
+    return e;
+}
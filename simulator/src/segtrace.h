@@ -0,0 +1,39 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#pragma once
+
+#include "hw.h"
+#include "sim65.h"
+
+// Options of a segmented run
+struct segtrace_opts
+{
+    unsigned threads;               // Worker threads, 0 for one per CPU
+    uint64_t interval;              // Cycles of each segment, 0 for the default
+    FILE *trace;                    // Trace output, NULL for no trace
+    int profile;                    // Adds the profile to the simulator
+};
+
+// Runs the simulation from the current registers up to an error, as
+// sim65_run, producing the same trace and profile as an instrumented run.
+// The machine runs without instrumentation, storing a clone at the start of
+// each segment, while worker threads execute the segments again with the
+// instrumentation. The traces of the segments are written in order.
+// The UART input must not be the console, so all the segments receive the
+// same input.
+enum sim65_error segtrace_run(sim65 s, struct hw *hw, const struct segtrace_opts *opt);
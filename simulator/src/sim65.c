@@ -17,8 +17,15 @@
  */
 #include "sim65.h"
 #include "likely.h"
+#include "sim65_alu.h"
+#include "sim65_alu_tab.h"
+#include "sim65_jit.h"
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,11 +33,46 @@
 
 #define MAXRAM (0x10000)
 
+// Use threaded code (GCC computed goto) to dispatch instructions, define
+// SIM65_SWITCH_DISPATCH to use the reference switch implementation.
+#if defined(__GNUC__) && !defined(SIM65_SWITCH_DISPATCH)
+#define SIM65_THREADED
+#endif
+
+// Run modes, bits of the run_mode field; tracing uses only one mode
+#define run_mode_prof   1
+#define run_mode_limit  2
+#define run_mode_trace  4
+
 // Memory status codes
 #define ms_undef    1
 #define ms_rom      2
 #define ms_invalid  4
 #define ms_callback 8
+#define ms_code     16  // Byte is part of a decoded block
+
+// Status bits that still allow direct reads of a byte
+#define ms_direct_read  (ms_rom | ms_code)
+
+// Callbacks of one memory page
+struct cb_page
+{
+    sim65_callback read[256];
+    sim65_callback write[256];
+    sim65_callback exec[256];
+    sim65_callback event[256];
+};
+
+// Memory page table entry. Simulated accesses use the host pointers when
+// not NULL, else the slow path checks the status of the byte in "mems".
+struct mpage
+{
+    uint8_t *rd;            // Page memory if all bytes can be read directly
+    uint8_t *wr;            // Page memory if all bytes can be written directly
+    struct cb_page *cb;     // Callbacks, NULL if the page has none
+    uint16_t n_rd;          // Number of bytes that can't be read directly
+    uint16_t n_wr;          // Number of bytes that can't be written directly
+};
 
 // Instruction lengths
 static uint8_t ilen[256] = {
@@ -44,127 +86,643 @@ static uint8_t ilen[256] = {
     2,2,1,1,2,2,2,1,1,2,1,1,3,3,3,1, 2,2,1,1,1,2,2,1,1,3,1,1,1,3,3,1
 };
 
+// Instruction cycles, without page-crossing and branch-taken extra cycles
+static uint8_t icyc[256] = {
+    0,6,0,0,0,3,5,0,3,2,2,0,0,4,6,0, 2,5,0,0,0,4,6,0,2,4,0,0,0,4,7,0,
+    6,6,0,0,3,3,5,0,4,2,2,0,4,4,6,0, 2,5,0,0,0,4,6,0,2,4,0,0,0,4,7,0,
+    6,6,0,0,0,3,5,0,3,2,2,0,3,4,6,0, 2,5,0,0,0,4,6,0,2,4,0,0,0,4,7,0,
+    6,6,0,0,0,3,5,0,4,2,2,0,5,4,6,0, 2,5,0,0,0,4,6,0,2,4,0,0,0,4,7,0,
+    0,6,0,0,3,3,3,0,2,0,2,0,4,4,4,0, 2,6,0,0,4,4,4,0,2,5,2,0,0,5,0,0,
+    2,6,2,0,3,3,3,0,2,2,2,0,4,4,4,0, 2,5,0,0,4,4,4,0,2,4,2,0,4,4,4,0,
+    2,6,0,0,3,3,5,0,2,2,2,0,4,4,6,0, 2,5,0,0,0,4,6,0,2,4,0,0,0,4,7,0,
+    2,6,0,0,3,3,5,0,2,2,2,0,4,4,6,0, 2,5,0,0,0,4,6,0,2,4,0,0,0,4,7,0
+};
+
+// Fused instruction sequences, see sim65_fuse.h
+enum fuse_id
+{
+#define FUSE(name, text, i1, i2, i3, check, code) fuse_##name,
+#include "sim65_fuse.h"
+#undef FUSE
+    fuse_num
+};
+
+// Decoded instruction
+struct dins
+{
+    uint8_t ins;
+    uint8_t len;
+    uint16_t data;
+    uint16_t op;        // Handler: the opcode, or 256 + fuse_id
+};
+
+// CPU state. The simulation loop keeps a copy in local variables, and
+// stores it back before calling any function that can read or modify it.
+struct cpu
+{
+    uint64_t cycles;
+    struct sim65_reg r;
+    // Lazy flags: while simulating, N, Z, C and V are kept here and the
+    // value in "r.p" is only updated when needed.
+    uint8_t fn;             // N flag is bit 7 of this value
+    uint8_t fz;             // Z flag is set if this value is zero
+    uint8_t fc;             // C flag, 0 or 1
+    uint8_t fv;             // V flag, 0 or SIM65_FLAG_V
+#ifdef SIM65_CHECKED
+    uint8_t p_valid;        // Flags not initialized
+#endif
+};
+
+// Functions that receive the local CPU state must be inlined in the
+// simulation loop, so the state is not forced to memory.
+#ifdef __GNUC__
+#define CPU_INLINE inline __attribute__((always_inline))
+#else
+#define CPU_INLINE inline
+#endif
+
+// Bits of "stop", the simulation loop only checks this value after each
+// instruction and handles the cause when not zero. The value is atomic as
+// sim65_stop can be called from other threads.
+enum {
+    stop_error = 1,         // An error was raised
+    stop_code = 2,          // Decoded code was invalidated
+    stop_irq = 4,           // An interrupt can be taken
+    stop_host = 8,          // The host requested to stop the simulation
+    stop_mode = 16          // The run mode changed inside a block
+};
+
+// Block of decoded instructions, straight-line code up to a jump or branch
+// and always inside one memory page.
+struct dblock
+{
+    struct dblock *next;    // Next block in the free list
+    unsigned cycles;        // Maximum cycles of all instructions
+    unsigned count;         // Number of instructions
+    unsigned idle;          // Cycles of one iteration if it is an idle loop
+#ifdef SIM65_JIT
+    unsigned hits;          // Times the block was started, to find hot blocks
+    jit_code native;        // Translated code, if any
+#endif
+    struct dins ins[];
+};
+
+// Profile information, allocated when profiling is enabled
+struct prof
+{
+    unsigned exe[MAXRAM];   // Times this instruction was executed
+    unsigned branch[MAXRAM];// Times this branch was taken
+    unsigned branch_skip;   // Number of branches skipped
+    unsigned branch_taken;  // Number of branches taken
+    unsigned branch_extra;  // Extra cycles per branch to other page
+    unsigned abs_x_extra;   // Extra cycles per ABS,X crossing page
+    unsigned abs_y_extra;   // Extra cycles per ABS,Y crossing page
+    unsigned ind_y_extra;   // Extra cycles per (),Y crossing page
+    unsigned instructions;  // Number of instructions
+};
+
+// Last start of an idle loop, to detect iterations that end in the same
+// state they started.
+struct idle
+{
+    const struct dblock *block;
+    struct cpu cpu;
+    unsigned events;        // Events executed before the iteration
+};
+
+// Trace window, see sim65_set_trace_trigger
+struct trig
+{
+    struct sim65_trace_trigger t;
+    int open;                       // A start condition happened
+    int active;                     // Open and inside the range, traced
+    uint64_t left;                  // Instructions left to trace
+    uint8_t sp;                     // Stack pointer when opened
+    sim65_callback start_prev;      // Callbacks replaced by the window
+    sim65_callback watch_prev;
+    sim65_callback range_prev[];    // From "lo" to "hi", while open
+};
+
+// Size of the trace window, including the callbacks of the range
+static size_t trig_size(const struct sim65_trace_trigger *t)
+{
+    return sizeof(struct trig) + (t->hi ? t->hi - t->lo + 1 : 0) * sizeof(sim65_callback);
+}
+
+// Maximum number of pending device events
+#define MAX_EVENTS 32
+
+// Device event, scheduled at a given cycle
+struct event
+{
+    uint64_t cycle;
+    sim65_event_cb cb;
+    void *data;
+};
+
+// Pending device events, a binary min-heap ordered by cycle
+struct events
+{
+    unsigned count;
+    unsigned done;          // Number of events executed
+    struct event heap[MAX_EVENTS];
+};
+
+// Labels, 32 bytes for each address, allocated by page when used
+struct labels
+{
+    char *page[256];
+};
+
+// Align to the cache line size, to keep the hot fields together
+#ifdef __GNUC__
+#define CACHE_ALIGN __attribute__((aligned(64)))
+#else
+#define CACHE_ALIGN
+#endif
+
 struct sim65s
 {
-    enum sim65_debug debug;
+    // Hot state, used by the simulation loop
+    struct cpu cpu;
+    _Atomic unsigned stop;          // Reasons to leave the block, stop_*
+    unsigned run_mode;              // Selects the simulation loop
+    uint64_t cycle_stop;            // Cycle of the next event or the limit
+    uint64_t cycle_limit;
     enum sim65_error error;
+    unsigned err_addr;
+    struct prof *prof;              // Profile information, if enabled
+    unsigned fuse_count[fuse_num];  // Executions of each fused sequence
+#ifdef SIM65_JIT
+    struct jit *jit;                // Native code translator, if active
+#endif
+    struct mpage pages[256] CACHE_ALIGN;
+    struct dblock **blocks[256];    // Decoded blocks, by page and address
+    uint8_t mem[MAXRAM] CACHE_ALIGN;
+    uint8_t mems[MAXRAM];
+    // Cold state
+    enum sim65_debug debug;
     enum sim65_error_lvl errlvl;
     FILE *trace_file;
-    unsigned err_addr;
-    uint64_t cycles;
-    uint64_t cycle_limit;
+    enum sim65_trace_fmt trace_fmt;
+    struct btrace *btrace;          // Binary trace buffer, if used
+    enum sim65_trace_async trace_async;
+    struct tring *tring;            // Asynchronous trace writer, if running
+    uint64_t trace_drops;           // Trace records dropped by the writer
+    struct trig *trig;              // Trace window, NULL to trace all
     unsigned do_prof;
-    struct sim65_reg r;
-    uint8_t p_valid;
-    uint8_t mem[MAXRAM];
-    uint8_t mems[MAXRAM];
-    sim65_callback cb_read[MAXRAM];
-    sim65_callback cb_write[MAXRAM];
-    sim65_callback cb_exec[MAXRAM];
-    struct {
-        unsigned exe[MAXRAM];   // Times this instruction was executed
-        unsigned branch[MAXRAM];// Times this branch was taken
-        unsigned branch_skip;   // Number of branches skipped
-        unsigned branch_taken;  // Number of branches taken
-        unsigned branch_extra;  // Extra cycles per branch to other page
-        unsigned abs_x_extra;   // Extra cycles per ABS,X crossing page
-        unsigned abs_y_extra;   // Extra cycles per ABS,Y crossing page
-        unsigned ind_y_extra;   // Extra cycles per (),Y crossing page
-        unsigned instructions;  // Number of instructions
-    } prof;
-    char *labels;
+    struct dblock *bfree;           // Invalidated blocks, to be freed
+    struct labels *labels;
+    struct events events;
+    unsigned irq;                   // Level of the IRQ line
+    unsigned nmi;                   // Level of the NMI line
+    unsigned nmi_edge;              // NMI transition not yet taken
+    struct idle idle;
+    unsigned idle_count;            // Number of idle loops skipped
+    uint64_t idle_cycles;           // Total cycles skipped in idle loops
+    void *user_data;                // Context for the callbacks
+};
+
+// Trace writers, defined with the text trace functions
+static void trace_ins(sim65 s);
+static void tring_sync(sim65 s);
+static void tring_stop(sim65 s);
+static void btrace_flush(sim65 s);
+static int trig_ins(sim65 s);
+
+// Minimum error level that makes each error stop the simulation, indexed
+// by the negated error code.
+static const uint8_t err_exit_lvl[] = {
+    [-sim65_err_exec_undef]  = sim65_errlvl_none,
+    [-sim65_err_exec_uninit] = sim65_errlvl_memory,
+    [-sim65_err_read_undef]  = sim65_errlvl_memory,
+    [-sim65_err_read_uninit] = sim65_errlvl_full,
+    [-sim65_err_write_undef] = sim65_errlvl_memory,
+    [-sim65_err_write_rom]   = sim65_errlvl_full,
+    [-sim65_err_break]       = sim65_errlvl_none,
+    [-sim65_err_invalid_ins] = sim65_errlvl_none,
+    [-sim65_err_call_ret]    = sim65_errlvl_none,
+    [-sim65_err_cycle_limit] = sim65_errlvl_none,
+    [-sim65_err_user]        = sim65_errlvl_none,
 };
 
-// Check if we should exit given this error, or simply log it
+// Check if we should exit given this error, or simply log it. This is only
+// called when an error was raised, the simulation loop tests "s->stop".
 static int get_error_exit(sim65 s)
 {
-    int e = 0;
-    switch (s->error)
-    {
-        case sim65_err_none:
-            // Never exit and don't print the error
-            return 0;
-        case sim65_err_read_uninit:
-        case sim65_err_write_rom:
-            e = (s->errlvl >= sim65_errlvl_full);
-            break;
-        case sim65_err_exec_uninit:
-        case sim65_err_read_undef:
-        case sim65_err_write_undef:
-            e = (s->errlvl >= sim65_errlvl_memory);
-            break;
-        case sim65_err_exec_undef:
-        case sim65_err_break:
-        case sim65_err_invalid_ins:
-        case sim65_err_call_ret:
-        case sim65_err_cycle_limit:
-        case sim65_err_user:
-            // Exit always
-            return 1;
-    }
-    if (!e)
-    {
-        sim65_dprintf(s, "%s at address %04x", sim65_error_str(s, s->error),
-                      s->err_addr);
-        s->error = sim65_err_none;
+    if (!s->error)
         return 0;
-    }
-    else
+    if (s->errlvl >= err_exit_lvl[-s->error])
         return s->error;
+    sim65_dprintf(s, "%s at address %04x", sim65_error_str(s, s->error),
+                  s->err_addr);
+    s->error = sim65_err_none;
+    s->stop &= ~stop_error;
+    return 0;
 }
 
 static char *get_label(sim65 s, uint16_t addr)
 {
-    if (s->labels)
-        return s->labels + addr * 32;
-    else
+    static char no_label[32];
+    if (!s->labels)
         return 0;
+    else if (s->labels->page[addr >> 8])
+        return s->labels->page[addr >> 8] + (addr & 0xFF) * 32;
+    else
+        return no_label;
+}
+
+#define LAZY_FLAGS (SIM65_FLAG_N | SIM65_FLAG_Z | SIM65_FLAG_C | SIM65_FLAG_V)
+
+// Returns the P register from the lazy flags
+static CPU_INLINE uint8_t get_p(const struct cpu *c)
+{
+    return (c->r.p & ~LAZY_FLAGS) | (c->fn & 0x80) | (c->fz ? 0 : SIM65_FLAG_Z) |
+           c->fc | c->fv;
+}
+
+// Sets the lazy flags from the P register
+static CPU_INLINE void load_p(struct cpu *c)
+{
+    c->fn = c->r.p;
+    c->fz = ~c->r.p & SIM65_FLAG_Z;
+    c->fc = c->r.p & SIM65_FLAG_C;
+    c->fv = c->r.p & SIM65_FLAG_V;
+}
+
+static CPU_INLINE void set_flags(struct cpu *c, uint8_t mask, uint8_t val)
+{
+    uint8_t chg = mask | val;
+    c->r.p = (c->r.p & ~mask) | val;
+    if (chg & SIM65_FLAG_N)
+        c->fn = val;
+    if (chg & SIM65_FLAG_Z)
+        c->fz = ~val & SIM65_FLAG_Z;
+    if (chg & SIM65_FLAG_C)
+        c->fc = val & SIM65_FLAG_C;
+    if (chg & SIM65_FLAG_V)
+        c->fv = val & SIM65_FLAG_V;
+#ifdef SIM65_CHECKED
+    c->p_valid &= ~mask;
+#endif
+}
+
+#ifdef SIM65_CHECKED
+static void print_uninit_flags(sim65 s, uint8_t flags)
+{
+    sim65_eprintf(s, "using uninitialized flags ($%02X) at PC=$%4X", flags, s->cpu.r.pc);
+}
+
+static CPU_INLINE void check_flags(sim65 s, struct cpu *c, uint8_t mask)
+{
+    if( 0 != (c->p_valid & mask) )
+    {
+        s->cpu = *c;
+        print_uninit_flags(s, c->p_valid & mask);
+    }
+}
+#else
+#define check_flags(s, c, mask) do { } while (0)
+#endif
+
+static CPU_INLINE uint8_t get_flags(sim65 s, struct cpu *c, uint8_t mask)
+{
+    check_flags(s, c, mask);
+    return get_p(c) & mask;
 }
 
-static void set_flags(sim65 s, uint8_t mask, uint8_t val)
+// Returns one flag, faster than get_flags
+static CPU_INLINE int get_flag(sim65 s, struct cpu *c, uint8_t flag)
 {
-    s->r.p = (s->r.p & ~mask) | val;
-    s->p_valid &= ~mask;
+    check_flags(s, c, flag);
+    switch (flag)
+    {
+        case SIM65_FLAG_N:
+            return c->fn & 0x80;
+        case SIM65_FLAG_Z:
+            return !c->fz;
+        case SIM65_FLAG_C:
+            return c->fc;
+        case SIM65_FLAG_V:
+            return c->fv;
+        default:
+            return c->r.p & flag;
+    }
 }
 
-static uint8_t get_flags(sim65 s, uint8_t mask)
+// Calls a memory or exec callback, the callback can read and modify the
+// registers so the flags must be updated.
+static int do_callback(sim65 s, sim65_callback cb, unsigned addr, int data)
 {
-    if( 0 != (s->p_valid & mask) )
-        sim65_eprintf(s, "using uninitialized flags ($%02X) at PC=$%4X",
-                      s->p_valid & mask, s->r.pc);
-    return s->r.p & mask;
+    int ret;
+    s->cpu.r.p = get_p(&s->cpu);
+    ret = cb(s, &s->cpu.r, addr, data);
+    load_p(&s->cpu);
+    return ret;
 }
 
 void sim65_set_flags(sim65 s, uint8_t flag, uint8_t val)
 {
-    set_flags(s, flag, val);
+    set_flags(&s->cpu, flag, val);
+}
+
+// Selects the simulation loop from the current options. With a trace
+// window, the trace loop keeps the window state even if not tracing.
+static void set_run_mode(sim65 s)
+{
+    unsigned mode = s->run_mode;
+    if (s->trig ? s->trig->active : s->debug >= sim65_debug_trace)
+        s->run_mode = run_mode_trace;
+    else
+        s->run_mode = (s->do_prof ? run_mode_prof : 0) |
+                      (s->cycle_stop != UINT64_MAX ? run_mode_limit : 0);
+    if (s->run_mode != mode)
+        s->stop |= stop_mode;
+}
+
+// Sets the cycle where the simulation loop must call the hooks, the first
+// of the next event and the cycle limit.
+static void set_cycle_stop(sim65 s)
+{
+    uint64_t stop = s->cycle_limit ? s->cycle_limit : UINT64_MAX;
+    if (s->events.count && s->events.heap[0].cycle < stop)
+        stop = s->events.heap[0].cycle;
+    if (s->trig && !s->trig->open && s->trig->t.start_cycle &&
+        s->trig->t.start_cycle < stop)
+        stop = s->trig->t.start_cycle;
+    s->cycle_stop = stop;
+    set_run_mode(s);
 }
 
 void sim65_set_cycle_limit(sim65 s, uint64_t limit)
 {
     if (limit)
-        s->cycle_limit = s->cycles + limit;
+        s->cycle_limit = s->cpu.cycles + limit;
     else
         s->cycle_limit = 0;
+    set_cycle_stop(s);
+}
+
+// Moves the event at position "i" of the heap up or down to its place
+static void event_fix(struct events *ev, unsigned i)
+{
+    struct event e = ev->heap[i];
+    while (i && ev->heap[(i - 1) / 2].cycle > e.cycle)
+    {
+        ev->heap[i] = ev->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    for (;;)
+    {
+        unsigned j = 2 * i + 1;
+        if (j >= ev->count)
+            break;
+        if (j + 1 < ev->count && ev->heap[j + 1].cycle < ev->heap[j].cycle)
+            j++;
+        if (ev->heap[j].cycle >= e.cycle)
+            break;
+        ev->heap[i] = ev->heap[j];
+        i = j;
+    }
+    ev->heap[i] = e;
+}
+
+// Removes the event at position "i" of the heap
+static void event_remove(struct events *ev, unsigned i)
+{
+    ev->count--;
+    if (i == ev->count)
+        return;
+    ev->heap[i] = ev->heap[ev->count];
+    event_fix(ev, i);
+}
+
+// Returns the position of the event with the given callback, or -1
+static int event_find(const struct events *ev, sim65_event_cb cb, void *data)
+{
+    unsigned i;
+    for (i = 0; i < ev->count; i++)
+        if (ev->heap[i].cb == cb && ev->heap[i].data == data)
+            return i;
+    return -1;
+}
+
+void sim65_schedule_event(sim65 s, uint64_t cycle, sim65_event_cb cb, void *data)
+{
+    struct events *ev = &s->events;
+    int i = event_find(ev, cb, data);
+    if (i < 0)
+    {
+        if (ev->count == MAX_EVENTS)
+        {
+            sim65_eprintf(s, "too many events, event lost");
+            return;
+        }
+        i = ev->count++;
+    }
+    ev->heap[i].cycle = cycle;
+    ev->heap[i].cb = cb;
+    ev->heap[i].data = data;
+    event_fix(ev, i);
+    set_cycle_stop(s);
+}
+
+void sim65_cancel_event(sim65 s, sim65_event_cb cb, void *data)
+{
+    int i = event_find(&s->events, cb, data);
+    if (i < 0)
+        return;
+    event_remove(&s->events, i);
+    set_cycle_stop(s);
+}
+
+// Sets the status of one byte, updating the page table entry
+static void set_mems(sim65 s, unsigned addr, uint8_t st)
+{
+    struct mpage *p = &s->pages[addr >> 8];
+    uint8_t old = s->mems[addr];
+    s->mems[addr] = st;
+    p->n_rd += !!(st & ~ms_direct_read) - !!(old & ~ms_direct_read);
+    p->n_wr += !!st - !!old;
+    p->rd = p->n_rd ? 0 : s->mem + (addr & 0xFF00);
+    p->wr = p->n_wr ? 0 : s->mem + (addr & 0xFF00);
+}
+
+// Returns the exec callback at the given address, if any
+static inline sim65_callback exec_callback(sim65 s, uint16_t addr)
+{
+    struct cb_page *cb = s->pages[addr >> 8].cb;
+    return cb ? cb->exec[addr & 0xFF] : 0;
+}
+
+// Invalidates all decoded blocks in the given memory page
+static void code_invalidate_page(sim65 s, unsigned page)
+{
+    struct dblock **b = s->blocks[page];
+    unsigned i;
+    if (!b)
+        return;
+    // Blocks are freed after the current block finishes executing
+    for (i = 0; i < 256; i++)
+        if (b[i])
+        {
+            b[i]->next = s->bfree;
+            s->bfree = b[i];
+            b[i] = 0;
+        }
+    for (i = page << 8; i < (page + 1) << 8; i++)
+        set_mems(s, i, s->mems[i] & ~ms_code);
+    s->stop |= stop_code;
+}
+
+// Invalidates decoded blocks in the given address range
+static void code_invalidate(sim65 s, unsigned addr, unsigned len)
+{
+    unsigned page;
+    if (!len)
+        return;
+    for (page = addr >> 8; page < 256 && page <= (addr + len - 1) >> 8; page++)
+        code_invalidate_page(s, page);
+}
+
+// Frees invalidated blocks
+static void code_gc(sim65 s)
+{
+    while (s->bfree)
+    {
+        struct dblock *b = s->bfree;
+        s->bfree = b->next;
+        free(b);
+    }
+    s->idle.block = 0;
+    s->stop &= ~stop_code;
 }
 
 sim65 sim65_new()
 {
-    sim65 s = (sim65)calloc(sizeof(struct sim65s), 1);
+    // Aligned, so the hot fields share cache lines
+    sim65 s = (sim65)aligned_alloc(64, sizeof(struct sim65s));
+    if (!s)
+        return 0;
+    memset(s, 0, sizeof(struct sim65s));
     s->trace_file = stderr;
-    s->r.s = 0xFF;
-    s->p_valid = 0xFF;
-    set_flags(s, 0xFF, 0x34);
+    s->cycle_stop = UINT64_MAX;
+    s->cpu.r.s = 0xFF;
+#ifdef SIM65_CHECKED
+    s->cpu.p_valid = 0xFF;
+#endif
+    set_flags(&s->cpu, 0xFF, 0x34);
     memset(s->mems, ms_undef | ms_invalid, MAXRAM * sizeof(s->mems[0]));
+    for (unsigned i = 0; i < 256; i++)
+        s->pages[i].n_rd = s->pages[i].n_wr = 256;
     return s;
 }
 
 void sim65_free(sim65 s)
 {
+    tring_stop(s);
+    for (unsigned i = 0; i < 256; i++)
+    {
+        code_invalidate_page(s, i);
+        free(s->blocks[i]);
+        free(s->pages[i].cb);
+        if (s->labels)
+            free(s->labels->page[i]);
+    }
+    code_gc(s);
+#ifdef SIM65_JIT
+    jit_free(s->jit);
+#endif
+    btrace_flush(s);
+    free(s->btrace);
+    free(s->trig);
     free(s->labels);
+    free(s->prof);
     free(s);
 }
 
+sim65 sim65_clone(const sim65 s)
+{
+    sim65 c = (sim65)aligned_alloc(64, sizeof(struct sim65s));
+    if (!c)
+        return 0;
+    memcpy(c, s, sizeof(struct sim65s));
+
+    // The clone starts without decoded code, events or resources of its own
+    c->stop = s->stop & (stop_error | stop_irq);
+    c->prof = 0;
+    c->btrace = 0;
+    c->tring = 0;
+    c->trig = 0;
+#ifdef SIM65_JIT
+    c->jit = 0;
+#endif
+    memset(c->blocks, 0, sizeof(c->blocks));
+    c->bfree = 0;
+    c->labels = 0;
+    c->events.count = 0;
+    c->idle.block = 0;
+    for (unsigned i = 0; i < 256; i++)
+        c->pages[i].cb = 0;
+    for (unsigned i = 0; i < MAXRAM; i++)
+        if (c->mems[i] & ms_code)
+            set_mems(c, i, c->mems[i] & ~ms_code);
+
+    for (unsigned i = 0; i < 256; i++)
+    {
+        // Direct access pointers point to the memory of the parent
+        struct mpage *p = &c->pages[i];
+        p->rd = p->n_rd ? 0 : c->mem + (i << 8);
+        p->wr = p->n_wr ? 0 : c->mem + (i << 8);
+        if (s->pages[i].cb)
+        {
+            p->cb = malloc(sizeof(struct cb_page));
+            if (!p->cb)
+                goto error;
+            memcpy(p->cb, s->pages[i].cb, sizeof(struct cb_page));
+        }
+    }
+    if (s->labels)
+    {
+        c->labels = calloc(1, sizeof(struct labels));
+        if (!c->labels)
+            goto error;
+        for (unsigned i = 0; i < 256; i++)
+            if (s->labels->page[i])
+            {
+                c->labels->page[i] = malloc(256 * 32);
+                if (!c->labels->page[i])
+                    goto error;
+                memcpy(c->labels->page[i], s->labels->page[i], 256 * 32);
+            }
+    }
+    if (s->trig)
+    {
+        size_t size = trig_size(&s->trig->t);
+        c->trig = malloc(size);
+        if (!c->trig)
+            goto error;
+        memcpy(c->trig, s->trig, size);
+    }
+    if (s->prof)
+    {
+        c->prof = malloc(sizeof(struct prof));
+        if (!c->prof)
+            goto error;
+        memcpy(c->prof, s->prof, sizeof(struct prof));
+    }
+#ifdef SIM65_JIT
+    if (s->jit && !sim65_set_jit(c, 1))
+        goto error;
+#endif
+    set_cycle_stop(c);
+    return c;
+
+error:
+    sim65_free(c);
+    return 0;
+}
+
 void sim65_add_ram(sim65 s, unsigned addr, unsigned len)
 {
     unsigned end = addr + len;
@@ -173,7 +731,7 @@ void sim65_add_ram(sim65 s, unsigned addr, unsigned len)
     if (end >= MAXRAM)
         end = MAXRAM;
     for (; addr < end; addr++)
-        s->mems[addr] &= ~ms_undef;
+        set_mems(s, addr, s->mems[addr] & ~ms_undef);
 }
 
 void sim65_add_zeroed_ram(sim65 s, unsigned addr, unsigned len)
@@ -183,9 +741,10 @@ void sim65_add_zeroed_ram(sim65 s, unsigned addr, unsigned len)
         return;
     if (end >= MAXRAM)
         end = MAXRAM;
+    code_invalidate(s, addr, end - addr);
     for (; addr < end; addr++)
     {
-        s->mems[addr] &= ~(ms_undef | ms_rom | ms_invalid);
+        set_mems(s, addr, s->mems[addr] & ~(ms_undef | ms_rom | ms_invalid));
         s->mem[addr] = 0;
     }
 }
@@ -197,9 +756,10 @@ void sim65_add_data_ram(sim65 s, unsigned addr, const unsigned char *data, unsig
         return;
     if (end >= MAXRAM)
         end = MAXRAM;
+    code_invalidate(s, addr, end - addr);
     for (; addr < end; addr++, data++)
     {
-        s->mems[addr] &= ~(ms_undef | ms_rom | ms_invalid);
+        set_mems(s, addr, s->mems[addr] & ~(ms_undef | ms_rom | ms_invalid));
         s->mem[addr] = *data;
     }
 }
@@ -211,31 +771,49 @@ void sim65_add_data_rom(sim65 s, unsigned addr, const unsigned char *data, unsig
         return;
     if (end >= MAXRAM)
         end = MAXRAM;
+    code_invalidate(s, addr, end - addr);
     for (; addr < end; addr++, data++)
     {
-        s->mems[addr] &= ~(ms_undef | ms_invalid);
-        s->mems[addr] |= ms_rom;
+        set_mems(s, addr, (s->mems[addr] & ~(ms_undef | ms_invalid)) | ms_rom);
         s->mem[addr] = *data;
     }
 }
 
 void sim65_add_callback(sim65 s, unsigned addr, sim65_callback cb, enum sim65_cb_type type)
 {
+    struct cb_page *p;
     if (addr >= MAXRAM)
         return;
-    s->mems[addr] |= ms_callback;
+    // Allocate callbacks of the page on first use
+    p = s->pages[addr >> 8].cb;
+    if (!p)
+    {
+        p = calloc(1, sizeof(struct cb_page));
+        if (!p)
+            return;
+        s->pages[addr >> 8].cb = p;
+    }
+    code_invalidate(s, addr, 1);
+    set_mems(s, addr, s->mems[addr] | ms_callback);
     switch (type)
     {
         case sim65_cb_read:
-            s->cb_read[addr] = cb;
+            p->read[addr & 0xFF] = cb;
             break;
         case sim65_cb_write:
-            s->cb_write[addr] = cb;
+            p->write[addr & 0xFF] = cb;
             break;
         case sim65_cb_exec:
-            s->cb_exec[addr] = cb;
+            p->exec[addr & 0xFF] = cb;
+            break;
+        case sim65_cb_event:
+            p->event[addr & 0xFF] = cb;
             break;
     }
+    // Clear the status if all callbacks were removed
+    unsigned i = addr & 0xFF;
+    if (!p->read[i] && !p->write[i] && !p->exec[i] && !p->event[i])
+        set_mems(s, addr, s->mems[addr] & ~ms_callback);
 }
 
 void sim65_add_callback_range(sim65 s, unsigned addr, unsigned len, sim65_callback cb,
@@ -262,15 +840,44 @@ uint8_t *sim65_get_pbyte(sim65 s, unsigned addr)
     return & s->mem[addr];
 }
 
-void set_error(sim65 s, int e, uint16_t addr)
+void sim65_mem_changed(sim65 s, unsigned addr, unsigned len)
+{
+    if (addr < MAXRAM && len)
+        code_invalidate(s, addr, len);
+}
+
+static void set_error(sim65 s, int e, uint16_t addr)
 {
     if (e < 0 && !s->error)
     {
         s->error = (enum sim65_error)e;
+        s->stop |= stop_error;
         s->err_addr = addr;
     }
 }
 
+// Calls the callbacks of the events scheduled up to the current cycle
+static void run_events(sim65 s)
+{
+    struct events *ev = &s->events;
+    while (ev->count && ev->heap[0].cycle <= s->cpu.cycles)
+    {
+        struct event e = ev->heap[0];
+        event_remove(ev, 0);
+        ev->done++;
+        set_error(s, e.cb(s, e.data), s->cpu.r.pc);
+    }
+    set_cycle_stop(s);
+}
+
+// Devices only update their state at scheduled events, so the events up to
+// the current cycle must run before accessing a device register.
+static inline void events_catch_up(sim65 s)
+{
+    if (unlikely(s->events.count && s->events.heap[0].cycle <= s->cpu.cycles))
+        run_events(s);
+}
+
 static uint8_t readPc_slow(sim65 s, uint16_t addr)
 {
     if (s->mems[addr] & ms_undef)
@@ -282,17 +889,20 @@ static uint8_t readPc_slow(sim65 s, uint16_t addr)
 
 static inline uint8_t readPc(sim65 s, unsigned offset)
 {
-    uint16_t addr = s->r.pc + offset;
-    return likely(!(s->mems[addr] & ~(ms_rom | ms_callback))) ?
+    uint16_t addr = s->cpu.r.pc + offset;
+    return likely(!(s->mems[addr] & ~(ms_rom | ms_callback | ms_code))) ?
            s->mem[addr] : readPc_slow(s, addr);
 }
 
 static uint8_t readByte_slow(sim65 s, uint16_t addr)
 {
     // Unusual memory
-    if ((s->mems[addr] & ms_callback) && s->cb_read[addr])
+    struct cb_page *cb = s->pages[addr >> 8].cb;
+    if ((s->mems[addr] & ms_callback) && cb->read[addr & 0xFF])
     {
-        int e = s->cb_read[addr](s, &s->r, addr, sim65_cb_read);
+        int e;
+        events_catch_up(s);
+        e = do_callback(s, cb->read[addr & 0xFF], addr, sim65_cb_read);
         set_error(s, e, addr);
         return e;
     }
@@ -300,81 +910,142 @@ static uint8_t readByte_slow(sim65 s, uint16_t addr)
     {
         if (s->mems[addr] & ms_undef)
             set_error(s, sim65_err_read_undef, addr);
-        else
+        else if (s->mems[addr] & ms_invalid)
         {
             set_error(s, sim65_err_read_uninit, addr);
-            s->mems[addr] &= ~ms_invalid; // Initializes the memory
+            set_mems(s, addr, s->mems[addr] & ~ms_invalid); // Initializes the memory
         }
         return s->mem[addr];
     }
 }
 
-static inline uint8_t readByte(sim65 s, uint16_t addr)
+static CPU_INLINE uint8_t readByte(sim65 s, struct cpu *c, uint16_t addr)
+{
+    uint8_t val;
+    const uint8_t *p = s->pages[addr >> 8].rd;
+    if (likely(p))
+        return p[addr & 0xFF];
+    if (likely(!(s->mems[addr] & ~ms_direct_read)))
+        return s->mem[addr];
+    // Callbacks see and can modify the registers
+    s->cpu = *c;
+    val = readByte_slow(s, addr);
+    *c = s->cpu;
+    return val;
+}
+
+// Writes to memory without write callbacks
+static void store_byte(sim65 s, uint16_t addr, uint8_t val)
 {
-    return likely(!(s->mems[addr] & ~ms_rom)) ? s->mem[addr] : readByte_slow(s, addr);
+    if (s->mems[addr] & ms_undef)
+        set_error(s, sim65_err_write_undef, addr);
+    else if (s->mems[addr] & ms_rom)
+        set_error(s, sim65_err_write_rom, addr);
+    else
+    {
+        // RAM with only exec or event callbacks
+        if (s->mems[addr] & ms_code)
+            code_invalidate_page(s, addr >> 8);
+        s->mem[addr] = val;
+        set_mems(s, addr, s->mems[addr] & ~ms_invalid);
+    }
 }
 
 static void writeByte_slow(sim65 s, uint16_t addr, uint8_t val)
 {
-    if (likely(!(s->mems[addr] & ~ms_invalid)))
+    struct cb_page *cb = s->pages[addr >> 8].cb;
+    if (likely(!(s->mems[addr] & ~(ms_invalid | ms_code))))
     {
+        // Writes over decoded code invalidate the blocks in the page
+        if (s->mems[addr] & ms_code)
+            code_invalidate_page(s, addr >> 8);
         s->mem[addr] = val;
-        s->mems[addr] = 0;
+        set_mems(s, addr, 0);
     }
-    else if ((s->mems[addr] & ms_callback) && s->cb_write[addr])
-        set_error(s, s->cb_write[addr](s, &s->r, addr, val), addr);
-    else if (s->mems[addr] & ms_undef)
-        set_error(s, sim65_err_write_undef, addr);
-    else if (s->mems[addr] & ms_rom)
-        set_error(s, sim65_err_write_rom, addr);
+    else if ((s->mems[addr] & ms_callback) && cb->write[addr & 0xFF])
+    {
+        events_catch_up(s);
+        set_error(s, do_callback(s, cb->write[addr & 0xFF], addr, val), addr);
+    }
+    else
+        store_byte(s, addr, val);
 }
 
-static inline void writeByte(sim65 s, uint16_t addr, uint8_t val)
+static CPU_INLINE void writeByte(sim65 s, struct cpu *c, uint16_t addr, uint8_t val)
 {
-    if (likely(!(s->mems[addr])))
+    uint8_t *p = s->pages[addr >> 8].wr;
+    if (likely(p))
+        p[addr & 0xFF] = val;
+    else if (likely(!s->mems[addr]))
         s->mem[addr] = val;
     else
+    {
+        s->cpu = *c;
         writeByte_slow(s, addr, val);
+        *c = s->cpu;
+    }
 }
 
-static inline uint16_t readWord(sim65 s, uint16_t addr)
+static CPU_INLINE uint16_t readWord(sim65 s, struct cpu *c, uint16_t addr)
 {
-    uint16_t d1 = readByte(s, addr);
-    return d1 | (readByte(s, addr + 1) << 8);
+    uint16_t d1 = readByte(s, c, addr);
+    return d1 | (readByte(s, c, addr + 1) << 8);
 }
 
-static uint8_t readIndX(sim65 s, unsigned addr)
+static CPU_INLINE uint8_t readIndX(sim65 s, struct cpu *c, unsigned addr)
 {
-    s->cycles += 6;
-    addr = readWord(s, (addr + s->r.x) & 0xFF);
-    return readByte(s, addr);
+    c->cycles += 6;
+    addr = readWord(s, c, (addr + c->r.x) & 0xFF);
+    return readByte(s, c, addr);
 }
 
-static int readIndY(sim65 s, unsigned addr)
+static CPU_INLINE int readIndY(sim65 s, struct cpu *c, unsigned addr, int prof)
 {
-    s->cycles += 5;
-    addr = readWord(s, addr & 0xFF);
-    if (unlikely(((addr & 0xFF) + s->r.y) > 0xFF))
+    c->cycles += 5;
+    addr = readWord(s, c, addr & 0xFF);
+    if (unlikely(((addr & 0xFF) + c->r.y) > 0xFF))
     {
-        s->cycles++;
-        if (s->do_prof)
-            s->prof.ind_y_extra ++;
+        c->cycles++;
+        if (prof)
+            s->prof->ind_y_extra ++;
     }
-    return readByte(s, 0xFFFF & (addr + s->r.y));
+    return readByte(s, c, 0xFFFF & (addr + c->r.y));
+}
+
+static CPU_INLINE void writeIndX(sim65 s, struct cpu *c, unsigned addr, unsigned val)
+{
+    c->cycles += 6;
+    addr = readWord(s, c, (addr + c->r.x) & 0xFF);
+    writeByte(s, c, addr, val);
+}
+
+static CPU_INLINE void writeIndY(sim65 s, struct cpu *c, unsigned addr, unsigned val)
+{
+    c->cycles += 6;
+    addr = readWord(s, c, addr & 0xFF);
+    writeByte(s, c, 0xFFFF & (addr + c->r.y), val);
 }
 
-static void writeIndX(sim65 s, unsigned addr, unsigned val)
+// Used by fused instructions, true if the access to the address can't
+// raise errors, call callbacks or modify decoded code.
+static inline int plain_read(sim65 s, uint16_t addr)
 {
-    s->cycles += 6;
-    addr = readWord(s, (addr + s->r.x) & 0xFF);
-    writeByte(s, addr, val);
+    return !(s->mems[addr] & ~ms_direct_read);
 }
 
-static void writeIndY(sim65 s, unsigned addr, unsigned val)
+static inline int plain_write(sim65 s, uint16_t addr)
 {
-    s->cycles += 6;
-    addr = readWord(s, addr & 0xFF);
-    writeByte(s, 0xFFFF & (addr + s->r.y), val);
+    return !s->mems[addr];
+}
+
+// Same, for an indirect Y access, this reads the pointer as readIndY.
+static CPU_INLINE int plain_ind_y(sim65 s, const struct cpu *c, unsigned addr, int write)
+{
+    uint16_t ptr = addr & 0xFF;
+    if (!plain_read(s, ptr) || !plain_read(s, ptr + 1))
+        return 0;
+    addr = (s->mem[ptr] | (s->mem[(uint16_t)(ptr + 1)] << 8)) + c->r.y;
+    return write ? plain_write(s, addr) : plain_read(s, addr);
 }
 
 #define FLAG_C SIM65_FLAG_C
@@ -385,154 +1056,162 @@ static void writeIndY(sim65 s, unsigned addr, unsigned val)
 #define FLAG_V SIM65_FLAG_V
 #define FLAG_N SIM65_FLAG_N
 
-#define SETZ(a) set_flags(s, FLAG_Z,  (a)&0xFF ? 0 : FLAG_Z)
-#define SETC(a) set_flags(s, FLAG_C,  (a) ? FLAG_C : 0)
-#define SETV(a) set_flags(s, FLAG_V,  (a) ? FLAG_V : 0)
-#define SETD(a) set_flags(s, FLAG_D,  (a) ? FLAG_D : 0)
-#define SETN(a) set_flags(s, FLAG_N,  (a)&0x80 ? FLAG_N : 0)
-#define SETI(a) set_flags(s, FLAG_I,  (a) ? FLAG_I : 0)
-#define GETC    get_flags(s, FLAG_C)
-#define GETD    get_flags(s, FLAG_D)
+#ifdef SIM65_CHECKED
+#define VALID(f) c->p_valid &= ~(f),
+#else
+#define VALID(f)
+#endif
+#define SETZ(a) (VALID(FLAG_Z) c->fz = (a))
+#define SETC(a) (VALID(FLAG_C) c->fc = (a) ? 1 : 0)
+#define SETV(a) (VALID(FLAG_V) c->fv = (a) ? FLAG_V : 0)
+#define SETD(a) set_flags(c, FLAG_D,  (a) ? FLAG_D : 0)
+#define SETN(a) (VALID(FLAG_N) c->fn = (a))
+#define SETI(a) set_flags(c, FLAG_I,  (a) ? FLAG_I : 0)
+#define GETC    get_flag(s, c, FLAG_C)
+#define GETD    get_flag(s, c, FLAG_D)
+
+#ifdef SIM65_CHECKED
+// Checks a table result against the reference implementation
+static void check_alu(sim65 s, struct cpu *c, unsigned r, unsigned ref)
+{
+    if (r != ref)
+    {
+        s->cpu = *c;
+        sim65_eprintf(s, "ALU table mismatch ($%04X, expected $%04X) at PC=$%4X",
+                      r, ref, c->r.pc);
+    }
+}
+#define CHECK_ALU(r, ref) check_alu(s, c, r, ref)
+#else
+#define CHECK_ALU(r, ref) do { } while (0)
+#endif
+
+// Sets A and the flags from a packed ALU table result
+static CPU_INLINE void set_alu(struct cpu *c, unsigned r)
+{
+    c->r.a = r & 0xFF;
+    r >>= 8;
+    c->fn = r;
+    c->fz = ~r & FLAG_Z;
+    c->fc = r & FLAG_C;
+    c->fv = r & FLAG_V;
+#ifdef SIM65_CHECKED
+    c->p_valid &= ~LAZY_FLAGS;
+#endif
+}
 
 // Implements ADC instruction, adding the accumulator with the given value.
-static void do_adc(sim65 s, unsigned val)
+static CPU_INLINE void do_adc(sim65 s, struct cpu *c, unsigned val)
 {
     if (GETD)
     {
-        // Decimal mode:
-        // Z flag is computed as the binary version.
-        unsigned tmp = s->r.a + val + (GETC ? 1 : 0);
-        SETZ(tmp);
-        // ADC value is computed in decimal
-        tmp = (s->r.a & 0xF) + (val & 0xF) + (GETC ? 1 : 0);
-        if (tmp >= 10)
-            tmp = (tmp - 10) | 16;
-        tmp += (s->r.a & 0xF0) + (val & 0xF0);
-        SETN(tmp);
-        SETV(!((s->r.a ^ val) & 0x80) && ((val ^ tmp) & 0x80));
-        if (tmp > 0x9F)
-            tmp += 0x60;
-        SETC(tmp > 0xFF);
-        s->r.a = tmp & 0xFF;
+        // Decimal mode, from the table
+        unsigned r = alu_adc_tab[ALU_INDEX(GETC, c->r.a, val)];
+        CHECK_ALU(r, alu_adc_dec(c->r.a, val, GETC));
+        set_alu(c, r);
     }
     else
     {
         // Binary mode
-        unsigned tmp = s->r.a + val + (GETC ? 1 : 0);
-        SETV(((~(s->r.a ^ val)) & (s->r.a ^ tmp)) & 0x80);
-        //  SETV(!((s->r.a ^ val) & 0x80) && ((val ^ tmp) & 0x80));
+        unsigned tmp = c->r.a + val + (GETC ? 1 : 0);
+        SETV(((~(c->r.a ^ val)) & (c->r.a ^ tmp)) & 0x80);
+        //  SETV(!((c->r.a ^ val) & 0x80) && ((val ^ tmp) & 0x80));
         SETC(tmp > 0xFF);
         SETN(tmp);
         SETZ(tmp);
-        s->r.a = tmp & 0xFF;
+        c->r.a = tmp & 0xFF;
     }
 }
 
 // Implements SBC instruction, subtract the accumulator to the given value.
-static void do_sbc(sim65 s, unsigned val)
+static CPU_INLINE void do_sbc(sim65 s, struct cpu *c, unsigned val)
 {
     if (GETD)
     {
-        // Decimal mode:
-        val = val ^ 0xFF;
-
-        // Z and V flags computed as the binary version.
-        unsigned tmp = s->r.a + val + (GETC ? 1 : 0);
-        SETV((((s->r.a ^ val)) & (s->r.a ^ tmp)) & 0x80);
-        SETZ(tmp);
-
-        // ADC value is computed in decimal
-        tmp = (s->r.a & 0xF) + (val & 0xF) + (GETC ? 1 : 0);
-        if (tmp < 0x10)
-            tmp = (tmp - 6) & 0x0F;
-
-        tmp += (s->r.a & 0xF0) + (val & 0xF0);
-        if (tmp < 0x100)
-            tmp = (tmp - 0x60) & 0xFF;
-
-        SETN(tmp);
-        SETC(tmp > 0xFF);
-        s->r.a = tmp & 0xFF;
+        // Decimal mode, from the table
+        unsigned r = alu_sbc_tab[ALU_INDEX(GETC, c->r.a, val)];
+        CHECK_ALU(r, alu_sbc_dec(c->r.a, val, GETC));
+        set_alu(c, r);
     }
     else
     {
         // Binary mode
-        unsigned tmp = s->r.a + 0xFF - val + (GETC ? 1 : 0);
-        SETV((((s->r.a ^ val)) & (s->r.a ^ tmp)) & 0x80);
+        unsigned tmp = c->r.a + 0xFF - val + (GETC ? 1 : 0);
+        SETV((((c->r.a ^ val)) & (c->r.a ^ tmp)) & 0x80);
         SETC(tmp > 0xFF);
         SETN(tmp);
         SETZ(tmp);
-        s->r.a = tmp & 0xFF;
+        c->r.a = tmp & 0xFF;
     }
 }
 
-// Implements branch instructions
-static void do_branch(sim65 s, int8_t off, uint8_t mask, int cond)
+// Implements branch instructions, "prof" is true if profiling
+static CPU_INLINE void do_branch(sim65 s, struct cpu *c, int8_t off, uint8_t mask, int cond, int prof)
 {
-    s->cycles += 2;
-    if (!get_flags(s, mask) == !cond)
+    c->cycles += 2;
+    if (!get_flag(s, c, mask) == !cond)
     {
-        s->cycles++;
-        if (s->do_prof)
+        c->cycles++;
+        if (prof)
         {
-            s->prof.branch[(s->r.pc-2) & 0xFFFF] ++;
-            s->prof.branch_taken ++;
+            s->prof->branch[(c->r.pc-2) & 0xFFFF] ++;
+            s->prof->branch_taken ++;
         }
-        uint16_t val = (s->r.pc + off) & 0xFFFF;
-        if ((val & 0xFF00) != (s->r.pc & 0xFF00))
+        uint16_t val = (c->r.pc + off) & 0xFFFF;
+        if ((val & 0xFF00) != (c->r.pc & 0xFF00))
         {
-            s->cycles++;
-            if (s->do_prof)
-                s->prof.branch_extra ++;
+            c->cycles++;
+            if (prof)
+                s->prof->branch_extra ++;
         }
-        s->r.pc = val;
+        c->r.pc = val;
     }
-    else if (s->do_prof)
-        s->prof.branch_skip ++;
+    else if (prof)
+        s->prof->branch_skip ++;
 }
 
-static void do_extra_absx(sim65 s, unsigned addr)
+static CPU_INLINE void do_extra_absx(sim65 s, struct cpu *c, unsigned addr, int prof)
 {
-    if (((addr & 0xFF) + s->r.x) > 0xFF)
+    if (((addr & 0xFF) + c->r.x) > 0xFF)
     {
-        s->cycles++;
-        if (s->do_prof)
-            s->prof.abs_x_extra ++;
+        c->cycles++;
+        if (prof)
+            s->prof->abs_x_extra ++;
     }
 }
 
-static void do_extra_absy(sim65 s, unsigned addr)
+static CPU_INLINE void do_extra_absy(sim65 s, struct cpu *c, unsigned addr, int prof)
 {
-    if (((addr & 0xFF) + s->r.y) > 0xFF)
+    if (((addr & 0xFF) + c->r.y) > 0xFF)
     {
-        s->cycles++;
-        if (s->do_prof)
-            s->prof.abs_y_extra ++;
+        c->cycles++;
+        if (prof)
+            s->prof->abs_y_extra ++;
     }
 }
 
-#define ZP_R1   val = readByte(s, data & 0xFF)
-#define ZP_W1   writeByte(s, data & 0xFF, val)
-#define ZPX_R1  val = readByte(s, (data + s->r.x) & 0xFF)
-#define ZPX_W1  writeByte(s, (data + s->r.x) & 0xFF, val)
-#define ZPY_R1  val = readByte(s, (data + s->r.y) & 0xFF)
-#define ZPY_W1  writeByte(s, (data + s->r.y) & 0xFF, val)
-#define ABS_R1  val = readByte(s, data)
-#define ABS_W1  writeByte(s, data, val)
-#define ABX_R1  val = readByte(s, data + s->r.x)
-#define ABX_W1  writeByte(s, data + s->r.x, val)
-#define ABY_R1  val = readByte(s, data + s->r.y)
-#define ABY_W1  writeByte(s, data + s->r.y, val)
-#define IND_X(op)  val = readIndX(s, data); op
-#define IND_Y(op)  val = readIndY(s, data); op
-#define INDW_X(op) op; writeIndX(s, data, val)
-#define INDW_Y(op) op; writeIndY(s, data, val)
-
-#define ORA s->r.a |= val; SETZ(s->r.a); SETN(s->r.a)
-#define AND s->r.a &= val; SETZ(s->r.a); SETN(s->r.a)
-#define EOR s->r.a ^= val; SETZ(s->r.a); SETN(s->r.a)
-#define ADC do_adc(s, val)
-#define SBC do_sbc(s, val)
+#define ZP_R1   val = readByte(s, c, data & 0xFF)
+#define ZP_W1   writeByte(s, c, data & 0xFF, val)
+#define ZPX_R1  val = readByte(s, c, (data + c->r.x) & 0xFF)
+#define ZPX_W1  writeByte(s, c, (data + c->r.x) & 0xFF, val)
+#define ZPY_R1  val = readByte(s, c, (data + c->r.y) & 0xFF)
+#define ZPY_W1  writeByte(s, c, (data + c->r.y) & 0xFF, val)
+#define ABS_R1  val = readByte(s, c, data)
+#define ABS_W1  writeByte(s, c, data, val)
+#define ABX_R1  val = readByte(s, c, data + c->r.x)
+#define ABX_W1  writeByte(s, c, data + c->r.x, val)
+#define ABY_R1  val = readByte(s, c, data + c->r.y)
+#define ABY_W1  writeByte(s, c, data + c->r.y, val)
+#define IND_X(op)  val = readIndX(s, c, data); op
+#define IND_Y(op)  val = readIndY(s, c, data, RUN_PROF); op
+#define INDW_X(op) op; writeIndX(s, c, data, val)
+#define INDW_Y(op) op; writeIndY(s, c, data, val)
+
+#define ORA c->r.a |= val; SETZ(c->r.a); SETN(c->r.a)
+#define AND c->r.a &= val; SETZ(c->r.a); SETN(c->r.a)
+#define EOR c->r.a ^= val; SETZ(c->r.a); SETN(c->r.a)
+#define ADC do_adc(s, c, val)
+#define SBC do_sbc(s, c, val)
 #define ASL SETC(val & 0x80); val = (val << 1) & 0xFF; SETZ(val); SETN(val)
 #define ROL val = (val << 1) | (GETC ? 1 : 0); SETC(val & 256); val &= 0xFF; SETZ(val); SETN(val)
 #define LSR SETC(val & 1); val=(val >> 1) & 0xFF; SETZ(val); SETN(val)
@@ -541,326 +1220,620 @@ static void do_extra_absy(sim65 s, unsigned addr)
 #define SET_ZN   SETN(val); SETZ(val)
 #define DEC val = (val - 1) & 0xFF; SET_ZN
 #define INC val = (val + 1) & 0xFF; SET_ZN
-#define CMP val = (s->r.a + 0x100 - val); SET_ZN; SETC(val > 0xFF)
-#define CPX val = (s->r.x + 0x100 - val); SET_ZN; SETC(val > 0xFF)
-#define CPY val = (s->r.y + 0x100 - val); SET_ZN; SETC(val > 0xFF)
-
-#define LDA SET_ZN; s->r.a = val
-#define LDX SET_ZN; s->r.x = val
-#define LDY SET_ZN; s->r.y = val
-#define STA val = s->r.a
-#define STX val = s->r.x
-#define STY val = s->r.y
-#define PUSH(val) s->cycles += 3; writeByte(s, 0x100 + s->r.s,val); s->r.s = (s->r.s - 1) & 0xFF
-#define POP  s->r.s = (s->r.s + 1) & 0xFF; val = readByte(s, 0x100 + s->r.s)
+#define CMP val = (c->r.a + 0x100 - val); SET_ZN; SETC(val > 0xFF)
+#define CPX val = (c->r.x + 0x100 - val); SET_ZN; SETC(val > 0xFF)
+#define CPY val = (c->r.y + 0x100 - val); SET_ZN; SETC(val > 0xFF)
+
+#define LDA SET_ZN; c->r.a = val
+#define LDX SET_ZN; c->r.x = val
+#define LDY SET_ZN; c->r.y = val
+#define STA val = c->r.a
+#define STX val = c->r.x
+#define STY val = c->r.y
+#define PUSH(val) c->cycles += 3; writeByte(s, c, 0x100 + c->r.s,val); c->r.s = (c->r.s - 1) & 0xFF
+#define POP  c->r.s = (c->r.s + 1) & 0xFF; val = readByte(s, c, 0x100 + c->r.s)
 
 // Complete ops
-#define ZP_R(op)   s->cycles += 3; ZP_R1; op
-#define ZP_W(op)   s->cycles += 3; op; ZP_W1
-#define ZP_RW(op)  s->cycles += 5; ZP_R1; op; ZP_W1
+#define ZP_R(op)   c->cycles += 3; ZP_R1; op
+#define ZP_W(op)   c->cycles += 3; op; ZP_W1
+#define ZP_RW(op)  c->cycles += 5; ZP_R1; op; ZP_W1
+
+#define ABS_R(op)  c->cycles += 4; ABS_R1; op
+#define ABS_W(op)  c->cycles += 4; op; ABS_W1
+#define ABS_RW(op) c->cycles += 6; ABS_R1; op; ABS_W1
 
-#define ABS_R(op)  s->cycles += 4; ABS_R1; op
-#define ABS_W(op)  s->cycles += 4; op; ABS_W1
-#define ABS_RW(op) s->cycles += 6; ABS_R1; op; ABS_W1
+#define ZPX_R(op)   c->cycles += 4; ZPX_R1; op
+#define ZPX_W(op)   c->cycles += 4; op; ZPX_W1
+#define ZPX_RW(op)  c->cycles += 6; ZPX_R1; op; ZPX_W1
 
-#define ZPX_R(op)   s->cycles += 4; ZPX_R1; op
-#define ZPX_W(op)   s->cycles += 4; op; ZPX_W1
-#define ZPX_RW(op)  s->cycles += 6; ZPX_R1; op; ZPX_W1
+#define ZPY_R(op)   c->cycles += 4; ZPY_R1; op
+#define ZPY_W(op)   c->cycles += 4; op; ZPY_W1
 
-#define ZPY_R(op)   s->cycles += 4; ZPY_R1; op
-#define ZPY_W(op)   s->cycles += 4; op; ZPY_W1
+#define ABX_R(op)   c->cycles += 4; do_extra_absx(s, c, data, RUN_PROF); ABX_R1; op
+#define ABX_W(op)   c->cycles += 5; op; ABX_W1
+#define ABX_RW(op)  c->cycles += 7; ABX_R1; op; ABX_W1
 
-#define ABX_R(op)   s->cycles += 4; do_extra_absx(s, data); ABX_R1; op
-#define ABX_W(op)   s->cycles += 5; op; ABX_W1
-#define ABX_RW(op)  s->cycles += 7; ABX_R1; op; ABX_W1
+#define ABY_R(op)   c->cycles += 4; do_extra_absy(s, c, data, RUN_PROF); ABY_R1; op
+#define ABY_W(op)   c->cycles += 5; op; ABY_W1
 
-#define ABY_R(op)   s->cycles += 4; do_extra_absy(s, data); ABY_R1; op
-#define ABY_W(op)   s->cycles += 5; op; ABY_W1
+#define IMM(op)     c->cycles += 2; val = data; op
+#define IMP_A(op)   c->cycles += 2; val = c->r.a; op; c->r.a = val; SET_ZN
+#define IMP_Y(op)   c->cycles += 2; val = c->r.y; op; c->r.y = val; SET_ZN
+#define IMP_X(op)   c->cycles += 2; val = c->r.x; op; c->r.x = val; SET_ZN
+#define TXS(op)     c->cycles += 2; c->r.s = c->r.x;
 
-#define IMM(op)     s->cycles += 2; val = data; op
-#define IMP_A(op)   s->cycles += 2; val = s->r.a; op; s->r.a = val; SET_ZN
-#define IMP_Y(op)   s->cycles += 2; val = s->r.y; op; s->r.y = val; SET_ZN
-#define IMP_X(op)   s->cycles += 2; val = s->r.x; op; s->r.x = val; SET_ZN
-#define TXS(op)     s->cycles += 2; s->r.s = s->r.x;
+#define BRA_0(a)    do_branch(s, c, data, a, 0, RUN_PROF)
+#define BRA_1(a)    do_branch(s, c, data, a, 1, RUN_PROF)
+#define JMP()      c->cycles += 3; c->r.pc = data
+#define JMP16()    c->cycles += 5; c->r.pc = readWord(s, c, data)
+#define JSR()      do_jsr(s, c, data)
+#define RTS()      do_rts(s, c)
+#define RTI()      do_rti(s, c)
 
-#define BRA_0(a)    do_branch(s, data, a, 0)
-#define BRA_1(a)    do_branch(s, data, a, 1)
-#define JMP()      s->cycles += 3; s->r.pc = data
-#define JMP16()    s->cycles += 5; s->r.pc = readWord(s, data)
-#define JSR()      do_jsr(s, data)
-#define RTS()      do_rts(s)
-#define RTI()      do_rti(s)
+#define CL_F(f)   c->cycles += 2; set_flags(c, f, 0)
+#define SE_F(f)   c->cycles += 2; set_flags(c, f, f)
 
-#define CL_F(f)   s->cycles += 2; set_flags(s, f, 0)
-#define SE_F(f)   s->cycles += 2; set_flags(s, f, f)
+#define POP_P  c->cycles += 4; POP; set_flags(c, 0xFF, val | 0x30)
 
-#define POP_P  s->cycles += 4; POP; set_flags(s, 0xFF, val | 0x30)
-#define POP_A  s->cycles += 4; POP; LDA
+// After clearing the I flag, leave the block to take an active IRQ
+#define IRQ_CHECK                                                             \
+    if (unlikely(s->irq) && !(c->r.p & FLAG_I))                               \
+        s->stop |= stop_irq
+#define POP_A  c->cycles += 4; POP; LDA
 
 // Special case BIT instructions as sometimes are used to SKIP
-void do_bit(sim65 s, uint16_t addr)
+static CPU_INLINE void do_bit(sim65 s, struct cpu *c, uint16_t addr)
 {
     if ((s->mems[addr] & ms_invalid) && !(s->mems[addr] & ms_callback))
-        s->p_valid |= (FLAG_N | FLAG_V | FLAG_Z);
+    {
+#ifdef SIM65_CHECKED
+        c->p_valid |= (FLAG_N | FLAG_V | FLAG_Z);
+#endif
+    }
     else
     {
-        uint8_t val = readByte(s, addr);
+        uint8_t val = readByte(s, c, addr);
         SETN(val);
         SETV(val & 0x40);
-        SETZ(s->r.a & val);
+        SETZ(c->r.a & val);
     }
 }
-#define BIT_ZP   s->cycles += 3; do_bit(s, data & 0xFF)
-#define BIT_ABS  s->cycles += 4; do_bit(s, data)
+#define BIT_ZP   c->cycles += 3; do_bit(s, c, data & 0xFF)
+#define BIT_ABS  c->cycles += 4; do_bit(s, c, data)
 
-static void do_jsr(sim65 s, unsigned data)
+static CPU_INLINE void do_jsr(sim65 s, struct cpu *c, unsigned data)
 {
-    s->r.pc = (s->r.pc - 1) & 0xFFFF;
-    PUSH(s->r.pc >> 8);
-    PUSH(s->r.pc);
-    s->r.pc = data;
+    c->r.pc = (c->r.pc - 1) & 0xFFFF;
+    PUSH(c->r.pc >> 8);
+    PUSH(c->r.pc);
+    c->r.pc = data;
 }
 
-static void do_rts(sim65 s)
+static CPU_INLINE void do_rts(sim65 s, struct cpu *c)
 {
     unsigned val;
     POP;
-    s->r.pc = val;
+    c->r.pc = val;
     POP;
-    s->r.pc |= val << 8;
-    s->r.pc = (s->r.pc + 1) & 0xFFFF;
-    s->cycles += 6;
+    c->r.pc |= val << 8;
+    c->r.pc = (c->r.pc + 1) & 0xFFFF;
+    c->cycles += 6;
 }
 
-static void do_rti(sim65 s)
+static CPU_INLINE void do_rti(sim65 s, struct cpu *c)
 {
     unsigned val;
     POP_P; // NOTE: already adds 4 cycles
     POP;
-    s->r.pc = val;
+    c->r.pc = val;
     POP;
-    s->r.pc |= val << 8;
-    s->r.pc = (s->r.pc) & 0xFFFF;
-    s->cycles += 2;
+    c->r.pc |= val << 8;
+    c->r.pc = (c->r.pc) & 0xFFFF;
+    c->cycles += 2;
 }
 
-static void next(sim65 s)
+// Takes a pending NMI, or the IRQ if the I flag is clear. Pushes the PC and
+// the P register with the B flag clear, and jumps to the interrupt vector.
+static void do_interrupt(sim65 s)
 {
-    unsigned ins, data, val, old_pc = 0, old_cycles = 0;
+    struct cpu *c = &s->cpu;
+    unsigned vec;
 
-    // See if out vector
-    if (s->cb_exec[s->r.pc])
+    s->stop &= ~stop_irq;
+    if (s->nmi_edge)
     {
-        set_error(s, s->cb_exec[s->r.pc](s, &s->r, s->r.pc, sim65_cb_exec), s->r.pc);
-        if (get_error_exit(s))
-            return;
+        s->nmi_edge = 0;
+        vec = 0xFFFA;
     }
+    else if (s->irq && !(c->r.p & FLAG_I))
+        vec = 0xFFFE;
+    else
+        return;
+    writeByte(s, c, 0x100 + c->r.s, c->r.pc >> 8);
+    c->r.s = (c->r.s - 1) & 0xFF;
+    writeByte(s, c, 0x100 + c->r.s, c->r.pc);
+    c->r.s = (c->r.s - 1) & 0xFF;
+    writeByte(s, c, 0x100 + c->r.s, (get_flags(s, c, 0xFF) & ~FLAG_B) | 0x20);
+    c->r.s = (c->r.s - 1) & 0xFF;
+    SETI(1);
+    c->r.pc = readByte(s, c, vec);
+    c->r.pc |= readByte(s, c, vec + 1) << 8;
+    c->cycles += 7;
+}
 
-    if (s->debug >= sim65_debug_trace)
-        sim65_print_reg(s, s->trace_file);
+void sim65_set_irq(sim65 s, int level)
+{
+    s->irq = !!level;
+    if (s->irq && !(s->cpu.r.p & SIM65_FLAG_I))
+        s->stop |= stop_irq;
+}
 
-    if (s->cycle_limit && s->cycles >= s->cycle_limit)
+void sim65_set_nmi(sim65 s, int level)
+{
+    if (level && !s->nmi)
     {
-        set_error(s, sim65_err_cycle_limit, s->r.pc);
-        return;
+        s->nmi_edge = 1;
+        s->stop |= stop_irq;
     }
+    s->nmi = !!level;
+}
 
-    // Read instruction and data
-    ins = readPc(s, 0);
-    if (ilen[ins] > 1)
-        data = readPc(s, 1);
+// Executes the hooks before each instruction: device events, exec
+// callbacks, cycle limit, trace window and trace. Returns 1 if the
+// simulation should stop.
+static int ins_hooks(sim65 s)
+{
+    sim65_callback cb;
 
-    if (ilen[ins] > 2)
-        data |= readPc(s, 2) << 8;
+    if (s->cpu.cycles >= s->cycle_stop)
+    {
+        run_events(s);
+        if (get_error_exit(s))
+            return 1;
+    }
 
-    // If profiling, store old info
-    if (s->do_prof)
+    // See if out vector
+    cb = exec_callback(s, s->cpu.r.pc);
+    if (cb)
     {
-        old_pc = s->r.pc;
-        old_cycles = s->cycles;
+        set_error(s, do_callback(s, cb, s->cpu.r.pc, sim65_cb_exec), s->cpu.r.pc);
+        if (get_error_exit(s))
+            return 1;
+    }
+
+    if (s->cycle_limit && s->cpu.cycles >= s->cycle_limit)
+    {
+        set_error(s, sim65_err_cycle_limit, s->cpu.r.pc);
+        return 1;
     }
-    // Update PC
-    s->r.pc += ilen[ins];
 
+    // Only traced if executed, so a run split in budgets gives the same trace
+    if (s->trig && !trig_ins(s))
+        return 0;
+    if (s->debug >= sim65_debug_trace)
+        trace_ins(s);
+    return 0;
+}
+
+// Valid opcodes
+static const uint8_t ivalid[256] = {
+#define OP(n, code) [n] = 1,
+#include "sim65_ops.h"
+#undef OP
+};
+
+// Returns true if the instruction ends a block: jumps, branches and BRK
+static int ins_ends_block(unsigned ins)
+{
+    return (ins & 0x1F) == 0x10 || ins == 0x00 || ins == 0x20 || ins == 0x40 ||
+           ins == 0x4C || ins == 0x60 || ins == 0x6C;
+}
+
+// Opcodes of each fused sequence, and text to show in statistics
+static const struct
+{
+    int16_t ins[3];
+    const char *text;
+} fuse_seq[fuse_num] = {
+#define FUSE(name, text, i1, i2, i3, check, code) { { i1, i2, i3 }, text },
+#include "sim65_fuse.h"
+#undef FUSE
+};
+
+// Marks the start of fused sequences in the decoded instructions, the first
+// one in the list that matches is used.
+static void fuse_block(struct dins *d, unsigned n)
+{
+    unsigned i, f;
+    for (i = 0; i + 1 < n; i++)
+        for (f = 0; f < fuse_num; f++)
+        {
+            const int16_t *ins = fuse_seq[f].ins;
+            if (d[i].ins == ins[0] && d[i + 1].ins == ins[1] &&
+                (ins[2] < 0 || (i + 2 < n && d[i + 2].ins == ins[2])))
+            {
+                d[i].op = 256 + f;
+                break;
+            }
+        }
+}
+
+// Returns true if the instruction can be part of an idle loop: reads of
+// absolute or zero page addresses, immediate and register instructions.
+static int ins_idle(unsigned ins)
+{
     switch (ins)
     {
-        case 0x00:  set_error(s, sim65_err_break, s->r.pc - 1); break;
-        case 0x01:  IND_X(ORA);             break;
-        case 0x05:  ZP_R(ORA);              break;
-        case 0x06:  ZP_RW(ASL);             break;
-        case 0x08:  PUSH(get_flags(s,0xFF)); break; // PHP
-        case 0x09:  IMM(ORA);               break;
-        case 0x0A:  IMP_A(ASL);             break;
-        case 0x0D:  ABS_R(ORA);             break;
-        case 0x0E:  ABS_RW(ASL);            break;
-        case 0x10:  BRA_0(FLAG_N);          break; // BPL
-        case 0x11:  IND_Y(ORA);             break;
-        case 0x15:  ZPX_R(ORA);             break;
-        case 0x16:  ZPX_RW(ASL);            break;
-        case 0x18:  CL_F(FLAG_C);           break; // CLC
-        case 0x19:  ABY_R(ORA);             break;
-        case 0x1d:  ABX_R(ORA);             break;
-        case 0x1e:  ABX_RW(ASL);            break;
-        case 0x20:  JSR();                  break; // JSR
-        case 0x21:  IND_X(AND);             break;
-        case 0x24:  BIT_ZP;                 break;
-        case 0x25:  ZP_R(AND);              break;
-        case 0x26:  ZP_RW(ROL);             break;
-        case 0x28:  POP_P;                  break; // PLP
-        case 0x29:  IMM(AND);               break;
-        case 0x2a:  IMP_A(ROL);             break;
-        case 0x2c:  BIT_ABS;                break;
-        case 0x2d:  ABS_R(AND);             break;
-        case 0x2e:  ABS_RW(ROL);            break;
-        case 0x30:  BRA_1(FLAG_N);          break;
-        case 0x31:  IND_Y(AND);             break;
-        case 0x35:  ZPX_R(AND);             break;
-        case 0x36:  ZPX_RW(ROL);            break;
-        case 0x38:  SE_F(FLAG_C);           break; // SEC
-        case 0x39:  ABY_R(AND);             break;
-        case 0x3d:  ABX_R(AND);             break;
-        case 0x3e:  ABX_RW(ROL);            break;
-        case 0x40:  RTI();                  break; // RTI
-        case 0x41:  IND_X(EOR);             break;
-        case 0x45:  ZP_R(EOR);              break;
-        case 0x46:  ZP_RW(LSR);             break;
-        case 0x48:  PUSH(s->r.a);           break; // PHA
-        case 0x49:  IMM(EOR);               break;
-        case 0x4a:  IMP_A(LSR);             break;
-        case 0x4c:  JMP();                  break; // JMP
-        case 0x4d:  ABS_R(EOR);             break;
-        case 0x4e:  ABS_RW(LSR);            break;
-        case 0x50:  BRA_0(FLAG_V);          break;
-        case 0x51:  IND_Y(EOR);             break;
-        case 0x55:  ZPX_R(EOR);             break;
-        case 0x56:  ZPX_RW(LSR);            break;
-        case 0x58:  CL_F(FLAG_I);           break; // CLI
-        case 0x59:  ABY_R(EOR);             break;
-        case 0x5d:  ABX_R(EOR);             break;
-        case 0x5e:  ABX_RW(LSR);            break;
-        case 0x60:  RTS();                  break; // RTS
-        case 0x61:  IND_X(ADC);             break;
-        case 0x65:  ZP_R(ADC);              break;
-        case 0x66:  ZP_RW(ROR);             break;
-        case 0x68:  POP_A;                  break; // PLA
-        case 0x69:  IMM(ADC);               break;
-        case 0x6a:  IMP_A(ROR);             break;
-        case 0x6c:  JMP16();                break; // JMP ()
-        case 0x6d:  ABS_R(ADC);             break;
-        case 0x6e:  ABS_RW(ROR);            break;
-        case 0x70:  BRA_1(FLAG_V);          break;
-        case 0x71:  IND_Y(ADC);             break;
-        case 0x75:  ZPX_R(ADC);             break;
-        case 0x76:  ZPX_RW(ROR);            break;
-        case 0x78:  SE_F(FLAG_I);           break; // SEI
-        case 0x79:  ABY_R(ADC);             break;
-        case 0x7d:  ABX_R(ADC);             break;
-        case 0x7e:  ABX_RW(ROR);            break;
-        case 0x81:  INDW_X(STA);            break;
-        case 0x84:  ZP_W(STY);              break;
-        case 0x85:  ZP_W(STA);              break;
-        case 0x86:  ZP_W(STX);              break;
-        case 0x88:  IMP_Y(DEC);             break; // DEY
-        case 0x8a:  IMP_X(LDA);             break; // TXA
-        case 0x8c:  ABS_W(STY);             break;
-        case 0x8d:  ABS_W(STA);             break;
-        case 0x8e:  ABS_W(STX);             break;
-        case 0x90:  BRA_0(FLAG_C);          break; // BCC
-        case 0x91:  INDW_Y(STA);            break;
-        case 0x94:  ZPX_W(STY);             break;
-        case 0x95:  ZPX_W(STA);             break;
-        case 0x96:  ZPY_W(STX);             break;
-        case 0x98:  IMP_Y(LDA);             break; // TYA
-        case 0x99:  ABY_W(STA);             break;
-        case 0x9a:  TXS();                  break; // TXS
-        case 0x9d:  ABX_W(STA);             break;
-        case 0xa0:  IMM(LDY);               break;
-        case 0xa1:  IND_X(LDA);             break;
-        case 0xa2:  IMM(LDX);               break;
-        case 0xa4:  ZP_R(LDY);              break;
-        case 0xa5:  ZP_R(LDA);              break;
-        case 0xa6:  ZP_R(LDX);              break;
-        case 0xa8:  IMP_A(LDY);             break; // TAY
-        case 0xa9:  IMM(LDA);               break;
-        case 0xaa:  IMP_A(LDX);             break; // TAX
-        case 0xac:  ABS_R(LDY);             break;
-        case 0xad:  ABS_R(LDA);             break;
-        case 0xae:  ABS_R(LDX);             break;
-        case 0xb0:  BRA_1(FLAG_C);          break; // BCS
-        case 0xb1:  IND_Y(LDA);             break;
-        case 0xb4:  ZPX_R(LDY);             break;
-        case 0xb5:  ZPX_R(LDA);             break;
-        case 0xb6:  ZPY_R(LDX);             break;
-        case 0xb8:  CL_F(FLAG_V);           break; // CLV
-        case 0xb9:  ABY_R(LDA);             break;
-        case 0xba:  IMP_X(val = s->r.s);    break; // TSX
-        case 0xbc:  ABX_R(LDY);             break;
-        case 0xbd:  ABX_R(LDA);             break;
-        case 0xbe:  ABY_R(LDX);             break;
-        case 0xc0:  IMM(CPY);               break;
-        case 0xc1:  IND_X(CMP);             break;
-        case 0xc4:  ZP_R(CPY);              break;
-        case 0xc5:  ZP_R(CMP);              break;
-        case 0xc6:  ZP_RW(DEC);             break;
-        case 0xc8:  IMP_Y(INC);             break; // INY
-        case 0xc9:  IMM(CMP);               break;
-        case 0xca:  IMP_X(DEC);             break; // DEX
-        case 0xcc:  ABS_R(CPY);             break;
-        case 0xcd:  ABS_R(CMP);             break;
-        case 0xce:  ABS_RW(DEC);            break;
-        case 0xd0:  BRA_0(FLAG_Z);          break; // BNE
-        case 0xd1:  IND_Y(CMP);             break;
-        case 0xd5:  ZPX_R(CMP);             break;
-        case 0xd6:  ZPX_RW(DEC);            break;
-        case 0xd8:  CL_F(FLAG_D);           break; // CLD
-        case 0xd9:  ABY_R(CMP);             break;
-        case 0xdd:  ABX_R(CMP);             break;
-        case 0xde:  ABX_RW(DEC);            break;
-        case 0xe0:  IMM(CPX);               break;
-        case 0xe1:  IND_X(SBC);             break;
-        case 0xe4:  ZP_R(CPX);              break;
-        case 0xe5:  ZP_R(SBC);              break;
-        case 0xe6:  ZP_RW(INC);             break;
-        case 0xe8:  IMP_X(INC);             break; // INX
-        case 0xe9:  IMM(SBC);               break;
-        case 0xea:  s->cycles += 2;         break; // NOP
-        case 0xec:  ABS_R(CPX);             break;
-        case 0xed:  ABS_R(SBC);             break;
-        case 0xee:  ABS_RW(INC);            break;
-        case 0xf0:  BRA_1(FLAG_Z);          break; // BEQ
-        case 0xf1:  IND_Y(SBC);             break;
-        case 0xf5:  ZPX_R(SBC);             break;
-        case 0xf6:  ZPX_RW(INC);            break;
-        case 0xf8:  SE_F(FLAG_D);           break; // SED
-        case 0xf9:  ABY_R(SBC);             break;
-        case 0xfd:  ABX_R(SBC);             break;
-        case 0xfe:  ABX_RW(INC);            break;
-        default:    set_error(s, sim65_err_invalid_ins, s->r.pc - 1);
-    }
-    // Update profile information
-    if (s->do_prof)
-    {
-        s->prof.instructions ++;
-        s->prof.exe[old_pc & 0xFFFF] += s->cycles -old_cycles;
+        // ORA, AND, EOR, ADC, LDA, CMP, SBC, BIT, LDX, LDY, CPX and CPY
+        case 0x05: case 0x09: case 0x0D: case 0x25: case 0x29: case 0x2D:
+        case 0x45: case 0x49: case 0x4D: case 0x65: case 0x69: case 0x6D:
+        case 0xA5: case 0xA9: case 0xAD: case 0xC5: case 0xC9: case 0xCD:
+        case 0xE5: case 0xE9: case 0xED: case 0x24: case 0x2C: case 0xA2:
+        case 0xA6: case 0xAE: case 0xA0: case 0xA4: case 0xAC: case 0xE0:
+        case 0xE4: case 0xEC: case 0xC0: case 0xC4: case 0xCC:
+        // Accumulator shifts, transfers, increments and flags
+        case 0x0A: case 0x2A: case 0x4A: case 0x6A: case 0x8A: case 0x98:
+        case 0xA8: case 0xAA: case 0xBA: case 0x9A: case 0x88: case 0xC8:
+        case 0xCA: case 0xE8: case 0x18: case 0x38: case 0xB8: case 0xD8:
+        case 0xF8: case 0xEA:
+            return 1;
+        default:
+            return 0;
     }
 }
 
+// Returns true if the instruction of an idle loop reads memory
+static inline int ins_idle_read(const struct dins *d)
+{
+    return d->len == 3 || (d->len == 2 && (d->ins & 0x1C) == 0x04);
+}
+
+// Returns the cycles of one iteration if the block is an idle loop, a
+// conditional branch to the start of the block that does not write memory,
+// else returns 0.
+static unsigned idle_cycles(const struct dins *d, unsigned n, uint16_t pc,
+                            unsigned end)
+{
+    unsigned i, cycles;
+    if ((d[n - 1].ins & 0x1F) != 0x10 || ((end + (int8_t)d[n - 1].data) & 0xFFFF) != pc)
+        return 0;
+    // Taken branch, with an extra cycle if the block ends at the page end
+    cycles = icyc[d[n - 1].ins] + 1 + ((end & 0xFF00) != (pc & 0xFF00));
+    for (i = 0; i + 1 < n; i++)
+    {
+        if (!ins_idle(d[i].ins))
+            return 0;
+        cycles += icyc[d[i].ins];
+    }
+    return cycles;
+}
+
+// Decodes a new block starting at the given address, returns NULL if
+// the instruction at the address can't be decoded.
+static struct dblock *decode_block(sim65 s, uint16_t pc)
+{
+    struct dins buf[256];
+    struct dblock *b;
+    unsigned addr = pc, n = 0, cycles = 0, i;
+
+    while (addr < ((pc & 0xFF00) + 0x100u))
+    {
+        unsigned ins = s->mem[addr], len = ilen[ins];
+        // Stop at invalid instructions, instructions crossing the page
+        // and at any not plain memory (undefined, uninitialized, callbacks)
+        if (!ivalid[ins] || (addr & 0xFF) + len > 0x100)
+            break;
+        for (i = 0; i < len; i++)
+            if (s->mems[addr + i] & ~ms_direct_read)
+                break;
+        if (i != len)
+            break;
+        buf[n].ins = ins;
+        buf[n].op = ins;
+        buf[n].len = len;
+        buf[n].data = len == 1 ? 0 : len == 2 ? s->mem[addr + 1] :
+                      s->mem[addr + 1] | (s->mem[addr + 2] << 8);
+        // Count maximum cycles, including extra cycles for page-crossing
+        cycles += icyc[ins] + 2;
+        n++;
+        addr += len;
+        if (ins_ends_block(ins))
+            break;
+    }
+    if (!n)
+        return 0;
+    fuse_block(buf, n);
+
+    b = malloc(sizeof(struct dblock) + n * sizeof(struct dins));
+    if (!b)
+        return 0;
+    if (!s->blocks[pc >> 8])
+    {
+        s->blocks[pc >> 8] = calloc(256, sizeof(struct dblock *));
+        if (!s->blocks[pc >> 8])
+        {
+            free(b);
+            return 0;
+        }
+    }
+    b->next = 0;
+    b->cycles = cycles;
+    b->count = n;
+    b->idle = idle_cycles(buf, n, pc, addr);
+#ifdef SIM65_JIT
+    b->hits = 0;
+    b->native = 0;
+#endif
+    memcpy(b->ins, buf, n * sizeof(struct dins));
+    for (i = pc; i < addr; i++)
+        set_mems(s, i, s->mems[i] | ms_code);
+    s->blocks[pc >> 8][pc & 0xFF] = b;
+    return b;
+}
+
+// Returns true if the CPU state is the same, ignoring the cycles
+static int same_state(const struct cpu *a, const struct cpu *b)
+{
+#ifdef SIM65_CHECKED
+    if (a->p_valid != b->p_valid)
+        return 0;
+#endif
+    return a->r.pc == b->r.pc && a->r.a == b->r.a && a->r.x == b->r.x &&
+           a->r.y == b->r.y && a->r.s == b->r.s && get_p(a) == get_p(b);
+}
+
+// Skips iterations of an idle loop. If one iteration ends in the same state
+// it started, the next ones are equal until one of the device registers read
+// changes its value, so whole iterations are skipped up to the first change
+// reported by the devices, the next scheduled event or the cycle limit.
+// Returns 1 if cycles were skipped.
+static int idle_skip(sim65 s, const struct dblock *b)
+{
+    struct idle *id = &s->idle;
+    uint64_t now = s->cpu.cycles, wait = INT_MAX, n;
+    unsigned i;
+
+    // Events in the last iteration could have changed the values read
+    if (id->block != b || id->cpu.cycles + b->idle != now ||
+        id->events != s->events.done || !same_state(&id->cpu, &s->cpu))
+    {
+        id->block = b;
+        id->cpu = s->cpu;
+        id->events = s->events.done;
+        return 0;
+    }
+    id->cpu.cycles = now;
+    for (i = 0; i < b->count; i++)
+    {
+        const struct dins *d = &b->ins[i];
+        uint16_t addr = d->len == 3 ? d->data : d->data & 0xFF;
+        if (!ins_idle_read(d))
+            continue;
+        if (s->mems[addr] & ms_callback)
+        {
+            // Only devices that report their events can be skipped
+            struct cb_page *cb = s->pages[addr >> 8].cb;
+            int e;
+            if (!cb->read[addr & 0xFF] || !cb->event[addr & 0xFF])
+                return 0;
+            e = do_callback(s, cb->event[addr & 0xFF], addr, sim65_cb_event);
+            if (e <= 0)
+                return 0;
+            if ((unsigned)e < wait)
+                wait = e;
+        }
+        else if (s->mems[addr] & ~ms_direct_read)
+            return 0;
+    }
+    // Device events and the cycle limit end the wait
+    if (s->cycle_stop <= now)
+        return 0;
+    if (s->cycle_stop - now < wait)
+        wait = s->cycle_stop - now;
+    n = wait / b->idle;
+    if (!n)
+        return 0;
+    s->cpu.cycles += n * b->idle;
+    id->cpu.cycles = s->cpu.cycles;
+    s->idle_count++;
+    s->idle_cycles += n * b->idle;
+    return 1;
+}
+
+#ifdef SIM65_JIT
+
+// Number of starts of a block before translating it to native code
+#define JIT_HOT 64
+
+// Forgets all translated code, to reuse the code buffer
+static void jit_flush_all(sim65 s)
+{
+    unsigned i, j;
+    for (i = 0; i < 256; i++)
+        if (s->blocks[i])
+            for (j = 0; j < 256; j++)
+                if (s->blocks[i][j])
+                {
+                    s->blocks[i][j]->native = 0;
+                    s->blocks[i][j]->hits = 0;
+                }
+    jit_flush(s->jit);
+}
+
+// Executes the block as native code if it is hot, returns 0 if the
+// interpreter must execute the block instead.
+static int run_native(sim65 s, struct dblock *b)
+{
+    uint64_t cycles = s->cpu.cycles;
+    uint16_t pc = s->cpu.r.pc;
+
+    if (!b->native)
+    {
+        struct jit_ins ins[256];
+        unsigned i;
+        // Translate only once, when reaching the threshold
+        if (b->hits++ != JIT_HOT)
+            return 0;
+        if (jit_full(s->jit))
+            jit_flush_all(s);
+        for (i = 0; i < b->count; i++)
+        {
+            ins[i].ins = b->ins[i].ins;
+            ins[i].len = b->ins[i].len;
+            ins[i].data = b->ins[i].data;
+        }
+        b->native = jit_compile(s->jit, pc, ins, b->count);
+        if (!b->native)
+            return 0;
+    }
+#ifdef SIM65_CHECKED
+    // The native code can't report uninitialized flags
+    if (s->cpu.p_valid)
+        return 0;
+#endif
+    s->cpu.r.p = get_p(&s->cpu);
+    b->native(s);
+    load_p(&s->cpu);
+    // The native code stops before an instruction it can't execute, if it
+    // was the first one let the interpreter continue.
+    return s->cpu.r.pc != pc || s->cpu.cycles != cycles;
+}
+#endif
+
+// Get instruction data and update PC
+#define FETCH_INS                                                             \
+    data = d->data;                                                           \
+    /* If profiling, store old info */                                        \
+    if (RUN_PROF)                                                             \
+    {                                                                         \
+        old_pc = c->r.pc;                                                     \
+        old_cycles = c->cycles;                                               \
+    }                                                                         \
+    c->r.pc += d->len
+
+// Continue with the next instruction of a fused sequence, profiling never
+// uses the fused handlers.
+#define FUSE_NEXT                                                             \
+    count--;                                                                  \
+    d++;                                                                      \
+    FETCH_INS
+
+// Update profile information
+#define PROF_INS                                                              \
+    if (RUN_PROF)                                                             \
+    {                                                                         \
+        s->prof->instructions ++;                                             \
+        s->prof->exe[old_pc & 0xFFFF] += c->cycles -old_cycles;               \
+    }
+
+// Specialized simulation loops, see sim65_run.h
+#define RUN_NAME    run_plain
+#define RUN_MODE    0
+#define RUN_PROF    0
+#define RUN_LIMIT   0
+#define RUN_TRACE   0
+#include "sim65_run.h"
+
+#define RUN_NAME    run_limit
+#define RUN_MODE    run_mode_limit
+#define RUN_PROF    0
+#define RUN_LIMIT   1
+#define RUN_TRACE   0
+#include "sim65_run.h"
+
+#define RUN_NAME    run_prof
+#define RUN_MODE    run_mode_prof
+#define RUN_PROF    1
+#define RUN_LIMIT   0
+#define RUN_TRACE   0
+#include "sim65_run.h"
+
+#define RUN_NAME    run_prof_limit
+#define RUN_MODE    (run_mode_prof | run_mode_limit)
+#define RUN_PROF    1
+#define RUN_LIMIT   1
+#define RUN_TRACE   0
+#include "sim65_run.h"
+
+// Tracing is slow anyway, so profiling is checked at run time
+#define RUN_NAME    run_trace
+#define RUN_MODE    run_mode_trace
+#define RUN_PROF    (s->do_prof)
+#define RUN_LIMIT   1
+#define RUN_TRACE   1
+#include "sim65_run.h"
+
+static void run(sim65 s)
+{
+    static void (*const run_fn[])(sim65 s) = {
+        run_plain, run_prof, run_limit, run_prof_limit, run_trace
+    };
+    unsigned mode;
+    // Run until stopped, selecting the loop again when the mode changes
+    do
+    {
+        mode = s->run_mode;
+        run_fn[mode](s);
+    }
+    while (mode != s->run_mode && !(s->stop & stop_host) && !get_error_exit(s));
+    if (s->stop & stop_host)
+        s->stop &= ~stop_host;
+}
+
 enum sim65_error sim65_run(sim65 s, struct sim65_reg *regs, unsigned addr)
 {
     if (regs)
-        memcpy(&s->r, regs, sizeof(*regs));
+        memcpy(&s->cpu.r, regs, sizeof(*regs));
 
     s->error = sim65_err_none;
-    s->r.pc = addr;
-    while (!get_error_exit(s))
-        next(s);
+    s->stop &= ~stop_error;
+    s->cpu.r.pc = addr;
+    load_p(&s->cpu);
+    run(s);
+    s->cpu.r.p = get_p(&s->cpu);
+    if (s->stop & stop_code)
+        code_gc(s);
+    // The trace is complete after each run
+    tring_sync(s);
+    btrace_flush(s);
 
     if (regs)
-        memcpy(regs, &s->r, sizeof(*regs));
+        memcpy(regs, &s->cpu.r, sizeof(*regs));
 
     return s->error;
 }
 
+enum sim65_error sim65_run_cycles(sim65 s, struct sim65_reg *regs, uint64_t budget)
+{
+    uint64_t limit = s->cycle_limit, end = s->cpu.cycles + budget;
+    enum sim65_error e;
+
+    // The budget is a temporary cycle limit
+    if (!limit || end < limit)
+        s->cycle_limit = end;
+    set_cycle_stop(s);
+    e = sim65_run(s, regs, regs ? regs->pc : s->cpu.r.pc);
+    s->cycle_limit = limit;
+    set_cycle_stop(s);
+    if (e == sim65_err_cycle_limit && (!limit || s->cpu.cycles < limit))
+    {
+        e = s->error = sim65_err_none;
+        s->stop &= ~stop_error;
+    }
+    return e;
+}
+
+enum sim65_error sim65_step(sim65 s, struct sim65_reg *regs)
+{
+    // All instructions take more than one cycle
+    return sim65_run_cycles(s, regs, 1);
+}
+
+void sim65_stop(sim65 s)
+{
+    s->stop |= stop_host;
+}
+
 // Called on return from simulated code
 static int sim65_rts_callback(sim65 s, struct sim65_reg *regs,
                               unsigned addr, int data)
@@ -873,17 +1846,17 @@ enum sim65_error sim65_call(sim65 s, struct sim65_reg *regs, unsigned addr)
 {
     // Setup registers if given
     if (regs)
-        memcpy(&s->r, regs, sizeof(*regs));
+        memcpy(&s->cpu.r, regs, sizeof(*regs));
 
     // Save original PC
-    unsigned old_pc = s->r.pc;
+    unsigned old_pc = s->cpu.r.pc;
 
     // Use 0 as return address
-    s->r.pc = 0;
+    s->cpu.r.pc = 0;
     sim65_add_callback(s, 0, sim65_rts_callback, sim65_cb_exec);
 
     // Execute a JSR
-    do_jsr(s, addr);
+    do_jsr(s, &s->cpu, addr);
 
     // And continue the emulator
     enum sim65_error err = sim65_run(s, 0, addr);
@@ -892,8 +1865,9 @@ enum sim65_error sim65_call(sim65 s, struct sim65_reg *regs, unsigned addr)
     if (err == sim65_err_call_ret)
     {
         // Now, return to old address
-        s->r.pc = old_pc;
+        s->cpu.r.pc = old_pc;
         err = s->error = sim65_err_none;
+        s->stop &= ~stop_error;
     }
 
     return err;
@@ -902,10 +1876,16 @@ enum sim65_error sim65_call(sim65 s, struct sim65_reg *regs, unsigned addr)
 void sim65_set_debug(sim65 s, enum sim65_debug level)
 {
     s->debug = level;
+    set_run_mode(s);
 }
 
 void sim65_set_trace_file(sim65 s, FILE *f)
 {
+    // A new file starts with its own header
+    tring_stop(s);
+    btrace_flush(s);
+    free(s->btrace);
+    s->btrace = 0;
     if (f)
         s->trace_file = f;
     else
@@ -1069,11 +2049,11 @@ static char *print_ind_label(sim65 s, char *buf, uint16_t addr, char idx, int hi
         *buf++ = '$';
 
         if (idx == 'X')
-            buf = hex4(buf, readWord(s, 0xFF & (addr + s->r.x)));
+            buf = hex4(buf, readWord(s, &s->cpu, 0xFF & (addr + s->cpu.r.x)));
         else if (idx == 'Y')
-            buf = hex4(buf, readWord(s, addr) + s->r.y);
+            buf = hex4(buf, readWord(s, &s->cpu, addr) + s->cpu.r.y);
         else
-            buf = hex4(buf, readWord(s, addr));
+            buf = hex4(buf, readWord(s, &s->cpu, addr));
         *buf++ = ']';
     }
 
@@ -1100,13 +2080,13 @@ static char *print_ind_label(sim65 s, char *buf, uint16_t addr, char idx, int hi
 #define INSPRT_ABS(name) PNAM(name); PLAB(data)
 #define INSPRT_ABXW(name) PNAM(name); PLABX(data)
 #define INSPRT_ABYW(name) PNAM(name); PLABY(data)
-#define INSPRT_ABX(name) PNAM(name); PXTRA(data,s->r.x, hint); PLABX(data)
-#define INSPRT_ABY(name) PNAM(name); PXTRA(data,s->r.y, hint); PLABY(data)
+#define INSPRT_ABX(name) PNAM(name); PXTRA(data,s->cpu.r.x, hint); PLABX(data)
+#define INSPRT_ABY(name) PNAM(name); PXTRA(data,s->cpu.r.y, hint); PLABY(data)
 #define INSPRT_ZPG(name) PNAM(name); PLZP(data)
 #define INSPRT_ZPX(name) PNAM(name); PLZPX(data)
 #define INSPRT_ZPY(name) PNAM(name); PLZPY(data)
 #define INSPRT_IDX(name) PNAM(name); PLIDX(data)
-#define INSPRT_IDY(name) PNAM(name); PXTRA(readWord(s, data),s->r.y, hint); PLIDY(data)
+#define INSPRT_IDY(name) PNAM(name); PXTRA(readWord(s, &s->cpu, data),s->cpu.r.y, hint); PLIDY(data)
 #define INSPRT_IDYW(name) PNAM(name); PLIDY(data)
 #define INSPRT_IND(name) PNAM(name); PLIND(data)
 #define INSPRT_IMP(name) PNAM(name)
@@ -1411,21 +2391,21 @@ void sim65_print_reg(const sim65 s, FILE *f)
 {
     char buffer[256];
     char *buf = buffer;
-    buf = hex8(buf, s->cycles);
+    buf = hex8(buf, s->cpu.cycles);
     PSTR(": A=");
-    PHX2(s->r.a);
+    PHX2(s->cpu.r.a);
     PSTR(" X=");
-    PHX2(s->r.x);
+    PHX2(s->cpu.r.x);
     PSTR(" Y=");
-    PHX2(s->r.y);
+    PHX2(s->cpu.r.y);
     PSTR(" P=");
-    PHX2(s->r.p);
+    PHX2(get_p(&s->cpu));
     PSTR(" S=");
-    PHX2(s->r.s);
+    PHX2(s->cpu.r.s);
     PSTR(" PC=");
-    PHX4(s->r.pc);
+    PHX4(s->cpu.r.pc);
     *buf++ = ' ';
-    print_curr_ins(s, s->r.pc, buf, 1);
+    print_curr_ins(s, s->cpu.r.pc, buf, 1);
     fputs(buffer, f);
     putc('\n', f);
 }
@@ -1436,10 +2416,944 @@ char * sim65_disassemble(const sim65 s, char *buf, uint16_t addr)
     return buf;
 }
 
+// --------------------------------------------------------------------
+// Trace records
+// --------------------------------------------------------------------
+// State needed to write one line of the trace, captured by the simulation
+// so the line can be written later or in other thread.
+struct trec
+{
+    uint64_t cycles;
+    struct sim65_reg r;
+    uint8_t code[3];        // Instruction bytes
+    uint8_t st;             // Status of each byte, two bits each
+    uint16_t hint;          // Pointer read by indirect instructions
+    uint32_t dropped;       // Records dropped before this one
+    char *msg;              // Message instead of an instruction, if not NULL
+};
+
+// Address read by the trace hints of indirect instructions, as in
+// print_ind_label.
+static const uint8_t ihint[256] = {
+    [0x01] = 'X', [0x13] = 'X', [0x21] = 'X', [0x23] = 'X', [0x41] = 'X',
+    [0x43] = 'X', [0x61] = 'X', [0x63] = 'X', [0x81] = 'X', [0x83] = 'X',
+    [0xA1] = 'X', [0xA3] = 'X', [0xC1] = 'X', [0xC3] = 'X', [0xE1] = 'X',
+    [0xE3] = 'X',
+    [0x03] = 'Y', [0x11] = 'Y', [0x31] = 'Y', [0x33] = 'Y', [0x51] = 'Y',
+    [0x53] = 'Y', [0x71] = 'Y', [0x73] = 'Y', [0x91] = 'Y', [0x93] = 'Y',
+    [0xB1] = 'Y', [0xB3] = 'Y', [0xD1] = 'Y', [0xD3] = 'Y', [0xF1] = 'Y',
+    [0xF3] = 'Y',
+    [0x6C] = 'I',
+};
+
+// Status of a byte as shown in the trace: RAM, ROM, undefined or
+// uninitialized
+static unsigned trec_status(sim65 s, unsigned addr)
+{
+    uint8_t st = s->mems[addr & 0xFFFF];
+    if (!(st & ms_invalid))
+        return (st & ms_rom) ? 1 : 0;
+    return (st & ms_undef) ? 2 : 3;
+}
+
+static const uint8_t trec_mems[4] = { 0, ms_rom, ms_undef | ms_invalid, ms_invalid };
+
+static void trec_get(sim65 s, struct trec *t)
+{
+    t->cycles = s->cpu.cycles;
+    t->r = s->cpu.r;
+    t->r.p = get_p(&s->cpu);
+    t->st = 0;
+    t->msg = 0;
+    unsigned pc = t->r.pc, len = ilen[s->mem[pc]];
+    for (unsigned i = 0; i < len; i++)
+    {
+        t->code[i] = s->mem[(pc + i) & 0xFFFF];
+        t->st |= trec_status(s, pc + i) << (2 * i);
+    }
+    if (ihint[t->code[0]])
+    {
+        unsigned data = t->code[1] | (len == 3 ? t->code[2] << 8 : 0);
+        t->hint = readWord(s, &s->cpu, ihint[t->code[0]] == 'X' ? 0xFF & (data + t->r.x) : data);
+    }
+}
+
+// Prints the record as sim65_print_reg, using "s" as a scratch simulator
+static void trec_print(sim65 s, const struct trec *t, FILE *f)
+{
+    unsigned pc = t->r.pc, len = ilen[t->code[0]];
+    if (ihint[t->code[0]])
+    {
+        unsigned data = t->code[1] | (len == 3 ? t->code[2] << 8 : 0);
+        unsigned addr = ihint[t->code[0]] == 'X' ? 0xFF & (data + t->r.x) : data;
+        for (unsigned i = 0; i < 2; i++)
+        {
+            s->mem[(addr + i) & 0xFFFF] = t->hint >> (8 * i);
+            set_mems(s, (addr + i) & 0xFFFF, 0);
+        }
+    }
+    for (unsigned i = 0; i < len; i++)
+    {
+        s->mem[(pc + i) & 0xFFFF] = t->code[i];
+        set_mems(s, (pc + i) & 0xFFFF, trec_mems[(t->st >> (2 * i)) & 3]);
+    }
+    s->cpu.r = t->r;
+    s->cpu.cycles = t->cycles;
+    load_p(&s->cpu);
+    sim65_print_reg(s, f);
+}
+
+// --------------------------------------------------------------------
+// Binary trace
+// --------------------------------------------------------------------
+// The file is a sequence of chunks, each one a 4 byte tag, the 32 bit
+// length of the data and the data, in host byte order:
+//  "S65T": header, the version, a flag set if the simulator had labels
+//          and the labels, each one as the address, length and text.
+//  "S65B": block of records. The state is reset at the start of each block,
+//          so blocks can be decoded alone and trace files concatenated.
+// Each instruction is one record, with the flags byte, the PC if it is not
+// the next instruction, the registers that changed, the cycle increment as
+// a variable length number, the instruction bytes and their status if they
+// changed since the last time they were traced, and the pointer used by
+// indirect instructions. Messages are records with both PC flags set.
+#define BTRACE_VERSION 1
+#define BTRACE_BLOCK   65536
+
+enum btrace_flags
+{
+    bt_pc     = 1,      // Followed by the PC
+    bt_branch = 2,      // Followed by the PC offset from the next instruction
+    bt_msg    = 3,      // Message: absolute cycle, length and text
+    bt_a      = 4,      // Followed by register values
+    bt_x      = 8,
+    bt_y      = 16,
+    bt_p      = 32,
+    bt_s      = 64,
+    bt_code   = 128     // Followed by the instruction bytes and status
+};
+
+// State of the binary trace, the same in the writer and the reader
+struct btrace
+{
+    uint8_t buf[BTRACE_BLOCK];
+    unsigned len;
+    int header;                 // Header already written
+    int state;                  // Registers already written in the block
+    struct sim65_reg r;         // Registers of the last record
+    uint64_t cycles;
+    uint16_t next_pc;           // PC after the last instruction
+    uint8_t mem[MAXRAM];        // Instruction bytes in the trace
+    uint8_t mems[MAXRAM];       // Their status + 1, 0 if not in the trace
+};
+
+static void btrace_chunk(FILE *f, const char *tag, const void *data, uint32_t len)
+{
+    fwrite(tag, 1, 4, f);
+    fwrite(&len, sizeof(len), 1, f);
+    fwrite(data, 1, len, f);
+}
+
+static void btrace_flush(sim65 s)
+{
+    struct btrace *b = s->btrace;
+    if (b && b->len)
+    {
+        btrace_chunk(s->trace_file, "S65B", b->buf, b->len);
+        b->len = 0;
+    }
+}
+
+static uint8_t *put_num(uint8_t *p, uint64_t x)
+{
+    while (x >= 0x80)
+    {
+        *p++ = x | 0x80;
+        x >>= 7;
+    }
+    *p++ = x;
+    return p;
+}
+
+// Returns the space for a record of up to "len" bytes, starting a new
+// block if needed. Returns NULL on error.
+static uint8_t *btrace_record(sim65 s, unsigned len)
+{
+    struct btrace *b = s->btrace;
+    if (!b)
+    {
+        b = s->btrace = (struct btrace *)malloc(sizeof(struct btrace));
+        if (!b)
+            return 0;
+        b->len = 0;
+        b->header = 0;
+    }
+    if (!b->header)
+    {
+        // Header, with the labels used to print the trace
+        size_t size = 8, pos = 8;
+        for (unsigned i = 0; s->labels && i < 256; i++)
+            for (unsigned j = 0; s->labels->page[i] && j < 256; j++)
+                size += 3 + strlen(s->labels->page[i] + j * 32);
+        uint8_t *h = (uint8_t *)malloc(size);
+        if (!h)
+            return 0;
+        uint32_t hdr[2] = { BTRACE_VERSION, s->labels != 0 };
+        memcpy(h, hdr, 8);
+        for (unsigned i = 0; s->labels && i < 256; i++)
+            for (unsigned j = 0; s->labels->page[i] && j < 256; j++)
+            {
+                const char *l = s->labels->page[i] + j * 32;
+                size_t n = strlen(l);
+                if (!n)
+                    continue;
+                uint16_t addr = i * 256 + j;
+                memcpy(h + pos, &addr, 2);
+                h[pos + 2] = n;
+                memcpy(h + pos + 3, l, n);
+                pos += 3 + n;
+            }
+        btrace_chunk(s->trace_file, "S65T", h, pos);
+        free(h);
+        b->header = 1;
+    }
+    if (b->len + len > BTRACE_BLOCK)
+        btrace_flush(s);
+    if (!b->len)
+    {
+        b->state = 0;
+        memset(b->mems, 0, sizeof(b->mems));
+    }
+    return b->buf + b->len;
+}
+
+static void btrace_ins(sim65 s, const struct trec *t)
+{
+    uint8_t *p = btrace_record(s, 32), *start = p;
+    if (!p)
+        return;
+    struct btrace *b = s->btrace;
+    int first = !b->state;
+    unsigned len = ilen[t->code[0]], flags = 0;
+
+    // Flags, PC and changed registers
+    int16_t ofs = t->r.pc - b->next_pc;
+    p++;
+    if (first || (ofs && (ofs < -128 || ofs > 127)))
+    {
+        flags |= bt_pc;
+        memcpy(p, &t->r.pc, 2);
+        p += 2;
+    }
+    else if (ofs)
+    {
+        flags |= bt_branch;
+        *p++ = ofs;
+    }
+#define BT_REG(reg, flag) if (first || t->r.reg != b->r.reg) { flags |= flag; *p++ = t->r.reg; }
+    BT_REG(a, bt_a);
+    BT_REG(x, bt_x);
+    BT_REG(y, bt_y);
+    BT_REG(p, bt_p);
+    BT_REG(s, bt_s);
+#undef BT_REG
+    p = put_num(p, t->cycles - (first ? 0 : b->cycles));
+
+    // Instruction bytes, if not already known
+    for (unsigned i = 0; i < len; i++)
+    {
+        unsigned addr = (t->r.pc + i) & 0xFFFF;
+        if (b->mems[addr] != ((t->st >> (2 * i)) & 3) + 1 || b->mem[addr] != t->code[i])
+            flags |= bt_code;
+    }
+    if (flags & bt_code)
+    {
+        for (unsigned i = 0; i < len; i++)
+        {
+            unsigned addr = (t->r.pc + i) & 0xFFFF;
+            *p++ = b->mem[addr] = t->code[i];
+            b->mems[addr] = ((t->st >> (2 * i)) & 3) + 1;
+        }
+        *p++ = t->st;
+    }
+
+    // Pointer of indirect instructions
+    if (ihint[t->code[0]])
+    {
+        memcpy(p, &t->hint, 2);
+        p += 2;
+    }
+
+    *start = flags;
+    b->len += p - start;
+    b->r = t->r;
+    b->cycles = t->cycles;
+    b->next_pc = t->r.pc + len;
+    b->state = 1;
+}
+
+static void btrace_msg(sim65 s, uint64_t cycles, const char *msg)
+{
+    size_t n = strlen(msg);
+    uint8_t *p = btrace_record(s, n + 32), *start = p;
+    if (!p)
+        return;
+    *p++ = bt_msg;
+    p = put_num(p, cycles);
+    p = put_num(p, n);
+    memcpy(p, msg, n);
+    p += n;
+    s->btrace->len += p - start;
+}
+
+void sim65_set_trace_format(sim65 s, enum sim65_trace_fmt fmt)
+{
+    tring_stop(s);
+    btrace_flush(s);
+    s->trace_fmt = fmt;
+}
+
+// Reads a variable length number, returns 0 at the end of the data
+static int get_num(const uint8_t **p, const uint8_t *end, uint64_t *x)
+{
+    *x = 0;
+    for (unsigned sh = 0; *p < end && sh < 64; sh += 7)
+    {
+        uint8_t c = *(*p)++;
+        *x |= (uint64_t)(c & 0x7F) << sh;
+        if (!(c & 0x80))
+            return 1;
+    }
+    return 0;
+}
+
+// Prints the records of one block, returns 0 if it is invalid
+static int btrace_decode_block(sim65 s, struct btrace *b, const uint8_t *p,
+                               const uint8_t *end, FILE *out)
+{
+    int first = 1;
+    memset(b->mems, 0, sizeof(b->mems));
+    while (p < end)
+    {
+        unsigned flags = *p++;
+        uint64_t x;
+        if ((flags & bt_msg) == bt_msg)
+        {
+            uint64_t cycles;
+            if (!get_num(&p, end, &cycles) || !get_num(&p, end, &x) || x > (uint64_t)(end - p))
+                return 0;
+            fprintf(out, "%08" PRIX64 ": %.*s\n", cycles, (int)x, p);
+            p += x;
+            continue;
+        }
+        if (first && (flags & (bt_pc | bt_a | bt_x | bt_y | bt_p | bt_s)) !=
+                     (bt_pc | bt_a | bt_x | bt_y | bt_p | bt_s))
+            return 0;
+        if (end - p < (flags & bt_pc ? 2 : 1))
+            return 0;
+        if (flags & bt_pc)
+        {
+            memcpy(&b->r.pc, p, 2);
+            p += 2;
+        }
+        else if (flags & bt_branch)
+            b->r.pc = b->next_pc + (int8_t)*p++;
+        else
+            b->r.pc = b->next_pc;
+#define BT_REG(reg, flag) if (flags & flag) { if (p >= end) return 0; b->r.reg = *p++; }
+        BT_REG(a, bt_a);
+        BT_REG(x, bt_x);
+        BT_REG(y, bt_y);
+        BT_REG(p, bt_p);
+        BT_REG(s, bt_s);
+#undef BT_REG
+        if (!get_num(&p, end, &x))
+            return 0;
+        b->cycles = (first ? 0 : b->cycles) + x;
+        first = 0;
+
+        uint16_t pc = b->r.pc;
+        if (flags & bt_code)
+        {
+            if (p >= end)
+                return 0;
+            unsigned len = ilen[*p];
+            if ((unsigned)(end - p) < len + 1)
+                return 0;
+            for (unsigned i = 0; i < len; i++)
+            {
+                b->mem[(pc + i) & 0xFFFF] = p[i];
+                b->mems[(pc + i) & 0xFFFF] = ((p[len] >> (2 * i)) & 3) + 1;
+            }
+            p += len + 1;
+        }
+        struct trec tr = { .cycles = b->cycles, .r = b->r };
+        unsigned len = ilen[b->mem[pc]];
+        for (unsigned i = 0; i < len; i++)
+        {
+            unsigned addr = (pc + i) & 0xFFFF;
+            if (!b->mems[addr])
+                return 0;
+            tr.code[i] = b->mem[addr];
+            tr.st |= (b->mems[addr] - 1) << (2 * i);
+        }
+        if (ihint[tr.code[0]])
+        {
+            if (end - p < 2)
+                return 0;
+            memcpy(&tr.hint, p, 2);
+            p += 2;
+        }
+        b->next_pc = pc + len;
+        trec_print(s, &tr, out);
+    }
+    return 1;
+}
+
+int sim65_trace_decode(sim65 s, FILE *in, FILE *out)
+{
+    struct btrace *b = (struct btrace *)malloc(sizeof(struct btrace));
+    uint8_t *data = 0;
+    int ret = -1;
+    char tag[4];
+    uint32_t len;
+    if (!b)
+        return -1;
+    while (1 == fread(tag, 4, 1, in))
+    {
+        if (1 != fread(&len, sizeof(len), 1, in))
+            goto end;
+        uint8_t *ndata = (uint8_t *)realloc(data, len ? len : 1);
+        if (!ndata)
+            goto end;
+        data = ndata;
+        if (len != fread(data, 1, len, in))
+            goto end;
+        if (!memcmp(tag, "S65T", 4))
+        {
+            // Header, loads the labels
+            uint32_t hdr[2];
+            if (len < 8)
+                goto end;
+            memcpy(hdr, data, 8);
+            if (hdr[0] != BTRACE_VERSION)
+                goto end;
+            if (hdr[1] && !s->labels)
+                s->labels = (struct labels *)calloc(1, sizeof(struct labels));
+            for (uint32_t pos = 8; pos + 3 <= len; pos += 3 + data[pos + 2])
+            {
+                char lbl[32];
+                uint16_t addr;
+                unsigned n = data[pos + 2];
+                if (pos + 3 + n > len || n > 31)
+                    goto end;
+                memcpy(&addr, data + pos, 2);
+                memcpy(lbl, data + pos + 3, n);
+                lbl[n] = 0;
+                sim65_lbl_add(s, addr, lbl);
+            }
+        }
+        else if (memcmp(tag, "S65B", 4) ||
+                 !btrace_decode_block(s, b, data, data + len, out))
+            goto end;
+    }
+    ret = feof(in) ? 0 : -1;
+end:
+    free(data);
+    free(b);
+    return ret;
+}
+
+// --------------------------------------------------------------------
+// Asynchronous trace writer
+// --------------------------------------------------------------------
+// The simulation thread only captures the trace records into a single
+// producer, single consumer ring, and a writer thread formats and writes
+// them. The trace file, format and binary trace buffer belong to the writer
+// while it runs, the simulation waits for the ring to be empty before
+// changing them.
+// The indexes are only atomics, a thread that finds the ring empty (the
+// writer) or full (the simulation) sets its flag and sleeps on a condition
+// variable, and the other thread only takes the lock to wake it.
+// The simulation wakes the writer every TRING_WAKE records, or when it has
+// to wait, so that the writer does not switch in for every few records.
+#define TRING_SIZE  65536       // Records in the ring, a power of two
+#define TRING_BATCH 64          // Records written before updating the tail
+#define TRING_WAKE  4096        // Records stored before waking the writer
+
+struct tring
+{
+    struct trec rec[TRING_SIZE];
+    _Atomic uint64_t head CACHE_ALIGN;  // Next record, written by the simulation
+    uint64_t tail_cache;                // Last tail seen by the simulation
+    uint32_t dropped;                   // Records dropped since the last one
+    _Atomic uint64_t tail CACHE_ALIGN;  // Next record, written by the writer
+    _Atomic int terminate;
+    _Atomic int idle;                   // Writer waiting for records
+    _Atomic uint64_t wait_pos;          // Tail the simulation waits for, or 0
+    pthread_mutex_t lock;
+    pthread_cond_t more;                // Signals new records or terminate
+    pthread_cond_t room;                // Signals written records
+    sim65 s;
+    sim65 view;                         // Scratch simulator to print records
+    pthread_t thread;
+};
+
+static void tring_write(struct tring *t, struct trec *r)
+{
+    sim65 s = t->s;
+    char msg[64];
+    if (r->dropped)
+    {
+        snprintf(msg, sizeof(msg), "%" PRIu32 " trace records dropped", r->dropped);
+        if (s->trace_fmt == sim65_trace_binary)
+            btrace_msg(s, r->cycles, msg);
+        else
+            fprintf(s->trace_file, "%08" PRIX64 ": %s\n", r->cycles, msg);
+    }
+    if (r->msg)
+    {
+        if (s->trace_fmt == sim65_trace_binary)
+            btrace_msg(s, r->cycles, r->msg);
+        else
+            fprintf(s->trace_file, "%08" PRIX64 ": %s\n", r->cycles, r->msg);
+        free(r->msg);
+    }
+    else if (s->trace_fmt == sim65_trace_binary)
+        btrace_ins(s, r);
+    else
+        trec_print(t->view, r, s->trace_file);
+}
+
+static void tring_wake(struct tring *t, pthread_cond_t *c)
+{
+    pthread_mutex_lock(&t->lock);
+    pthread_cond_signal(c);
+    pthread_mutex_unlock(&t->lock);
+}
+
+// Publishes the written records, the wait position is read after the store
+// so that either the writer sees the simulation waiting or the simulation
+// sees the new tail.
+static void tring_done(struct tring *t, uint64_t tail)
+{
+    atomic_store(&t->tail, tail);
+    uint64_t pos = atomic_load(&t->wait_pos);
+    if (pos && tail >= pos)
+        tring_wake(t, &t->room);
+}
+
+static void *tring_thread(void *arg)
+{
+    struct tring *t = arg;
+    uint64_t tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+    for (;;)
+    {
+        int terminate = atomic_load_explicit(&t->terminate, memory_order_acquire);
+        uint64_t head = atomic_load_explicit(&t->head, memory_order_acquire);
+        if (head == tail)
+        {
+            if (terminate)
+                break;
+            atomic_store(&t->idle, 1);
+            pthread_mutex_lock(&t->lock);
+            while (atomic_load(&t->head) == tail && !atomic_load(&t->terminate))
+                pthread_cond_wait(&t->more, &t->lock);
+            pthread_mutex_unlock(&t->lock);
+            atomic_store_explicit(&t->idle, 0, memory_order_relaxed);
+            continue;
+        }
+        while (tail != head)
+        {
+            tring_write(t, &t->rec[tail++ & (TRING_SIZE - 1)]);
+            if (!(tail & (TRING_BATCH - 1)))
+                tring_done(t, tail);
+        }
+        tring_done(t, tail);
+    }
+    return 0;
+}
+
+// Wakes the writer if it sleeps, the fence orders the last head store
+// before reading the flag
+static void tring_kick(struct tring *t)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&t->idle, memory_order_relaxed))
+        tring_wake(t, &t->more);
+}
+
+// Waits until the writer has written all the records before pos
+static void tring_wait(struct tring *t, uint64_t pos)
+{
+    if (atomic_load_explicit(&t->tail, memory_order_acquire) >= pos)
+        return;
+    atomic_store(&t->wait_pos, pos);
+    tring_kick(t);
+    pthread_mutex_lock(&t->lock);
+    while (atomic_load(&t->tail) < pos)
+        pthread_cond_wait(&t->room, &t->lock);
+    pthread_mutex_unlock(&t->lock);
+    atomic_store_explicit(&t->wait_pos, 0, memory_order_relaxed);
+}
+
+static int tring_start(sim65 s)
+{
+    struct tring *t = (struct tring *)aligned_alloc(64, sizeof(struct tring));
+    if (!t)
+        return -1;
+    t->view = sim65_new();
+    if (!t->view)
+    {
+        free(t);
+        return -1;
+    }
+    // Labels can't change while the writer runs, see sim65_lbl_add
+    t->view->labels = s->labels;
+    t->s = s;
+    t->tail_cache = t->dropped = 0;
+    atomic_init(&t->head, 0);
+    atomic_init(&t->tail, 0);
+    atomic_init(&t->terminate, 0);
+    atomic_init(&t->idle, 0);
+    atomic_init(&t->wait_pos, 0);
+    pthread_mutex_init(&t->lock, 0);
+    pthread_cond_init(&t->more, 0);
+    pthread_cond_init(&t->room, 0);
+    if (pthread_create(&t->thread, 0, tring_thread, t))
+    {
+        pthread_cond_destroy(&t->room);
+        pthread_cond_destroy(&t->more);
+        pthread_mutex_destroy(&t->lock);
+        t->view->labels = 0;
+        sim65_free(t->view);
+        free(t);
+        return -1;
+    }
+    s->tring = t;
+    return 0;
+}
+
+// Waits until the writer thread has written all the records
+static void tring_sync(sim65 s)
+{
+    struct tring *t = s->tring;
+    if (t)
+        tring_wait(t, atomic_load_explicit(&t->head, memory_order_relaxed));
+}
+
+static void tring_stop(sim65 s)
+{
+    struct tring *t = s->tring;
+    if (!t)
+        return;
+    pthread_mutex_lock(&t->lock);
+    atomic_store_explicit(&t->terminate, 1, memory_order_release);
+    pthread_cond_signal(&t->more);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->thread, 0);
+    pthread_cond_destroy(&t->room);
+    pthread_cond_destroy(&t->more);
+    pthread_mutex_destroy(&t->lock);
+    t->view->labels = 0;
+    sim65_free(t->view);
+    free(t);
+    s->tring = 0;
+}
+
+// Returns the next free record, or NULL if it was dropped
+static struct trec *tring_next(sim65 s, int drop)
+{
+    struct tring *t = s->tring;
+    uint64_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+    while (head - t->tail_cache == TRING_SIZE)
+    {
+        t->tail_cache = atomic_load_explicit(&t->tail, memory_order_acquire);
+        if (head - t->tail_cache < TRING_SIZE)
+            break;
+        if (drop)
+        {
+            t->dropped++;
+            s->trace_drops++;
+            return 0;
+        }
+        // Wait for half the ring, not for each batch the writer publishes
+        tring_wait(t, head - TRING_SIZE / 2);
+    }
+    struct trec *r = &t->rec[head & (TRING_SIZE - 1)];
+    r->dropped = t->dropped;
+    t->dropped = 0;
+    return r;
+}
+
+static void tring_push(sim65 s)
+{
+    struct tring *t = s->tring;
+    uint64_t head = atomic_load_explicit(&t->head, memory_order_relaxed) + 1;
+    atomic_store_explicit(&t->head, head, memory_order_release);
+    if (!(head & (TRING_WAKE - 1)))
+        tring_kick(t);
+}
+
+// Writes the trace of the current instruction
+static void trace_ins(sim65 s)
+{
+    if (s->trace_async && !s->tring && tring_start(s))
+        s->trace_async = sim65_trace_sync;
+    if (s->tring)
+    {
+        struct trec *r = tring_next(s, s->trace_async == sim65_trace_drop);
+        if (r)
+        {
+            trec_get(s, r);
+            tring_push(s);
+        }
+    }
+    else if (s->trace_fmt == sim65_trace_binary)
+    {
+        struct trec r;
+        trec_get(s, &r);
+        btrace_ins(s, &r);
+    }
+    else
+        sim65_print_reg(s, s->trace_file);
+}
+
+// Writes a message to the trace, returns 0 if it must be written directly
+static int trace_msg(sim65 s, const char *msg)
+{
+    if (s->tring)
+    {
+        // Messages are never dropped
+        struct trec *r = tring_next(s, 0);
+        r->cycles = s->cpu.cycles;
+        r->msg = strdup(msg);
+        if (r->msg)
+        {
+            tring_push(s);
+            return 1;
+        }
+        tring_sync(s);
+    }
+    if (s->trace_fmt == sim65_trace_binary)
+    {
+        btrace_msg(s, s->cpu.cycles, msg);
+        return 1;
+    }
+    return 0;
+}
+
+void sim65_set_trace_async(sim65 s, enum sim65_trace_async mode)
+{
+    tring_stop(s);
+    s->trace_async = mode;
+}
+
+uint64_t sim65_get_trace_drops(const sim65 s)
+{
+    return s->trace_drops;
+}
+
+// --------------------------------------------------------------------
+// Trace window
+// --------------------------------------------------------------------
+// The start conditions only need hooks that are already free while the
+// window is closed: an exec callback at the start address, a write callback
+// at the watched address and the cycle stop of the simulation loop. While
+// the window is open the trace loop checks the stop conditions and the
+// range at each instruction, and the range addresses have exec callbacks to
+// select the trace loop again when the PC enters the range. Those are only
+// installed while the window is open, so the code in the range is still
+// decoded and translated while it is closed.
+
+static void trace_note(sim65 s, const char *msg)
+{
+    if (s->debug >= sim65_debug_trace && !trace_msg(s, msg))
+        fprintf(s->trace_file, "%08" PRIX64 ": %s\n", s->cpu.cycles, msg);
+}
+
+static void trig_set_active(sim65 s, int active)
+{
+    if (s->trig->active != active)
+    {
+        s->trig->active = active;
+        set_run_mode(s);
+    }
+}
+
+static int trig_exec(sim65 s, struct sim65_reg *regs, unsigned addr, int data);
+
+// Installs or removes the exec callbacks of the range, chaining the
+// callbacks already there. The start address always has its callback.
+static void trig_range(sim65 s, int set)
+{
+    struct trig *t = s->trig;
+    for (unsigned a = t->t.lo; t->t.hi && a <= t->t.hi; a++)
+    {
+        if ((int)a == t->t.start_pc)
+            continue;
+        if (set)
+        {
+            t->range_prev[a - t->t.lo] = exec_callback(s, a);
+            sim65_add_callback(s, a, trig_exec, sim65_cb_exec);
+        }
+        else if (exec_callback(s, a) == trig_exec)
+            sim65_add_callback(s, a, t->range_prev[a - t->t.lo], sim65_cb_exec);
+    }
+}
+
+static void trig_open(sim65 s, const char *msg)
+{
+    struct trig *t = s->trig;
+    t->open = 1;
+    trig_range(s, 1);
+    t->left = t->t.count;
+    t->sp = s->cpu.r.s;
+    trig_set_active(s, 1);
+    if (msg)
+        trace_note(s, msg);
+}
+
+static void trig_close(sim65 s)
+{
+    s->trig->open = 0;
+    trig_range(s, 0);
+    trig_set_active(s, 0);
+}
+
+// Name of the address for the trace messages
+static const char *trig_name(sim65 s, uint16_t addr, char *buf)
+{
+    const char *l = get_label(s, addr);
+    if (l && *l)
+        return l;
+    sprintf(buf, "$%04X", addr);
+    return buf;
+}
+
+static int trig_exec(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
+{
+    struct trig *t = s->trig;
+    sim65_callback prev;
+    // The range is checked in trig_ins, called after the callback
+    if ((int)addr != t->t.start_pc)
+        prev = t->range_prev[addr - t->t.lo];
+    else
+    {
+        prev = t->start_prev;
+        if (!t->open)
+        {
+            char msg[80], buf[8];
+            snprintf(msg, sizeof(msg), "Trace started at %s", trig_name(s, addr, buf));
+            trig_open(s, msg);
+        }
+    }
+    return prev ? prev(s, regs, addr, data) : 0;
+}
+
+static int trig_write(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
+{
+    struct trig *t = s->trig;
+    if (!t->open)
+    {
+        char msg[80], buf[8];
+        snprintf(msg, sizeof(msg), "Trace started by write of $%02X to %s",
+                 data & 0xFF, trig_name(s, addr, buf));
+        trig_open(s, msg);
+    }
+    if (t->watch_prev)
+        return t->watch_prev(s, regs, addr, data);
+    store_byte(s, addr, data);
+    return 0;
+}
+
+// Updates the trace window before each instruction in the trace loop, and
+// before the instructions with hooks in the other loops.
+// Returns 1 if the instruction is traced.
+static int trig_ins(sim65 s)
+{
+    struct trig *t = s->trig;
+    uint16_t pc = s->cpu.r.pc;
+    if (!t->open && t->t.start_cycle && s->cpu.cycles >= t->t.start_cycle)
+    {
+        t->t.start_cycle = 0;
+        set_cycle_stop(s);
+        trig_open(s, "Trace started at cycle");
+    }
+    if (!t->open)
+        return 0;
+    if (t->t.stop_cycle && s->cpu.cycles >= t->t.stop_cycle)
+    {
+        trig_close(s);
+        return 0;
+    }
+    // Outside the range, the range callbacks select the trace loop again
+    if (t->t.hi && (pc < t->t.lo || pc > t->t.hi))
+    {
+        trig_set_active(s, 0);
+        return 0;
+    }
+    trig_set_active(s, 1);
+    // Closes after tracing the last instruction
+    uint8_t ins = s->mem[pc];
+    if ((t->t.count && !--t->left) ||
+        (t->t.stop_ret && (ins == 0x60 || ins == 0x40) && s->cpu.r.s == t->sp))
+        trig_close(s);
+    return 1;
+}
+
+// Removes the callbacks of the trace window
+static void trig_remove(sim65 s)
+{
+    struct trig *t = s->trig;
+    if (!t)
+        return;
+    if (t->open)
+        trig_range(s, 0);
+    if (t->t.start_pc >= 0)
+        sim65_add_callback(s, t->t.start_pc, t->start_prev, sim65_cb_exec);
+    if (t->t.watch >= 0)
+        sim65_add_callback(s, t->t.watch, t->watch_prev, sim65_cb_write);
+    free(t);
+    s->trig = 0;
+}
+
+int sim65_set_trace_trigger(sim65 s, const struct sim65_trace_trigger *trig)
+{
+    trig_remove(s);
+    if (trig && (trig->start_pc >= MAXRAM || trig->watch >= MAXRAM ||
+                 trig->hi >= MAXRAM || (trig->hi && trig->lo > trig->hi) ||
+                 !(s->trig = (struct trig *)calloc(1, trig_size(trig)))))
+    {
+        set_cycle_stop(s);
+        return -1;
+    }
+    if (trig)
+    {
+        struct trig *t = s->trig;
+        t->t = *trig;
+        if (t->t.start_pc >= 0)
+        {
+            t->start_prev = exec_callback(s, t->t.start_pc);
+            sim65_add_callback(s, t->t.start_pc, trig_exec, sim65_cb_exec);
+        }
+        if (t->t.watch >= 0)
+        {
+            struct cb_page *cb = s->pages[t->t.watch >> 8].cb;
+            t->watch_prev = cb ? cb->write[t->t.watch & 0xFF] : 0;
+            sim65_add_callback(s, t->t.watch, trig_write, sim65_cb_write);
+        }
+        if (t->t.start_pc < 0 && t->t.watch < 0 && !t->t.start_cycle)
+            trig_open(s, 0);
+    }
+    set_cycle_stop(s);
+    return 0;
+}
+
 int sim65_dprintf(sim65 s, const char *format, ...)
 {
     char buf[1024];
-    int size;
+    int size = 0;
     va_list ap;
 
     if (s->debug >= sim65_debug_messages)
@@ -1452,18 +3366,16 @@ int sim65_dprintf(sim65 s, const char *format, ...)
         if (s->debug < sim65_debug_trace || s->trace_file != stderr)
             size = fprintf(stderr, "sim65: %s\n", buf);
         // And print to trace file, if trace is active
-        if (s->debug >= sim65_debug_trace)
-            size = fprintf(s->trace_file, "%08" PRIX64 ": %s\n", s->cycles, buf);
+        if (s->debug >= sim65_debug_trace && !trace_msg(s, buf))
+            size = fprintf(s->trace_file, "%08" PRIX64 ": %s\n", s->cpu.cycles, buf);
     }
-    else
-        size = 0;
     return size;
 }
 
 int sim65_eprintf(sim65 s, const char *format, ...)
 {
     char buf[1024];
-    int size;
+    int size = 0;
     va_list ap;
     va_start(ap, format);
     vsnprintf(buf, 1024, format, ap);
@@ -1471,7 +3383,12 @@ int sim65_eprintf(sim65 s, const char *format, ...)
     if (s->debug < sim65_debug_trace || s->trace_file != stderr)
         size = fprintf(stderr, "sim65: ERROR, %s\n", buf);
     if (s->debug >= sim65_debug_trace)
-        size = fprintf(s->trace_file, "%08" PRIX64 ": ERROR, %s\n", s->cycles, buf);
+    {
+        char msg[1040];
+        snprintf(msg, sizeof(msg), "ERROR, %s", buf);
+        if (!trace_msg(s, msg))
+            size = fprintf(s->trace_file, "%08" PRIX64 ": %s\n", s->cpu.cycles, msg);
+    }
     return size;
 }
 
@@ -1510,12 +3427,31 @@ void sim65_lbl_add(sim65 s, uint16_t addr, const char *lbl)
     // Ignore empty labels
     if (!lbl || !*lbl)
         return;
+    // The trace writer thread reads the labels
+    tring_stop(s);
     // Allocate labels if not already done
     if (!s->labels)
-        s->labels = (char *)calloc(65536, 32);
+        s->labels = (struct labels *)calloc(1, sizeof(struct labels));
+    if (!s->labels)
+        return;
+    if (!s->labels->page[addr >> 8])
+        s->labels->page[addr >> 8] = (char *)calloc(256, 32);
+    if (!s->labels->page[addr >> 8])
+        return;
     strncpy( get_label(s, addr), lbl, 31);
 }
 
+int sim65_lbl_find(const sim65 s, const char *lbl)
+{
+    if (!*lbl)
+        return -1;
+    for (unsigned i = 0; s->labels && i < 256; i++)
+        for (unsigned j = 0; s->labels->page[i] && j < 256; j++)
+            if (!strncmp(s->labels->page[i] + j * 32, lbl, 31))
+                return i * 256 + j;
+    return -1;
+}
+
 int sim65_lbl_load(sim65 s, const char *lblname)
 {
     int line = 0;
@@ -1550,28 +3486,196 @@ int sim65_lbl_load(sim65 s, const char *lblname)
 
 uint64_t sim65_get_cycles(const sim65 s)
 {
-    return s->cycles;
+    return s->cpu.cycles;
+}
+
+void sim65_get_regs(const sim65 s, struct sim65_reg *regs)
+{
+    *regs = s->cpu.r;
+}
+
+void sim65_set_regs(sim65 s, const struct sim65_reg *regs)
+{
+    s->cpu.r = *regs;
+}
+
+void sim65_set_user_data(sim65 s, void *data)
+{
+    s->user_data = data;
+}
+
+void *sim65_get_user_data(const sim65 s)
+{
+    return s->user_data;
+}
+
+// Snapshot of the machine state, stored in host byte order. The memory
+// status is stored without the decoded code bits.
+#define SNAPSHOT_MAGIC "sim65sn"
+#define SNAPSHOT_VERSION 1
+struct snapshot
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t size;          // Size of this struct
+    uint64_t cycles;
+    struct sim65_reg r;
+    uint8_t irq;
+    uint8_t nmi;
+    uint8_t nmi_edge;
+    uint8_t pad[6];
+    uint8_t mem[MAXRAM];
+    uint8_t mems[MAXRAM];
+};
+
+int sim65_snapshot_save(const sim65 s, FILE *f)
+{
+    struct snapshot *sn = calloc(1, sizeof(struct snapshot));
+    if (!sn)
+        return -1;
+    memcpy(sn->magic, SNAPSHOT_MAGIC, sizeof(sn->magic));
+    sn->version = SNAPSHOT_VERSION;
+    sn->size = sizeof(struct snapshot);
+    sn->cycles = s->cpu.cycles;
+    sn->r = s->cpu.r;
+    sn->irq = s->irq;
+    sn->nmi = s->nmi;
+    sn->nmi_edge = s->nmi_edge;
+    memcpy(sn->mem, s->mem, MAXRAM);
+    for (unsigned i = 0; i < MAXRAM; i++)
+        sn->mems[i] = s->mems[i] & ~ms_code;
+    int ret = fwrite(sn, sizeof(struct snapshot), 1, f) == 1 ? 0 : -1;
+    free(sn);
+    return ret;
+}
+
+size_t sim65_snapshot_load(sim65 s, const void *data, size_t len)
+{
+    const struct snapshot *sn = data;
+    if (len < sizeof(struct snapshot) ||
+        memcmp(sn->magic, SNAPSHOT_MAGIC, sizeof(sn->magic)) ||
+        sn->version != SNAPSHOT_VERSION || sn->size != sizeof(struct snapshot))
+        return 0;
+
+    // All decoded code and device events are discarded
+    code_invalidate(s, 0, MAXRAM);
+    code_gc(s);
+    s->events.count = 0;
+
+    // Keep the remaining cycles of the limit
+    if (s->cycle_limit)
+        s->cycle_limit = s->cycle_limit > s->cpu.cycles ?
+                         s->cycle_limit - s->cpu.cycles + sn->cycles : sn->cycles;
+    s->cpu.cycles = sn->cycles;
+    s->cpu.r = sn->r;
+    set_flags(&s->cpu, 0xFF, sn->r.p);
+    memcpy(s->mem, sn->mem, MAXRAM);
+    // Only the initialized state is restored, the memory map stays
+    for (unsigned i = 0; i < MAXRAM; i++)
+        set_mems(s, i, (s->mems[i] & ~ms_invalid) | (sn->mems[i] & ms_invalid));
+    s->error = sim65_err_none;
+    s->stop &= ~(stop_error | stop_irq);
+    s->irq = 0;
+    s->nmi = sn->nmi;
+    s->nmi_edge = sn->nmi_edge;
+    if (s->nmi_edge)
+        s->stop |= stop_irq;
+    sim65_set_irq(s, sn->irq);
+    set_cycle_stop(s);
+    return sizeof(struct snapshot);
 }
 
 struct sim65_profile sim65_get_profile_info(const sim65 s)
 {
+    // Return zeros if profiling was never enabled
+    static const struct prof no_prof;
+    const struct prof *p = s->prof ? s->prof : &no_prof;
     struct sim65_profile r;
-    r.exe_count = s->prof.exe;
-    r.branch_taken = s->prof.branch;
-    r.total.branch_skip = s->prof.branch_skip;
-    r.total.branch_taken = s->prof.branch_taken;
-    r.total.branch_extra = s->prof.branch_extra;
-    r.total.instructions = s->prof.instructions;
-    r.total.cycles = s->cycles;
-    r.total.extra_abs_x = s->prof.abs_x_extra;
-    r.total.extra_abs_y = s->prof.abs_y_extra;
-    r.total.extra_ind_y = s->prof.ind_y_extra;
+    r.exe_count = p->exe;
+    r.branch_taken = p->branch;
+    r.total.branch_skip = p->branch_skip;
+    r.total.branch_taken = p->branch_taken;
+    r.total.branch_extra = p->branch_extra;
+    r.total.instructions = p->instructions;
+    r.total.cycles = s->cpu.cycles;
+    r.total.extra_abs_x = p->abs_x_extra;
+    r.total.extra_abs_y = p->abs_y_extra;
+    r.total.extra_ind_y = p->ind_y_extra;
     return r;
 }
 
+void sim65_add_profile(sim65 s, const sim65 from)
+{
+    const struct prof *f = from->prof;
+    if (!f || (!s->prof && !(s->prof = (struct prof *)calloc(1, sizeof(struct prof)))))
+        return;
+    struct prof *p = s->prof;
+    for (unsigned i = 0; i < MAXRAM; i++)
+    {
+        p->exe[i] += f->exe[i];
+        p->branch[i] += f->branch[i];
+    }
+    p->branch_skip += f->branch_skip;
+    p->branch_taken += f->branch_taken;
+    p->branch_extra += f->branch_extra;
+    p->abs_x_extra += f->abs_x_extra;
+    p->abs_y_extra += f->abs_y_extra;
+    p->ind_y_extra += f->ind_y_extra;
+    p->instructions += f->instructions;
+}
+
+void sim65_print_fuse_stats(const sim65 s, FILE *f)
+{
+    unsigned i;
+    for (i = 0; i < fuse_num; i++)
+        fprintf(f, "%9u %s\n", s->fuse_count[i], fuse_seq[i].text);
+}
+
+void sim65_print_idle_stats(const sim65 s, FILE *f)
+{
+    fprintf(f, "%9u idle loops skipped\n", s->idle_count);
+    fprintf(f, "%9" PRIu64 " cycles skipped\n", s->idle_cycles);
+}
+
 void sim65_set_profiling(const sim65 s, int set)
 {
-    s->do_prof = set;
+    if (set && !s->prof)
+        s->prof = (struct prof *)calloc(1, sizeof(struct prof));
+    s->do_prof = set && s->prof;
+    set_run_mode(s);
+}
+
+int sim65_set_jit(sim65 s, int set)
+{
+#ifdef SIM65_JIT
+    if (set && !s->jit)
+    {
+        struct jit_layout l = {
+            .mem = offsetof(struct sim65s, mem),
+            .mems = offsetof(struct sim65s, mems),
+            .a = offsetof(struct sim65s, cpu.r.a),
+            .x = offsetof(struct sim65s, cpu.r.x),
+            .y = offsetof(struct sim65s, cpu.r.y),
+            .p = offsetof(struct sim65s, cpu.r.p),
+            .s = offsetof(struct sim65s, cpu.r.s),
+            .pc = offsetof(struct sim65s, cpu.r.pc),
+            .cycles = offsetof(struct sim65s, cpu.cycles),
+            .ms_write = 0xFF,
+            .ms_read = 0xFF & ~(ms_rom | ms_code),
+        };
+        s->jit = jit_new(&l, icyc);
+        return s->jit != 0;
+    }
+    if (!set && s->jit)
+    {
+        jit_flush_all(s);
+        jit_free(s->jit);
+        s->jit = 0;
+    }
+    return set ? s->jit != 0 : 1;
+#else
+    return !set;
+#endif
 }
 
 const char *sim65_get_label(const sim65 s, uint16_t addr)
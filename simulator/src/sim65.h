@@ -29,6 +29,19 @@ enum sim65_debug {
     sim65_debug_trace = 2
 };
 
+/// Format of the trace file
+enum sim65_trace_fmt {
+    sim65_trace_text = 0,
+    sim65_trace_binary = 1
+};
+
+/// Writer of the trace file
+enum sim65_trace_async {
+    sim65_trace_sync = 0,   ///< Written by the simulation thread
+    sim65_trace_block = 1,  ///< Written by a thread, waits if it falls behind
+    sim65_trace_drop = 2    ///< Written by a thread, drops records if behind
+};
+
 /// Errors returned by simulator
 enum sim65_error {
     sim65_err_none        = 0,
@@ -87,6 +100,13 @@ struct sim65_profile {
 sim65 sim65_new();
 /// Deletes simulator state, freeing all memory.
 void sim65_free(sim65 s);
+/// Creates a copy of the simulator state, to continue the simulation from
+/// the same point in many ways. The clone has the same memory map,
+/// callbacks, options and user data, and starts without decoded code.
+/// Pending device events are not copied, as their data belongs to the
+/// parent; the host must schedule them again in the clone.
+/// @returns the new state, or NULL on error.
+sim65 sim65_clone(const sim65 s);
 /// Adds an uninitialized RAM region.
 void sim65_add_ram(sim65 s, unsigned addr, unsigned len);
 /// Adds a zeroed RAM region.
@@ -99,6 +119,37 @@ void sim65_add_data_rom(sim65 s, unsigned addr, const unsigned char *data, unsig
 void sim65_set_debug(sim65 s, enum sim65_debug level);
 /// Sets tracing file, instead of stderr..
 void sim65_set_trace_file(sim65 s, FILE *f);
+/// Sets the format of the trace file. The binary format is much smaller and
+/// faster to write, it is converted to text by sim65_trace_decode.
+void sim65_set_trace_format(sim65 s, enum sim65_trace_fmt fmt);
+/// Sets the writer of the trace. With a writer thread, the simulation only
+/// stores the state of each instruction into a buffer, and the thread formats
+/// and writes it. The trace is complete when each sim65_run call returns.
+void sim65_set_trace_async(sim65 s, enum sim65_trace_async mode);
+/// Returns the number of trace records dropped by sim65_trace_drop.
+uint64_t sim65_get_trace_drops(const sim65 s);
+
+/// Conditions of the trace window. Instructions are only traced while the
+/// window is open, it opens at any of the start conditions, or at once if
+/// there are none, and closes at any of the stop conditions. The window
+/// opens again each time a start condition happens. While the window is
+/// closed the simulation runs at full speed.
+struct sim65_trace_trigger
+{
+    int start_pc;           ///< Opens when executing the address, -1 for none
+    int watch;              ///< Opens after a write to the address, -1 for none
+    uint64_t start_cycle;   ///< Opens at the cycle, 0 for none
+    uint64_t count;         ///< Closes after the instructions, 0 for no limit
+    uint64_t stop_cycle;    ///< Closes at the cycle, 0 for none
+    int stop_ret;           ///< Closes at the RTS or RTI of the routine
+                            ///< executing when the window opened
+    unsigned lo, hi;        ///< Only traces instructions from "lo" to "hi",
+                            ///< "hi" 0 for all
+};
+
+/// Sets the trace window, NULL to trace all instructions.
+/// @returns 0 on success, -1 on error.
+int sim65_set_trace_trigger(sim65 s, const struct sim65_trace_trigger *trig);
 /// Sets the error level to "level"
 void sim65_set_error_level(sim65 s, enum sim65_error_lvl level);
 /// Prints message if debug flag was given debug
@@ -127,7 +178,8 @@ enum sim65_cb_type
 {
     sim65_cb_write = 0,
     sim65_cb_read = -1,
-    sim65_cb_exec = -2
+    sim65_cb_exec = -2,
+    sim65_cb_event = -3
 };
 
 /** Callback from the simulator.
@@ -137,12 +189,20 @@ enum sim65_cb_type
  * @param data type of callback:
  *             sim65_cb_read = read memory
  *             sim65_cb_exec = execute address
+ *             sim65_cb_event = query the next change of a read value
  *             other value   = write memory, data is the value to write.
  * @returns the value (0-255) in case of read-callback, or an negative value
- *          from enum sim65_error. */
+ *          from enum sim65_error.
+ *
+ * Event callbacks must not modify the device state, they return the number
+ * of cycles from now until a read of the address could return a different
+ * value or have side effects, INT_MAX if it never changes by itself and 0 if
+ * it could have changed since the last read. Loops that only poll addresses
+ * with event callbacks are skipped up to that cycle. */
 typedef int (*sim65_callback)(sim65 s, struct sim65_reg *regs, unsigned addr, int data);
 
-/// Adds a callback at the given address of the given type
+/// Adds a callback at the given address of the given type, a NULL callback
+/// removes it.
 void sim65_add_callback(sim65 s, unsigned addr, sim65_callback cb, enum sim65_cb_type type);
 /// Adds a callback at the given address range of the given type
 void sim65_add_callback_range(sim65 s, unsigned addr, unsigned len,
@@ -157,16 +217,62 @@ void sim65_set_flags(sim65 s, uint8_t flag, uint8_t val);
  *  A value of 0 disables the limit. */
 void sim65_set_cycle_limit(sim65 s, uint64_t limit);
 
+/** Device event callback, called once when the simulation reaches the
+ * scheduled cycle: before the next instruction or before the next access to
+ * a memory callback, whichever comes first.
+ * @param s sim65 state.
+ * @param data the pointer given to @sim65_schedule_event.
+ * @returns 0 or a negative value from enum sim65_error. */
+typedef int (*sim65_event_cb)(sim65 s, void *data);
+
+/// Schedules a call to the event callback at the given cycle. There is only
+/// one pending event for each callback and data, scheduling it again moves
+/// the event to the new cycle.
+void sim65_schedule_event(sim65 s, uint64_t cycle, sim65_event_cb cb, void *data);
+
+/// Cancels the pending event of the given callback and data, if any.
+void sim65_cancel_event(sim65 s, sim65_event_cb cb, void *data);
+
+/// Sets the level of the IRQ line, the interrupt is taken before the next
+/// instruction while the line is active and the I flag is clear.
+void sim65_set_irq(sim65 s, int level);
+
+/// Sets the level of the NMI line, the interrupt is taken before the next
+/// instruction after each change from inactive to active.
+void sim65_set_nmi(sim65 s, int level);
+
 /// Reads from simulation state.
 unsigned sim65_get_byte(sim65 s, unsigned addr);
 
 /// Returns a pointer to simulated memory.
 uint8_t *sim65_get_pbyte(sim65 s, unsigned addr);
 
+/// Signals that simulated memory was modified through the pointer returned
+/// by @sim65_get_pbyte, discarding any decoded code in the range.
+void sim65_mem_changed(sim65 s, unsigned addr, unsigned len);
+
 /// Runs the simulation. Stops at BRK, a callback returning != 0 or execution errors.
 /// If regs is NULL, initializes the registers to zero.
 enum sim65_error sim65_run(sim65 s, struct sim65_reg *regs, unsigned addr);
 
+/// Runs the simulation for the given number of cycles, stopping at the first
+/// instruction boundary after the budget is used. Stops before that on the
+/// same conditions as @sim65_run.
+/// If regs is NULL, continues with the current registers, else starts with
+/// the given values, including the PC, and returns the final ones.
+/// @returns sim65_err_none if the budget was used or @sim65_stop was called.
+enum sim65_error sim65_run_cycles(sim65 s, struct sim65_reg *regs, uint64_t budget);
+
+/// Executes one instruction, or takes a pending interrupt.
+/// Registers are used as in @sim65_run_cycles.
+/// @returns the same as @sim65_run_cycles.
+enum sim65_error sim65_step(sim65 s, struct sim65_reg *regs);
+
+/// Requests the running simulation to return at the next instruction
+/// boundary. It can be called from other threads or from callbacks, if the
+/// simulation is not running the next run returns before any instruction.
+void sim65_stop(sim65 s);
+
 /// Calls the simulation.
 /// Simulates a call via a JSR to the given address, pushing a (fake) return address
 /// to the stack and returning on the matching RTS.
@@ -190,19 +296,72 @@ int sim65_lbl_load(sim65 s, const char *lblname);
 /// Adds a single label
 void sim65_lbl_add(sim65 s, uint16_t addr, const char *lbl);
 
+/// Returns the address of the label, or -1 if not found
+int sim65_lbl_find(const sim65 s, const char *lbl);
+
 /// Returns number of cycles executed
-unsigned long sim65_get_cycles(const sim65 s);
+uint64_t sim65_get_cycles(const sim65 s);
+
+/// Returns the current registers, outside of the simulation or from a
+/// callback.
+void sim65_get_regs(const sim65 s, struct sim65_reg *regs);
+
+/// Sets the registers used by the next @sim65_run_cycles or @sim65_step
+/// without registers, outside of the simulation.
+void sim65_set_regs(sim65 s, const struct sim65_reg *regs);
+
+/// Sets a pointer for the callbacks to get their context, so many
+/// simulators can share the same callback functions.
+void sim65_set_user_data(sim65 s, void *data);
+
+/// Returns the pointer given to @sim65_set_user_data, or NULL.
+void *sim65_get_user_data(const sim65 s);
+
+/// Writes a snapshot of the machine to the file: registers, cycle count,
+/// memory contents and status, and interrupt lines. The state of the devices
+/// must be saved by the host.
+/// @returns 0 on success.
+int sim65_snapshot_save(const sim65 s, FILE *f);
+
+/// Restores a snapshot written by @sim65_snapshot_save from memory, that can
+/// be a memory mapped file. The simulator must have the same memory map as
+/// the saved one. Pending device events are cancelled, the host must
+/// schedule them again after restoring the devices.
+/// @returns the size of the snapshot data, or 0 if the data is not valid.
+size_t sim65_snapshot_load(sim65 s, const void *data, size_t len);
 
 /// Activate instruction profiling.
 void sim65_set_profiling(sim65 s, int set);
 
+/// Activate translation of hot code to native code, only on x86-64 hosts.
+/// The native code is not used while tracing or profiling.
+/// @returns 1 if the translator could be set as requested.
+int sim65_set_jit(sim65 s, int set);
+
 /// Get's profiling information.
 /// @returns a sim65_profile struct with the profile data.
 struct sim65_profile sim65_get_profile_info(const sim65 s);
 
+/// Adds the profile counts of another simulator, for example a clone that
+/// executed part of the run. Does not enable profiling.
+void sim65_add_profile(sim65 s, const sim65 from);
+
+/// Prints the number of times each fused instruction sequence was executed
+/// as a single instruction, to tune the list of fused sequences.
+void sim65_print_fuse_stats(const sim65 s, FILE *f);
+
+/// Prints the number of idle loops skipped waiting for a device event, and
+/// the total cycles skipped.
+void sim65_print_idle_stats(const sim65 s, FILE *f);
+
 /// Returns name of label in given location, or null pointer if not found
 const char *sim65_get_label(const sim65 s, uint16_t addr);
 
 /// Disassembles the givenn address to the buffer, length should be > 128.
 /// @returns the same buffer passed.
 char * sim65_disassemble(const sim65 s, char *buf, uint16_t addr);
+
+/// Reads a binary trace from "in" and writes it to "out" as a text trace,
+/// using "s", a new simulator state, to print the instructions.
+/// @returns 0 on success, -1 if the trace is not valid.
+int sim65_trace_decode(sim65 s, FILE *in, FILE *out);
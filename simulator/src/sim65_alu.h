@@ -0,0 +1,83 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#pragma once
+
+// Reference implementation of the decimal mode ADC and SBC instructions.
+// The simulator uses tables generated from these functions by gen_alu.c,
+// the checked build compares each table result with these functions.
+//
+// Results are packed as the result byte in bits 0-7 and the N, V, Z and C
+// flags in bits 8-15, using the P register bit positions.
+
+#include "sim65.h"
+
+#define ALU_INDEX(carry, a, val) (((carry) << 16) | ((a) << 8) | (val))
+#define ALU_TABLE_SIZE 0x20000
+
+// ADC in decimal mode, "carry" is 0 or 1.
+static inline unsigned alu_adc_dec(unsigned a, unsigned val, unsigned carry)
+{
+    unsigned flags = 0;
+    // Z flag is computed as the binary version.
+    unsigned tmp = a + val + carry;
+    if (!(tmp & 0xFF))
+        flags |= SIM65_FLAG_Z;
+    // ADC value is computed in decimal
+    tmp = (a & 0xF) + (val & 0xF) + carry;
+    if (tmp >= 10)
+        tmp = (tmp - 10) | 16;
+    tmp += (a & 0xF0) + (val & 0xF0);
+    if (tmp & 0x80)
+        flags |= SIM65_FLAG_N;
+    if (!((a ^ val) & 0x80) && ((val ^ tmp) & 0x80))
+        flags |= SIM65_FLAG_V;
+    if (tmp > 0x9F)
+        tmp += 0x60;
+    if (tmp > 0xFF)
+        flags |= SIM65_FLAG_C;
+    return (tmp & 0xFF) | (flags << 8);
+}
+
+// SBC in decimal mode, "carry" is 0 or 1.
+static inline unsigned alu_sbc_dec(unsigned a, unsigned val, unsigned carry)
+{
+    unsigned flags = 0;
+    val = val ^ 0xFF;
+
+    // Z and V flags computed as the binary version.
+    unsigned tmp = a + val + carry;
+    if (((a ^ val) & (a ^ tmp)) & 0x80)
+        flags |= SIM65_FLAG_V;
+    if (!(tmp & 0xFF))
+        flags |= SIM65_FLAG_Z;
+
+    // ADC value is computed in decimal
+    tmp = (a & 0xF) + (val & 0xF) + carry;
+    if (tmp < 0x10)
+        tmp = (tmp - 6) & 0x0F;
+
+    tmp += (a & 0xF0) + (val & 0xF0);
+    if (tmp < 0x100)
+        tmp = (tmp - 0x60) & 0xFF;
+
+    if (tmp & 0x80)
+        flags |= SIM65_FLAG_N;
+    if (tmp > 0xFF)
+        flags |= SIM65_FLAG_C;
+    return (tmp & 0xFF) | (flags << 8);
+}
@@ -0,0 +1,67 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+// List of fused instruction sequences, executed by one handler, each one as
+// FUSE(name, text, ins1, ins2, ins3, check, code).
+//  ins1 to ins3: opcodes of the sequence, ins3 is -1 for pairs.
+//  check:        expression, true if the sequence can't raise an error or
+//                reach callbacks, "d[n].data" is the data of instruction n.
+//                If false, the instructions are executed one by one.
+//  code:         the instructions, separated by FUSE_NEXT.
+// This file is included by sim65.c with different definitions of the FUSE
+// macro, so it has no include guard.
+
+// Loop counters
+FUSE(dex_bne, "DEX/BNE", 0xca, 0xd0, -1, 1,
+     IMP_X(DEC); FUSE_NEXT; BRA_0(FLAG_Z))
+FUSE(dey_bne, "DEY/BNE", 0x88, 0xd0, -1, 1,
+     IMP_Y(DEC); FUSE_NEXT; BRA_0(FLAG_Z))
+FUSE(dex_bpl, "DEX/BPL", 0xca, 0x10, -1, 1,
+     IMP_X(DEC); FUSE_NEXT; BRA_0(FLAG_N))
+FUSE(dey_bpl, "DEY/BPL", 0x88, 0x10, -1, 1,
+     IMP_Y(DEC); FUSE_NEXT; BRA_0(FLAG_N))
+FUSE(inx_cpx_bne, "INX/CPX #/BNE", 0xe8, 0xe0, 0xd0, 1,
+     IMP_X(INC); FUSE_NEXT; IMM(CPX); FUSE_NEXT; BRA_0(FLAG_Z))
+FUSE(iny_cpy_bne, "INY/CPY #/BNE", 0xc8, 0xc0, 0xd0, 1,
+     IMP_Y(INC); FUSE_NEXT; IMM(CPY); FUSE_NEXT; BRA_0(FLAG_Z))
+
+// Compare and branch
+FUSE(cmp_bne, "CMP #/BNE", 0xc9, 0xd0, -1, 1,
+     IMM(CMP); FUSE_NEXT; BRA_0(FLAG_Z))
+FUSE(cmp_beq, "CMP #/BEQ", 0xc9, 0xf0, -1, 1,
+     IMM(CMP); FUSE_NEXT; BRA_1(FLAG_Z))
+FUSE(cmp_bcc, "CMP #/BCC", 0xc9, 0x90, -1, 1,
+     IMM(CMP); FUSE_NEXT; BRA_0(FLAG_C))
+FUSE(cmp_bcs, "CMP #/BCS", 0xc9, 0xb0, -1, 1,
+     IMM(CMP); FUSE_NEXT; BRA_1(FLAG_C))
+
+// Flag tests of RAM operands. The device status registers have callbacks,
+// so BIT polling of the UART, SPI or PS2 never fuses, those loops are
+// skipped by the idle loop detection instead.
+FUSE(bit_bpl, "BIT abs/BPL", 0x2c, 0x10, -1, plain_read(s, d[0].data),
+     BIT_ABS; FUSE_NEXT; BRA_0(FLAG_N))
+FUSE(bit_bmi, "BIT abs/BMI", 0x2c, 0x30, -1, plain_read(s, d[0].data),
+     BIT_ABS; FUSE_NEXT; BRA_1(FLAG_N))
+
+// Memory copy
+FUSE(copy_aby, "LDA abs,Y/STA abs,Y", 0xb9, 0x99, -1,
+     plain_read(s, d[0].data + c->r.y) && plain_write(s, d[1].data + c->r.y),
+     ABY_R(LDA); FUSE_NEXT; ABY_W(STA))
+FUSE(copy_idy, "LDA (zp),Y/STA (zp),Y", 0xb1, 0x91, -1,
+     plain_ind_y(s, c, d[0].data, 0) && plain_ind_y(s, c, d[1].data, 1),
+     IND_Y(LDA); FUSE_NEXT; INDW_Y(STA))
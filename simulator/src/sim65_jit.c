@@ -0,0 +1,852 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "sim65_jit.h"
+
+#ifdef SIM65_JIT
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define JIT_SIZE    (4 << 20)   // Size of the code buffer
+#define JIT_MAXCODE (64 << 10)  // Maximum size of the code of one block
+#define JIT_MAXFIX  1024        // Maximum number of jumps to side exits
+
+// Generated code register usage:
+//  RDI: pointer to the simulator state
+//  RBX: pointer to the N/Z flags table
+//  R8-R11: 6502 registers A, X, Y and P, upper bits always zero
+//  RSI: dynamic cycles, page crossing and branches taken
+//  RAX, RCX, RDX: scratch
+enum { RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11 };
+#define RA  R8
+#define RX  R9
+#define RY  R10
+#define RP  R11
+
+// x86 ALU operations, as used in the opcode and ModRM "reg" field
+enum { ALU_ADD = 0, ALU_OR, ALU_ADC, ALU_SBB, ALU_AND, ALU_SUB, ALU_XOR, ALU_CMP };
+// x86 shift operations
+enum { SH_RCL = 2, SH_RCR, SH_SHL, SH_SHR };
+// x86 condition codes
+enum { CC_O = 0, CC_NO, CC_C, CC_NC, CC_Z, CC_NZ, CC_BE, CC_A, CC_S, CC_NS };
+
+// 6502 flags
+#define FLAG_C  0x01
+#define FLAG_Z  0x02
+#define FLAG_I  0x04
+#define FLAG_D  0x08
+#define FLAG_V  0x40
+#define FLAG_N  0x80
+
+// Translated operations
+enum {
+    J_NONE = 0, J_LDA, J_LDX, J_LDY, J_STA, J_STX, J_STY, J_ORA, J_AND, J_EOR,
+    J_ADC, J_SBC, J_CMP, J_CPX, J_CPY, J_BIT, J_INC, J_DEC, J_ASL, J_LSR,
+    J_ROL, J_ROR, J_INX, J_INY, J_DEX, J_DEY, J_TAX, J_TAY, J_TXA, J_TYA,
+    J_TSX, J_TXS, J_CLF, J_SEF, J_NOP, J_PHA, J_PLA, J_PHP, J_BRA,
+    J_JMP, J_JMPI, J_JSR, J_RTS
+};
+
+// Addressing modes
+enum { M_IMP = 0, M_ACC, M_IMM, M_ZP, M_ZPX, M_ZPY, M_ABS, M_ABX, M_ABY, M_IZX, M_IZY };
+
+static const struct {
+    uint8_t op, mode;
+} jtab[256] = {
+    [0xA9] = {J_LDA, M_IMM}, [0xA5] = {J_LDA, M_ZP},  [0xB5] = {J_LDA, M_ZPX},
+    [0xAD] = {J_LDA, M_ABS}, [0xBD] = {J_LDA, M_ABX}, [0xB9] = {J_LDA, M_ABY},
+    [0xA1] = {J_LDA, M_IZX}, [0xB1] = {J_LDA, M_IZY},
+    [0xA2] = {J_LDX, M_IMM}, [0xA6] = {J_LDX, M_ZP},  [0xB6] = {J_LDX, M_ZPY},
+    [0xAE] = {J_LDX, M_ABS}, [0xBE] = {J_LDX, M_ABY},
+    [0xA0] = {J_LDY, M_IMM}, [0xA4] = {J_LDY, M_ZP},  [0xB4] = {J_LDY, M_ZPX},
+    [0xAC] = {J_LDY, M_ABS}, [0xBC] = {J_LDY, M_ABX},
+    [0x85] = {J_STA, M_ZP},  [0x95] = {J_STA, M_ZPX}, [0x8D] = {J_STA, M_ABS},
+    [0x9D] = {J_STA, M_ABX}, [0x99] = {J_STA, M_ABY}, [0x81] = {J_STA, M_IZX},
+    [0x91] = {J_STA, M_IZY},
+    [0x86] = {J_STX, M_ZP},  [0x96] = {J_STX, M_ZPY}, [0x8E] = {J_STX, M_ABS},
+    [0x84] = {J_STY, M_ZP},  [0x94] = {J_STY, M_ZPX}, [0x8C] = {J_STY, M_ABS},
+    [0x09] = {J_ORA, M_IMM}, [0x05] = {J_ORA, M_ZP},  [0x15] = {J_ORA, M_ZPX},
+    [0x0D] = {J_ORA, M_ABS}, [0x1D] = {J_ORA, M_ABX}, [0x19] = {J_ORA, M_ABY},
+    [0x01] = {J_ORA, M_IZX}, [0x11] = {J_ORA, M_IZY},
+    [0x29] = {J_AND, M_IMM}, [0x25] = {J_AND, M_ZP},  [0x35] = {J_AND, M_ZPX},
+    [0x2D] = {J_AND, M_ABS}, [0x3D] = {J_AND, M_ABX}, [0x39] = {J_AND, M_ABY},
+    [0x21] = {J_AND, M_IZX}, [0x31] = {J_AND, M_IZY},
+    [0x49] = {J_EOR, M_IMM}, [0x45] = {J_EOR, M_ZP},  [0x55] = {J_EOR, M_ZPX},
+    [0x4D] = {J_EOR, M_ABS}, [0x5D] = {J_EOR, M_ABX}, [0x59] = {J_EOR, M_ABY},
+    [0x41] = {J_EOR, M_IZX}, [0x51] = {J_EOR, M_IZY},
+    [0x69] = {J_ADC, M_IMM}, [0x65] = {J_ADC, M_ZP},  [0x75] = {J_ADC, M_ZPX},
+    [0x6D] = {J_ADC, M_ABS}, [0x7D] = {J_ADC, M_ABX}, [0x79] = {J_ADC, M_ABY},
+    [0x61] = {J_ADC, M_IZX}, [0x71] = {J_ADC, M_IZY},
+    [0xE9] = {J_SBC, M_IMM}, [0xE5] = {J_SBC, M_ZP},  [0xF5] = {J_SBC, M_ZPX},
+    [0xED] = {J_SBC, M_ABS}, [0xFD] = {J_SBC, M_ABX}, [0xF9] = {J_SBC, M_ABY},
+    [0xE1] = {J_SBC, M_IZX}, [0xF1] = {J_SBC, M_IZY},
+    [0xC9] = {J_CMP, M_IMM}, [0xC5] = {J_CMP, M_ZP},  [0xD5] = {J_CMP, M_ZPX},
+    [0xCD] = {J_CMP, M_ABS}, [0xDD] = {J_CMP, M_ABX}, [0xD9] = {J_CMP, M_ABY},
+    [0xC1] = {J_CMP, M_IZX}, [0xD1] = {J_CMP, M_IZY},
+    [0xE0] = {J_CPX, M_IMM}, [0xE4] = {J_CPX, M_ZP},  [0xEC] = {J_CPX, M_ABS},
+    [0xC0] = {J_CPY, M_IMM}, [0xC4] = {J_CPY, M_ZP},  [0xCC] = {J_CPY, M_ABS},
+    [0x24] = {J_BIT, M_ZP},  [0x2C] = {J_BIT, M_ABS},
+    [0xE6] = {J_INC, M_ZP},  [0xF6] = {J_INC, M_ZPX}, [0xEE] = {J_INC, M_ABS},
+    [0xFE] = {J_INC, M_ABX},
+    [0xC6] = {J_DEC, M_ZP},  [0xD6] = {J_DEC, M_ZPX}, [0xCE] = {J_DEC, M_ABS},
+    [0xDE] = {J_DEC, M_ABX},
+    [0x0A] = {J_ASL, M_ACC}, [0x06] = {J_ASL, M_ZP},  [0x16] = {J_ASL, M_ZPX},
+    [0x0E] = {J_ASL, M_ABS}, [0x1E] = {J_ASL, M_ABX},
+    [0x4A] = {J_LSR, M_ACC}, [0x46] = {J_LSR, M_ZP},  [0x56] = {J_LSR, M_ZPX},
+    [0x4E] = {J_LSR, M_ABS}, [0x5E] = {J_LSR, M_ABX},
+    [0x2A] = {J_ROL, M_ACC}, [0x26] = {J_ROL, M_ZP},  [0x36] = {J_ROL, M_ZPX},
+    [0x2E] = {J_ROL, M_ABS}, [0x3E] = {J_ROL, M_ABX},
+    [0x6A] = {J_ROR, M_ACC}, [0x66] = {J_ROR, M_ZP},  [0x76] = {J_ROR, M_ZPX},
+    [0x6E] = {J_ROR, M_ABS}, [0x7E] = {J_ROR, M_ABX},
+    [0xE8] = {J_INX, M_IMP}, [0xC8] = {J_INY, M_IMP}, [0xCA] = {J_DEX, M_IMP},
+    [0x88] = {J_DEY, M_IMP}, [0xAA] = {J_TAX, M_IMP}, [0xA8] = {J_TAY, M_IMP},
+    [0x8A] = {J_TXA, M_IMP}, [0x98] = {J_TYA, M_IMP}, [0xBA] = {J_TSX, M_IMP},
+    [0x9A] = {J_TXS, M_IMP}, [0xEA] = {J_NOP, M_IMP},
+    // CLI and PLP can enable a pending IRQ, the interpreter checks it
+    [0x18] = {J_CLF, M_IMP}, [0xB8] = {J_CLF, M_IMP}, [0xD8] = {J_CLF, M_IMP},
+    [0x38] = {J_SEF, M_IMP}, [0x78] = {J_SEF, M_IMP}, [0xF8] = {J_SEF, M_IMP},
+    [0x48] = {J_PHA, M_IMP}, [0x68] = {J_PLA, M_IMP}, [0x08] = {J_PHP, M_IMP},
+    [0x10] = {J_BRA, M_IMP}, [0x30] = {J_BRA, M_IMP}, [0x50] = {J_BRA, M_IMP},
+    [0x70] = {J_BRA, M_IMP}, [0x90] = {J_BRA, M_IMP}, [0xB0] = {J_BRA, M_IMP},
+    [0xD0] = {J_BRA, M_IMP}, [0xF0] = {J_BRA, M_IMP},
+    [0x4C] = {J_JMP, M_IMP}, [0x6C] = {J_JMPI, M_IMP}, [0x20] = {J_JSR, M_IMP},
+    [0x60] = {J_RTS, M_IMP},
+};
+
+// Code generation state of one block
+struct gen
+{
+    struct jit *j;
+    uint8_t *p;             // Current position
+    unsigned cur;           // Current instruction
+    uint16_t pc[257];       // Address of each instruction
+    unsigned cyc[257];      // Static cycles before each instruction
+    unsigned nfix;          // Jumps to side exits
+    struct {
+        uint8_t *rel;
+        unsigned ins;
+    } fix[JIT_MAXFIX];
+};
+
+struct jit
+{
+    uint8_t *buf;           // Code buffer, starts with the N/Z flags table
+    size_t pos;             // Used bytes of the buffer
+    struct jit_layout l;
+    const uint8_t *icyc;
+    struct gen gen;
+};
+
+static void e8(struct gen *g, unsigned v)
+{
+    *g->p++ = v;
+}
+
+static void e32(struct gen *g, uint32_t v)
+{
+    memcpy(g->p, &v, 4);
+    g->p += 4;
+}
+
+static void e64(struct gen *g, uint64_t v)
+{
+    memcpy(g->p, &v, 8);
+    g->p += 8;
+}
+
+// Emits an instruction with a register operand, always with REX prefix so
+// that the byte registers are uniform.
+static void rr(struct gen *g, int w, unsigned op, int reg, int rm)
+{
+    e8(g, 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3));
+    if (op > 0xFF)
+        e8(g, op >> 8);
+    e8(g, op & 0xFF);
+    e8(g, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// Emits an instruction with a memory operand [base + idx + disp], idx < 0
+// for no index register.
+static void rm(struct gen *g, int w, unsigned op, int reg, int base, int idx, int32_t disp)
+{
+    e8(g, 0x40 | (w << 3) | ((reg >> 3) << 2) | (idx >= 0 ? (idx >> 3) << 1 : 0) |
+              (base >> 3));
+    if (op > 0xFF)
+        e8(g, op >> 8);
+    e8(g, op & 0xFF);
+    if (idx >= 0 || (base & 7) == RSP)
+    {
+        e8(g, 0x84 | ((reg & 7) << 3));
+        e8(g, (((idx >= 0 ? idx : RSP) & 7) << 3) | (base & 7));
+    }
+    else
+        e8(g, 0x80 | ((reg & 7) << 3) | (base & 7));
+    e32(g, disp);
+}
+
+// movzx reg32, byte [state + idx + disp]
+static void load8(struct gen *g, int reg, int idx, size_t disp)
+{
+    rm(g, 0, 0x0FB6, reg, RDI, idx, disp);
+}
+
+// mov byte [state + idx + disp], reg8
+static void store8(struct gen *g, int reg, int idx, size_t disp)
+{
+    rm(g, 0, 0x88, reg, RDI, idx, disp);
+}
+
+// mov byte [state + idx + disp], imm8
+static void store8i(struct gen *g, int idx, size_t disp, uint8_t imm)
+{
+    rm(g, 0, 0xC6, 0, RDI, idx, disp);
+    e8(g, imm);
+}
+
+// ALU operation on byte registers: op dst, src
+static void alu8(struct gen *g, int op, int dst, int src)
+{
+    rr(g, 0, op << 3, src, dst);
+}
+
+// ALU operation on 32 bit registers: op dst, src
+static void alu32(struct gen *g, int op, int dst, int src)
+{
+    rr(g, 0, (op << 3) | 1, src, dst);
+}
+
+// ALU operation with a byte register and an immediate
+static void alu8i(struct gen *g, int op, int reg, unsigned imm)
+{
+    rr(g, 0, 0x80, op, reg);
+    e8(g, imm);
+}
+
+// ALU operation with a 32 bit register and an immediate
+static void alu32i(struct gen *g, int op, int reg, uint32_t imm)
+{
+    rr(g, 0, 0x81, op, reg);
+    e32(g, imm);
+}
+
+// ALU operation with a byte in the state and an immediate
+static void alu8mi(struct gen *g, int op, int idx, size_t disp, uint8_t imm)
+{
+    rm(g, 0, 0x80, op, RDI, idx, disp);
+    e8(g, imm);
+}
+
+static void mov32(struct gen *g, int dst, int src)
+{
+    rr(g, 0, 0x89, src, dst);
+}
+
+static void movzx8(struct gen *g, int dst, int src)
+{
+    rr(g, 0, 0x0FB6, dst, src);
+}
+
+static void movi(struct gen *g, int reg, uint32_t imm)
+{
+    e8(g, 0x40 | (reg >> 3));
+    e8(g, 0xB8 + (reg & 7));
+    e32(g, imm);
+}
+
+static void setcc(struct gen *g, int cc, int reg)
+{
+    rr(g, 0, 0x0F90 + cc, 0, reg);
+}
+
+static void shift8(struct gen *g, int op, int reg)
+{
+    rr(g, 0, 0xD0, op, reg);
+}
+
+static void shift32(struct gen *g, int op, int reg, uint8_t n)
+{
+    rr(g, 0, 0xC1, op, reg);
+    e8(g, n);
+}
+
+// inc/dec reg8
+static void incdec8(struct gen *g, int dec, int reg)
+{
+    rr(g, 0, 0xFE, dec, reg);
+}
+
+// Copies the 6502 carry to the host carry: bt P, 0
+static void get_carry(struct gen *g)
+{
+    rr(g, 0, 0x0FBA, 4, RP);
+    e8(g, 0);
+}
+
+// Emits a jump with a 32 bit displacement, returns the address to patch
+static uint8_t *jump(struct gen *g, int cc)
+{
+    if (cc < 0)
+        e8(g, 0xE9);
+    else
+    {
+        e8(g, 0x0F);
+        e8(g, 0x80 + cc);
+    }
+    e32(g, 0);
+    return g->p - 4;
+}
+
+static void patch(uint8_t *rel, const uint8_t *target)
+{
+    int32_t d = target - (rel + 4);
+    memcpy(rel, &d, 4);
+}
+
+// Jumps to the side exit of the current instruction if the condition is true
+static int side_exit(struct gen *g, int cc)
+{
+    if (g->nfix >= JIT_MAXFIX)
+        return 1;
+    g->fix[g->nfix].rel = jump(g, cc);
+    g->fix[g->nfix].ins = g->cur;
+    g->nfix++;
+    return 0;
+}
+
+// Exits if the memory at [idx + addr] has any of the status bits in mask
+static int guard(struct gen *g, int idx, unsigned addr, uint8_t mask)
+{
+    rm(g, 0, 0xF6, 0, RDI, idx, g->j->l.mems + addr);
+    e8(g, mask);
+    return side_exit(g, CC_NZ);
+}
+
+// Sets N and Z flags from a byte register
+static void flags_nz(struct gen *g, int reg)
+{
+    alu8i(g, ALU_AND, RP, ~(FLAG_N | FLAG_Z));
+    movzx8(g, RDX, reg);
+    rm(g, 0, (ALU_OR << 3) | 2, RP, RBX, RDX, 0);
+}
+
+// Sets C flag from the host carry copied to a byte register with setc/setnc
+static void flags_c(struct gen *g, int reg)
+{
+    alu8i(g, ALU_AND, RP, ~FLAG_C);
+    alu8(g, ALU_OR, RP, reg);
+}
+
+// Emits the computation of the effective address of the instruction, with
+// the guards for the access. Returns the index register holding the address
+// or -1 if the address is the constant "*addr".
+static int address(struct gen *g, int mode, unsigned data, uint8_t mask, int read, unsigned *addr)
+{
+    const struct jit_layout *l = &g->j->l;
+    int extra = 0;
+
+    *addr = 0;
+    switch (mode)
+    {
+        case M_ZP:
+            *addr = data & 0xFF;
+            return guard(g, -1, *addr, mask) ? -2 : -1;
+        case M_ABS:
+            *addr = data;
+            return guard(g, -1, *addr, mask) ? -2 : -1;
+        case M_ZPX:
+        case M_ZPY:
+            mov32(g, RCX, mode == M_ZPX ? RX : RY);
+            alu32i(g, ALU_ADD, RCX, data & 0xFF);
+            alu32i(g, ALU_AND, RCX, 0xFF);
+            break;
+        case M_ABX:
+        case M_ABY:
+            mov32(g, RCX, mode == M_ABX ? RX : RY);
+            alu32i(g, ALU_ADD, RCX, data);
+            alu32i(g, ALU_AND, RCX, 0xFFFF);
+            // Extra cycle if crossing page
+            if (read && (data & 0xFF))
+            {
+                alu32(g, ALU_XOR, RDX, RDX);
+                alu8i(g, ALU_CMP, mode == M_ABX ? RX : RY, 0xFF - (data & 0xFF));
+                setcc(g, CC_A, RDX);
+                extra = 1;
+            }
+            break;
+        case M_IZX:
+            mov32(g, RDX, RX);
+            alu32i(g, ALU_ADD, RDX, data & 0xFF);
+            alu32i(g, ALU_AND, RDX, 0xFF);
+            if (guard(g, RDX, 0, l->ms_read) || guard(g, RDX, 1, l->ms_read))
+                return -2;
+            load8(g, RCX, RDX, l->mem);
+            load8(g, RAX, RDX, l->mem + 1);
+            shift32(g, SH_SHL, RAX, 8);
+            alu32(g, ALU_OR, RCX, RAX);
+            break;
+        case M_IZY:
+            data &= 0xFF;
+            if (guard(g, -1, data, l->ms_read) || guard(g, -1, data + 1, l->ms_read))
+                return -2;
+            load8(g, RCX, -1, l->mem + data);
+            load8(g, RAX, -1, l->mem + data + 1);
+            shift32(g, SH_SHL, RAX, 8);
+            alu32(g, ALU_OR, RCX, RAX);
+            // Extra cycle if crossing page
+            if (read)
+            {
+                movzx8(g, RDX, RCX);
+                alu32(g, ALU_ADD, RDX, RY);
+                shift32(g, SH_SHR, RDX, 8);
+                extra = 1;
+            }
+            alu32(g, ALU_ADD, RCX, RY);
+            alu32i(g, ALU_AND, RCX, 0xFFFF);
+            break;
+    }
+    if (guard(g, RCX, 0, mask))
+        return -2;
+    // Add extra cycles after the last guard, the side exit must not see them
+    if (extra)
+        alu32(g, ALU_ADD, RSI, RDX);
+    return RCX;
+}
+
+// Emits code to read the operand of the instruction into AL
+static int operand(struct gen *g, int mode, unsigned data)
+{
+    const struct jit_layout *l = &g->j->l;
+    unsigned addr;
+    int idx;
+
+    if (mode == M_IMM)
+    {
+        movi(g, RAX, data & 0xFF);
+        return 0;
+    }
+    idx = address(g, mode, data, l->ms_read, 1, &addr);
+    if (idx < -1)
+        return 1;
+    load8(g, RAX, idx, l->mem + addr);
+    return 0;
+}
+
+// Emits a push of the byte register to the stack
+static int push(struct gen *g, int reg)
+{
+    const struct jit_layout *l = &g->j->l;
+    load8(g, RCX, -1, l->s);
+    if (guard(g, RCX, 0x100, l->ms_write))
+        return 1;
+    store8(g, reg, RCX, l->mem + 0x100);
+    alu8mi(g, ALU_SUB, -1, l->s, 1);
+    return 0;
+}
+
+// Emits a pop from the stack into AL
+static int pop(struct gen *g)
+{
+    const struct jit_layout *l = &g->j->l;
+    load8(g, RCX, -1, l->s);
+    alu32i(g, ALU_ADD, RCX, 1);
+    alu32i(g, ALU_AND, RCX, 0xFF);
+    if (guard(g, RCX, 0x100, l->ms_read))
+        return 1;
+    load8(g, RAX, RCX, l->mem + 0x100);
+    store8(g, RCX, -1, l->s);
+    return 0;
+}
+
+// Emits the jump to the exit code, with the new PC in EDX
+static uint8_t *block_exit(struct gen *g, unsigned cycles)
+{
+    if (cycles)
+        alu32i(g, ALU_ADD, RSI, cycles);
+    return jump(g, -1);
+}
+
+// Translates one instruction, returns 1 if not possible.
+static int translate(struct gen *g, const struct jit_ins *in, uint8_t **end, int *nend)
+{
+    const struct jit_layout *l = &g->j->l;
+    unsigned op = jtab[in->ins].op, mode = jtab[in->ins].mode, data = in->data;
+    unsigned pc = g->pc[g->cur], next = (pc + in->len) & 0xFFFF, cycles, addr;
+    int idx, reg;
+
+    // Static cycles up to the end of this instruction
+    cycles = g->cyc[g->cur] + g->j->icyc[in->ins];
+
+    switch (op)
+    {
+        case J_NONE:
+            return 1;
+        case J_LDA:
+        case J_LDX:
+        case J_LDY:
+            reg = op == J_LDA ? RA : op == J_LDX ? RX : RY;
+            if (operand(g, mode, data))
+                return 1;
+            movzx8(g, reg, RAX);
+            flags_nz(g, reg);
+            break;
+        case J_STA:
+        case J_STX:
+        case J_STY:
+            reg = op == J_STA ? RA : op == J_STX ? RX : RY;
+            idx = address(g, mode, data, l->ms_write, 0, &addr);
+            if (idx < -1)
+                return 1;
+            store8(g, reg, idx, l->mem + addr);
+            break;
+        case J_ORA:
+        case J_AND:
+        case J_EOR:
+            if (operand(g, mode, data))
+                return 1;
+            alu8(g, op == J_ORA ? ALU_OR : op == J_AND ? ALU_AND : ALU_XOR, RA, RAX);
+            flags_nz(g, RA);
+            break;
+        case J_ADC:
+        case J_SBC:
+            // Decimal mode is left to the interpreter
+            rr(g, 0, 0xF6, 0, RP);
+            e8(g, FLAG_D);
+            if (side_exit(g, CC_NZ) || operand(g, mode, data))
+                return 1;
+            get_carry(g);
+            if (op == J_ADC)
+            {
+                alu8(g, ALU_ADC, RA, RAX);
+                setcc(g, CC_C, RCX);
+            }
+            else
+            {
+                e8(g, 0xF5); // cmc
+                alu8(g, ALU_SBB, RA, RAX);
+                setcc(g, CC_NC, RCX);
+            }
+            setcc(g, CC_O, RDX);
+            flags_c(g, RCX);
+            alu8i(g, ALU_AND, RP, ~FLAG_V);
+            shift32(g, SH_SHL, RDX, 6);
+            alu8(g, ALU_OR, RP, RDX);
+            flags_nz(g, RA);
+            break;
+        case J_CMP:
+        case J_CPX:
+        case J_CPY:
+            if (operand(g, mode, data))
+                return 1;
+            mov32(g, RDX, op == J_CMP ? RA : op == J_CPX ? RX : RY);
+            alu8(g, ALU_SUB, RDX, RAX);
+            setcc(g, CC_NC, RCX);
+            flags_c(g, RCX);
+            flags_nz(g, RDX);
+            break;
+        case J_BIT:
+            if (operand(g, mode, data))
+                return 1;
+            alu8i(g, ALU_AND, RP, ~(FLAG_N | FLAG_V | FLAG_Z));
+            mov32(g, RDX, RAX);
+            alu32i(g, ALU_AND, RDX, FLAG_N | FLAG_V);
+            alu8(g, ALU_OR, RP, RDX);
+            rr(g, 0, 0x84, RA, RAX); // test al, A
+            setcc(g, CC_Z, RDX);
+            alu8(g, ALU_ADD, RDX, RDX);
+            alu8(g, ALU_OR, RP, RDX);
+            break;
+        case J_INC:
+        case J_DEC:
+        case J_ASL:
+        case J_LSR:
+        case J_ROL:
+        case J_ROR:
+            if (mode == M_ACC)
+            {
+                reg = RA;
+                idx = -1;
+            }
+            else
+            {
+                reg = RAX;
+                idx = address(g, mode, data, l->ms_write, 0, &addr);
+                if (idx < -1)
+                    return 1;
+                load8(g, RAX, idx, l->mem + addr);
+            }
+            // The address is in RCX, so use RDX for the carry
+            if (op == J_INC || op == J_DEC)
+                incdec8(g, op == J_DEC, reg);
+            else
+            {
+                if (op == J_ROL || op == J_ROR)
+                    get_carry(g);
+                shift8(g, op == J_ASL ? SH_SHL : op == J_LSR ? SH_SHR :
+                          op == J_ROL ? SH_RCL : SH_RCR, reg);
+                setcc(g, CC_C, RDX);
+                flags_c(g, RDX);
+            }
+            if (mode != M_ACC)
+                store8(g, RAX, idx, l->mem + addr);
+            flags_nz(g, reg);
+            break;
+        case J_INX:
+        case J_INY:
+        case J_DEX:
+        case J_DEY:
+            reg = (op == J_INX || op == J_DEX) ? RX : RY;
+            incdec8(g, op == J_DEX || op == J_DEY, reg);
+            flags_nz(g, reg);
+            break;
+        case J_TAX:
+        case J_TAY:
+            reg = op == J_TAX ? RX : RY;
+            movzx8(g, reg, RA);
+            flags_nz(g, reg);
+            break;
+        case J_TXA:
+        case J_TYA:
+            movzx8(g, RA, op == J_TXA ? RX : RY);
+            flags_nz(g, RA);
+            break;
+        case J_TSX:
+            load8(g, RX, -1, l->s);
+            flags_nz(g, RX);
+            break;
+        case J_TXS:
+            store8(g, RX, -1, l->s);
+            break;
+        case J_CLF:
+        case J_SEF:
+        {
+            uint8_t f = (in->ins & 0xC0) == 0x00 ? FLAG_C : (in->ins & 0xC0) == 0x40 ? FLAG_I :
+                        (in->ins & 0xC0) == 0x80 ? FLAG_V : FLAG_D;
+            if (op == J_CLF)
+                alu8i(g, ALU_AND, RP, ~f);
+            else
+                alu8i(g, ALU_OR, RP, f);
+            break;
+        }
+        case J_NOP:
+            break;
+        case J_PHA:
+        case J_PHP:
+            if (push(g, op == J_PHA ? RA : RP))
+                return 1;
+            break;
+        case J_PLA:
+            if (pop(g))
+                return 1;
+            movzx8(g, RA, RAX);
+            flags_nz(g, RA);
+            break;
+        case J_BRA:
+        {
+            static const uint8_t flag[4] = { FLAG_N, FLAG_V, FLAG_C, FLAG_Z };
+            unsigned target = (next + (int8_t)data) & 0xFFFF;
+            uint8_t *taken;
+            rr(g, 0, 0xF6, 0, RP);
+            e8(g, flag[in->ins >> 6]);
+            taken = jump(g, (in->ins & 0x20) ? CC_NZ : CC_Z);
+            movi(g, RDX, next);
+            end[(*nend)++] = block_exit(g, cycles);
+            patch(taken, g->p);
+            movi(g, RDX, target);
+            end[(*nend)++] = block_exit(g, cycles + 1 + ((target ^ next) > 0xFF));
+            return 0;
+        }
+        case J_JMP:
+            movi(g, RDX, data);
+            end[(*nend)++] = block_exit(g, cycles);
+            return 0;
+        case J_JMPI:
+            if (guard(g, -1, data, l->ms_read) || guard(g, -1, (data + 1) & 0xFFFF, l->ms_read))
+                return 1;
+            load8(g, RDX, -1, l->mem + data);
+            load8(g, RAX, -1, l->mem + ((data + 1) & 0xFFFF));
+            shift32(g, SH_SHL, RAX, 8);
+            alu32(g, ALU_OR, RDX, RAX);
+            end[(*nend)++] = block_exit(g, cycles);
+            return 0;
+        case J_JSR:
+            load8(g, RCX, -1, l->s);
+            mov32(g, RDX, RCX);
+            alu32i(g, ALU_SUB, RDX, 1);
+            alu32i(g, ALU_AND, RDX, 0xFF);
+            if (guard(g, RCX, 0x100, l->ms_write) || guard(g, RDX, 0x100, l->ms_write))
+                return 1;
+            store8i(g, RCX, l->mem + 0x100, (pc + 2) >> 8);
+            store8i(g, RDX, l->mem + 0x100, (pc + 2) & 0xFF);
+            alu8mi(g, ALU_SUB, -1, l->s, 2);
+            movi(g, RDX, data);
+            end[(*nend)++] = block_exit(g, cycles);
+            return 0;
+        case J_RTS:
+            load8(g, RCX, -1, l->s);
+            alu32i(g, ALU_ADD, RCX, 1);
+            alu32i(g, ALU_AND, RCX, 0xFF);
+            mov32(g, RDX, RCX);
+            alu32i(g, ALU_ADD, RDX, 1);
+            alu32i(g, ALU_AND, RDX, 0xFF);
+            if (guard(g, RCX, 0x100, l->ms_read) || guard(g, RDX, 0x100, l->ms_read))
+                return 1;
+            store8(g, RDX, -1, l->s);
+            load8(g, RAX, RDX, l->mem + 0x100);
+            load8(g, RDX, RCX, l->mem + 0x100);
+            shift32(g, SH_SHL, RAX, 8);
+            alu32(g, ALU_OR, RDX, RAX);
+            alu32i(g, ALU_ADD, RDX, 1);
+            alu32i(g, ALU_AND, RDX, 0xFFFF);
+            end[(*nend)++] = block_exit(g, cycles);
+            return 0;
+    }
+    return 0;
+}
+
+struct jit *jit_new(const struct jit_layout *l, const uint8_t *icyc)
+{
+    struct jit *j = calloc(1, sizeof(struct jit));
+    unsigned i;
+    if (!j)
+        return 0;
+    j->buf = mmap(0, JIT_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j->buf == MAP_FAILED)
+    {
+        free(j);
+        return 0;
+    }
+    j->l = *l;
+    j->icyc = icyc;
+    // N and Z flags of each value
+    for (i = 0; i < 256; i++)
+        j->buf[i] = (i & FLAG_N) | (i ? 0 : FLAG_Z);
+    jit_flush(j);
+    return j;
+}
+
+void jit_free(struct jit *j)
+{
+    if (!j)
+        return;
+    munmap(j->buf, JIT_SIZE);
+    free(j);
+}
+
+int jit_full(const struct jit *j)
+{
+    return j->pos + JIT_MAXCODE > JIT_SIZE;
+}
+
+void jit_flush(struct jit *j)
+{
+    j->pos = 256;
+}
+
+jit_code jit_compile(struct jit *j, uint16_t pc, const struct jit_ins *ins, unsigned count)
+{
+    struct gen *g = &j->gen;
+    const struct jit_layout *l = &j->l;
+    uint8_t *start, *common, *end[256 * 2];
+    int nend = 0;
+    unsigned i;
+
+    if (jit_full(j) || !count || count > 256)
+        return 0;
+
+    g->j = j;
+    g->nfix = 0;
+    g->p = start = j->buf + ((j->pos + 15) & ~(size_t)15);
+
+    // Prologue: load registers
+    e8(g, 0x53); // push rbx
+    e8(g, 0x48); // mov rbx, imm64
+    e8(g, 0xBB);
+    e64(g, (uintptr_t)j->buf);
+    load8(g, RA, -1, l->a);
+    load8(g, RX, -1, l->x);
+    load8(g, RY, -1, l->y);
+    load8(g, RP, -1, l->p);
+    alu32(g, ALU_XOR, RSI, RSI);
+
+    g->pc[0] = pc;
+    g->cyc[0] = 0;
+    for (i = 0; i < count; i++)
+    {
+        uint8_t *p = g->p;
+        unsigned nfix = g->nfix;
+        int n = nend;
+        g->cur = i;
+        if (translate(g, &ins[i], end, &nend))
+        {
+            // Discard partial code
+            g->p = p;
+            g->nfix = nfix;
+            nend = n;
+            break;
+        }
+        g->pc[i + 1] = g->pc[i] + ins[i].len;
+        g->cyc[i + 1] = g->cyc[i] + j->icyc[ins[i].ins];
+        if (nend != n)
+        {
+            i++;
+            break;
+        }
+    }
+    if (!i)
+        return 0;
+
+    // Fall through: continue in the interpreter after the last instruction
+    if (!nend)
+    {
+        movi(g, RDX, g->pc[i]);
+        end[nend++] = block_exit(g, g->cyc[i]);
+    }
+
+    // Common exit, stores registers, PC in EDX and cycles
+    common = g->p;
+    store8(g, RA, -1, l->a);
+    store8(g, RX, -1, l->x);
+    store8(g, RY, -1, l->y);
+    store8(g, RP, -1, l->p);
+    e8(g, 0x66); // mov word [pc], dx
+    rm(g, 0, 0x89, RDX, RDI, -1, l->pc);
+    rm(g, 1, 0x01, RSI, RDI, -1, l->cycles); // add [cycles], rsi
+    e8(g, 0x5B); // pop rbx
+    e8(g, 0xC3); // ret
+    while (nend)
+        patch(end[--nend], common);
+
+    // Side exits, before the instruction
+    for (i = 0; i < g->nfix; i++)
+    {
+        unsigned k, n = g->fix[i].ins;
+        uint8_t *p = g->p;
+        movi(g, RDX, g->pc[n]);
+        for (k = i; k < g->nfix && g->fix[k].ins == n; k++)
+            patch(g->fix[k].rel, p);
+        i = k - 1;
+        patch(block_exit(g, g->cyc[n]), common);
+    }
+
+    j->pos = g->p - j->buf;
+    return (jit_code)start;
+}
+
+#endif // SIM65_JIT
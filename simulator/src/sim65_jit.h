@@ -0,0 +1,72 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#pragma once
+
+// Translator of decoded 6502 blocks to native x86-64 code, internal to
+// the sim65 core.
+//
+// The generated code executes the instructions directly on the simulator
+// state and only handles the common case: plain RAM/ROM accesses in binary
+// mode. On anything else (callbacks, uninitialized or undefined memory,
+// writes to decoded code, decimal mode) it stops *before* the instruction,
+// leaving the state exact so the interpreter can continue.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) && !defined(SIM65_NO_JIT)
+#define SIM65_JIT
+#endif
+
+/// Offsets of the simulator state fields used by the generated code.
+struct jit_layout
+{
+    size_t mem, mems;           // Memory and memory status arrays
+    size_t a, x, y, p, s, pc;   // Registers
+    size_t cycles;              // Cycle count, 64 bit
+    uint8_t ms_write;           // Status bits that block a write
+    uint8_t ms_read;            // Status bits that block a read
+};
+
+/// Instruction to translate.
+struct jit_ins
+{
+    uint8_t ins;
+    uint8_t len;
+    uint16_t data;
+};
+
+/// Translated code, called with the simulator state.
+typedef void (*jit_code)(void *state);
+
+struct jit;
+
+/// Creates a new translator, with the given state layout and table of
+/// instruction cycles. Returns NULL if executable memory is not available.
+struct jit *jit_new(const struct jit_layout *l, const uint8_t *icyc);
+/// Frees the translator and all the generated code.
+void jit_free(struct jit *j);
+/// Returns true if the code buffer is almost full, the caller must then
+/// forget all translated code and call jit_flush.
+int jit_full(const struct jit *j);
+/// Discards all the generated code.
+void jit_flush(struct jit *j);
+/// Translates "count" instructions starting at address "pc". Stops at the
+/// first instruction that can't be translated, returns NULL if the first
+/// one can't be translated.
+jit_code jit_compile(struct jit *j, uint16_t pc, const struct jit_ins *ins, unsigned count);
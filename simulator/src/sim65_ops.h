@@ -0,0 +1,172 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+// List of implemented opcodes, each one as OP(opcode, code).
+// This file is included by sim65.c with different definitions of the OP
+// macro to generate the instruction dispatch, so it has no include guard.
+OP(0x00, set_error(s, sim65_err_break, c->r.pc - 1))
+OP(0x01, IND_X(ORA))
+OP(0x05, ZP_R(ORA))
+OP(0x06, ZP_RW(ASL))
+OP(0x08, PUSH(get_flags(s, c, 0xFF)))       // PHP
+OP(0x09, IMM(ORA))
+OP(0x0A, IMP_A(ASL))
+OP(0x0D, ABS_R(ORA))
+OP(0x0E, ABS_RW(ASL))
+OP(0x10, BRA_0(FLAG_N))                 // BPL
+OP(0x11, IND_Y(ORA))
+OP(0x15, ZPX_R(ORA))
+OP(0x16, ZPX_RW(ASL))
+OP(0x18, CL_F(FLAG_C))                  // CLC
+OP(0x19, ABY_R(ORA))
+OP(0x1d, ABX_R(ORA))
+OP(0x1e, ABX_RW(ASL))
+OP(0x20, JSR())                         // JSR
+OP(0x21, IND_X(AND))
+OP(0x24, BIT_ZP)
+OP(0x25, ZP_R(AND))
+OP(0x26, ZP_RW(ROL))
+OP(0x28, POP_P; IRQ_CHECK)             // PLP
+OP(0x29, IMM(AND))
+OP(0x2a, IMP_A(ROL))
+OP(0x2c, BIT_ABS)
+OP(0x2d, ABS_R(AND))
+OP(0x2e, ABS_RW(ROL))
+OP(0x30, BRA_1(FLAG_N))
+OP(0x31, IND_Y(AND))
+OP(0x35, ZPX_R(AND))
+OP(0x36, ZPX_RW(ROL))
+OP(0x38, SE_F(FLAG_C))                  // SEC
+OP(0x39, ABY_R(AND))
+OP(0x3d, ABX_R(AND))
+OP(0x3e, ABX_RW(ROL))
+OP(0x40, RTI(); IRQ_CHECK)             // RTI
+OP(0x41, IND_X(EOR))
+OP(0x45, ZP_R(EOR))
+OP(0x46, ZP_RW(LSR))
+OP(0x48, PUSH(c->r.a))                  // PHA
+OP(0x49, IMM(EOR))
+OP(0x4a, IMP_A(LSR))
+OP(0x4c, JMP())                         // JMP
+OP(0x4d, ABS_R(EOR))
+OP(0x4e, ABS_RW(LSR))
+OP(0x50, BRA_0(FLAG_V))
+OP(0x51, IND_Y(EOR))
+OP(0x55, ZPX_R(EOR))
+OP(0x56, ZPX_RW(LSR))
+OP(0x58, CL_F(FLAG_I); IRQ_CHECK)      // CLI
+OP(0x59, ABY_R(EOR))
+OP(0x5d, ABX_R(EOR))
+OP(0x5e, ABX_RW(LSR))
+OP(0x60, RTS())                         // RTS
+OP(0x61, IND_X(ADC))
+OP(0x65, ZP_R(ADC))
+OP(0x66, ZP_RW(ROR))
+OP(0x68, POP_A)                         // PLA
+OP(0x69, IMM(ADC))
+OP(0x6a, IMP_A(ROR))
+OP(0x6c, JMP16())                       // JMP ()
+OP(0x6d, ABS_R(ADC))
+OP(0x6e, ABS_RW(ROR))
+OP(0x70, BRA_1(FLAG_V))
+OP(0x71, IND_Y(ADC))
+OP(0x75, ZPX_R(ADC))
+OP(0x76, ZPX_RW(ROR))
+OP(0x78, SE_F(FLAG_I))                  // SEI
+OP(0x79, ABY_R(ADC))
+OP(0x7d, ABX_R(ADC))
+OP(0x7e, ABX_RW(ROR))
+OP(0x81, INDW_X(STA))
+OP(0x84, ZP_W(STY))
+OP(0x85, ZP_W(STA))
+OP(0x86, ZP_W(STX))
+OP(0x88, IMP_Y(DEC))                    // DEY
+OP(0x8a, IMP_X(LDA))                    // TXA
+OP(0x8c, ABS_W(STY))
+OP(0x8d, ABS_W(STA))
+OP(0x8e, ABS_W(STX))
+OP(0x90, BRA_0(FLAG_C))                 // BCC
+OP(0x91, INDW_Y(STA))
+OP(0x94, ZPX_W(STY))
+OP(0x95, ZPX_W(STA))
+OP(0x96, ZPY_W(STX))
+OP(0x98, IMP_Y(LDA))                    // TYA
+OP(0x99, ABY_W(STA))
+OP(0x9a, TXS())                         // TXS
+OP(0x9d, ABX_W(STA))
+OP(0xa0, IMM(LDY))
+OP(0xa1, IND_X(LDA))
+OP(0xa2, IMM(LDX))
+OP(0xa4, ZP_R(LDY))
+OP(0xa5, ZP_R(LDA))
+OP(0xa6, ZP_R(LDX))
+OP(0xa8, IMP_A(LDY))                    // TAY
+OP(0xa9, IMM(LDA))
+OP(0xaa, IMP_A(LDX))                    // TAX
+OP(0xac, ABS_R(LDY))
+OP(0xad, ABS_R(LDA))
+OP(0xae, ABS_R(LDX))
+OP(0xb0, BRA_1(FLAG_C))                 // BCS
+OP(0xb1, IND_Y(LDA))
+OP(0xb4, ZPX_R(LDY))
+OP(0xb5, ZPX_R(LDA))
+OP(0xb6, ZPY_R(LDX))
+OP(0xb8, CL_F(FLAG_V))                  // CLV
+OP(0xb9, ABY_R(LDA))
+OP(0xba, IMP_X(val = c->r.s))           // TSX
+OP(0xbc, ABX_R(LDY))
+OP(0xbd, ABX_R(LDA))
+OP(0xbe, ABY_R(LDX))
+OP(0xc0, IMM(CPY))
+OP(0xc1, IND_X(CMP))
+OP(0xc4, ZP_R(CPY))
+OP(0xc5, ZP_R(CMP))
+OP(0xc6, ZP_RW(DEC))
+OP(0xc8, IMP_Y(INC))                    // INY
+OP(0xc9, IMM(CMP))
+OP(0xca, IMP_X(DEC))                    // DEX
+OP(0xcc, ABS_R(CPY))
+OP(0xcd, ABS_R(CMP))
+OP(0xce, ABS_RW(DEC))
+OP(0xd0, BRA_0(FLAG_Z))                 // BNE
+OP(0xd1, IND_Y(CMP))
+OP(0xd5, ZPX_R(CMP))
+OP(0xd6, ZPX_RW(DEC))
+OP(0xd8, CL_F(FLAG_D))                  // CLD
+OP(0xd9, ABY_R(CMP))
+OP(0xdd, ABX_R(CMP))
+OP(0xde, ABX_RW(DEC))
+OP(0xe0, IMM(CPX))
+OP(0xe1, IND_X(SBC))
+OP(0xe4, ZP_R(CPX))
+OP(0xe5, ZP_R(SBC))
+OP(0xe6, ZP_RW(INC))
+OP(0xe8, IMP_X(INC))                    // INX
+OP(0xe9, IMM(SBC))
+OP(0xea, c->cycles += 2)                // NOP
+OP(0xec, ABS_R(CPX))
+OP(0xed, ABS_R(SBC))
+OP(0xee, ABS_RW(INC))
+OP(0xf0, BRA_1(FLAG_Z))                 // BEQ
+OP(0xf1, IND_Y(SBC))
+OP(0xf5, ZPX_R(SBC))
+OP(0xf6, ZPX_RW(INC))
+OP(0xf8, SE_F(FLAG_D))                  // SED
+OP(0xf9, ABY_R(SBC))
+OP(0xfd, ABX_R(SBC))
+OP(0xfe, ABX_RW(INC))
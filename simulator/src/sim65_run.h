@@ -0,0 +1,286 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+// Simulation loop of the 6502 core, this file is included by sim65.c once
+// for each run mode with these macros defined:
+//  RUN_NAME:  name of the run function.
+//  RUN_MODE:  the run mode, the function returns if it changes.
+//  RUN_PROF:  expression, true if profiling.
+//  RUN_LIMIT: true if the cycle limit or device events must be checked.
+//  RUN_TRACE: true if each instruction must be traced.
+// Constant conditions are removed by the compiler, so each function only
+// includes the needed instrumentation.
+//
+// The CPU state is kept in the local variable "cpu" while executing the
+// instructions, so the compiler can hold the registers in host registers.
+// It is only stored back to "s->cpu" before calling functions that use it:
+// callbacks, the block decoder, the native code and on exit.
+
+#define RUN_CAT2(a, b) a##b
+#define RUN_CAT(a, b) RUN_CAT2(a, b)
+#define RUN_NEXT RUN_CAT(RUN_NAME, _next_block)
+#define RUN_FIND RUN_CAT(RUN_NAME, _find_block)
+
+// Returns the decoded block at the current PC if it can be executed without
+// leaving the simulation loop, or NULL if RUN_NEXT must be called.
+static CPU_INLINE const struct dins *RUN_FIND(sim65 s, const struct cpu *c,
+                                               unsigned *count)
+{
+    struct dblock **page, *b;
+    // Trace needs to process each instruction
+    if (RUN_TRACE || s->stop || s->run_mode != RUN_MODE)
+        return 0;
+#ifdef SIM65_JIT
+    // Native code needs the state in memory
+    if (!RUN_PROF && s->jit)
+        return 0;
+#endif
+    page = s->blocks[c->r.pc >> 8];
+    b = page ? page[c->r.pc & 0xFF] : 0;
+    // Idle loops are checked in RUN_NEXT
+    if (!b || (!RUN_PROF && b->idle) ||
+        (RUN_LIMIT && c->cycles + b->cycles >= s->cycle_stop))
+        return 0;
+    *count = b->count;
+    return b->ins;
+}
+
+// Returns the decoded instructions to execute at the current PC, using a
+// decoded block if possible or decoding one instruction in "tmp" if not.
+// Hot blocks are executed here as native code, if the translator is active.
+// Returns NULL if the simulation should stop or the run mode changed.
+static const struct dins *RUN_NEXT(sim65 s, struct dins *tmp, unsigned *count)
+{
+    for (;;)
+    {
+        if (unlikely(s->stop & stop_code))
+            code_gc(s);
+        if (unlikely(s->stop & stop_host))
+            return 0;
+        if (unlikely(s->stop & stop_irq))
+        {
+            do_interrupt(s);
+            if (get_error_exit(s))
+                return 0;
+        }
+        if (unlikely(s->stop & stop_mode))
+            s->stop &= ~stop_mode;
+        if (unlikely(s->run_mode != RUN_MODE))
+            return 0;
+
+        // Trace needs to process each instruction
+        if (!RUN_TRACE)
+        {
+            struct dblock **page = s->blocks[s->cpu.r.pc >> 8];
+            struct dblock *b = page ? page[s->cpu.r.pc & 0xFF] : 0;
+            if (!b && !exec_callback(s, s->cpu.r.pc))
+                b = decode_block(s, s->cpu.r.pc);
+            // Use the block if it could not reach the cycle limit
+            if (b && (!RUN_LIMIT || s->cpu.cycles + b->cycles < s->cycle_stop))
+            {
+                // Profiling needs each iteration of idle loops
+                if (!RUN_PROF && b->idle && idle_skip(s, b))
+                    continue;
+#ifdef SIM65_JIT
+                // Profiling needs each instruction
+                if (!RUN_PROF && s->jit && run_native(s, b))
+                    continue;
+#endif
+                *count = b->count;
+                return b->ins;
+            }
+        }
+        break;
+    }
+
+    if (unlikely(exec_callback(s, s->cpu.r.pc) || RUN_TRACE ||
+                 (RUN_LIMIT && s->cpu.cycles >= s->cycle_stop)) && ins_hooks(s))
+        return 0;
+
+    // Read instruction and data
+    tmp->ins = readPc(s, 0);
+    tmp->op = tmp->ins;
+    tmp->len = ilen[tmp->ins];
+    tmp->data = 0;
+    if (tmp->len > 1)
+        tmp->data = readPc(s, 1);
+    if (tmp->len > 2)
+        tmp->data |= readPc(s, 2) << 8;
+    *count = 1;
+    return tmp;
+}
+
+#ifndef SIM65_THREADED
+
+// Reference implementation, using a switch to dispatch each instruction.
+static void RUN_NAME(sim65 s)
+{
+    struct cpu cpu = s->cpu, *c = &cpu;
+    const struct dins *d;
+    struct dins tmp;
+    unsigned count, data, val, op, old_pc = 0, old_cycles = 0;
+
+    for (;;)
+    {
+        d = RUN_FIND(s, c, &count);
+        if (!d)
+        {
+            s->cpu = cpu;
+            d = RUN_NEXT(s, &tmp, &count);
+            if (!d)
+                return;
+            cpu = s->cpu;
+        }
+        for (;;)
+        {
+            FETCH_INS;
+            op = d->op;
+        dispatch:
+            switch (op)
+            {
+#define OP(n, code) case n: code; break;
+#include "sim65_ops.h"
+#undef OP
+                // Fused sequences execute the first instruction alone if the
+                // check fails
+#define FUSE(name, text, i1, i2, i3, check, code)                             \
+                case 256 + fuse_##name:                                       \
+                    if (RUN_PROF || !(check))                                 \
+                    {                                                         \
+                        op = d->ins;                                          \
+                        goto dispatch;                                        \
+                    }                                                         \
+                    s->fuse_count[fuse_##name]++;                             \
+                    code;                                                     \
+                    break;
+#include "sim65_fuse.h"
+#undef FUSE
+                default:    set_error(s, sim65_err_invalid_ins, c->r.pc - 1);
+            }
+            PROF_INS;
+            if (unlikely(s->stop))
+            {
+                s->cpu = cpu;
+                if (get_error_exit(s))
+                    return;
+                // Decoded code was invalidated
+                if (s->stop)
+                    break;
+            }
+            if (!--count)
+                break;
+            d++;
+        }
+    }
+}
+
+#else // SIM65_THREADED
+
+// Threaded code implementation, each instruction jumps directly to the next
+// one using the GCC "labels as values" extension.
+static void RUN_NAME(sim65 s)
+{
+    static const void *const optab[256 + fuse_num] = {
+        [0 ... 255] = &&op_invalid,
+#define OP(n, code) [n] = &&op_##n,
+#include "sim65_ops.h"
+#undef OP
+#define FUSE(name, text, i1, i2, i3, check, code) [256 + fuse_##name] = &&fuse_##name,
+#include "sim65_fuse.h"
+#undef FUSE
+    };
+    struct cpu cpu = s->cpu, *c = &cpu;
+    const struct dins *d = 0;
+    struct dins tmp;
+    unsigned count, data, val, old_pc = 0, old_cycles = 0;
+
+#define DISPATCH                                                              \
+    do                                                                        \
+    {                                                                         \
+        FETCH_INS;                                                            \
+        goto *optab[d->op];                                                   \
+    } while (0)
+
+    // Continue with next instruction in the block, or get a new block
+#define NEXT_INS                                                              \
+    do                                                                        \
+    {                                                                         \
+        PROF_INS;                                                             \
+        if (likely(--count && !s->stop))                                      \
+        {                                                                     \
+            d++;                                                              \
+            DISPATCH;                                                         \
+        }                                                                     \
+        goto next_block;                                                      \
+    } while (0)
+
+    count = 0;
+next_block:
+    if (unlikely(s->stop & stop_error))
+    {
+        s->cpu = cpu;
+        if (get_error_exit(s))
+            return;
+    }
+    // Continue the block if an error was ignored
+    if (count && !s->stop)
+    {
+        d++;
+        DISPATCH;
+    }
+    d = RUN_FIND(s, c, &count);
+    if (d)
+        DISPATCH;
+    s->cpu = cpu;
+    d = RUN_NEXT(s, &tmp, &count);
+    if (!d)
+        return;
+    cpu = s->cpu;
+    DISPATCH;
+
+#define OP(n, code) op_##n: code; NEXT_INS;
+#include "sim65_ops.h"
+#undef OP
+
+    // Fused sequences execute the first instruction alone if the check fails
+#define FUSE(name, text, i1, i2, i3, check, code)                             \
+fuse_##name:                                                                  \
+    if (RUN_PROF || !(check))                                                 \
+        goto *optab[d->ins];                                                  \
+    s->fuse_count[fuse_##name]++;                                             \
+    code;                                                                     \
+    NEXT_INS;
+#include "sim65_fuse.h"
+#undef FUSE
+
+op_invalid:
+    set_error(s, sim65_err_invalid_ins, c->r.pc - 1);
+    NEXT_INS;
+#undef NEXT_INS
+#undef DISPATCH
+}
+
+#endif // SIM65_THREADED
+
+#undef RUN_NEXT
+#undef RUN_FIND
+#undef RUN_NAME
+#undef RUN_MODE
+#undef RUN_PROF
+#undef RUN_LIMIT
+#undef RUN_TRACE
@@ -0,0 +1,58 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+// Converts a binary trace, from "my6502sim -B", to the text trace format.
+
+#include "sim65.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char **argv)
+{
+    FILE *in = stdin;
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-' && argv[1][1]))
+    {
+        fprintf(stderr, "Usage: %s [trace.bin]\n"
+                        "Writes the binary trace file, or the standard input,"
+                        " as text to the standard output.\n", argv[0]);
+        return 1;
+    }
+    if (argc == 2 && argv[1][0] != '-' && !(in = fopen(argv[1], "rb")))
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    sim65 s = sim65_new();
+    if (!s)
+    {
+        fprintf(stderr, "%s: internal error.\n", argv[0]);
+        return 1;
+    }
+    int e = sim65_trace_decode(s, in, stdout);
+    sim65_free(s);
+    if (in != stdin)
+        fclose(in);
+    if (e)
+    {
+        fprintf(stderr, "%s: invalid trace file.\n", argv[0]);
+        return 1;
+    }
+    return 0;
+}